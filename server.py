@@ -11,6 +11,7 @@ import sys
 import threading
 import time
 import traceback
+import zlib
 is_py2 = sys.version[0] == '2'
 if is_py2:
     import Queue as queue
@@ -49,6 +50,8 @@ ADD = 'F'
 AUTHENTICATE = 'A'
 BLOCK = 'B'
 CHUNK = 'C'
+CHUNKS = 'c'
+COMPRESS = 'Z'
 DISCONNECT = 'D'
 EVENT = 'v'
 EXTRA = 'e'
@@ -57,6 +60,7 @@ KEY = 'K'
 LIGHT = 'L'
 NICK = 'N'
 OPTION = 'O'
+PING = 'p'
 POSITION = 'P'
 PQ = 'Q'
 REDRAW = 'R'
@@ -70,6 +74,51 @@ TRANSFORM = 't'
 VERSION = 'V'
 YOU = 'U'
 
+# Protocol version 3 sends binary messages to the client, see protocol.h
+PROTOCOL_VERSION = 3
+MSG_TEXT = 0
+MSG_EDIT = 1
+MSG_CHUNK_LAYER = 2
+MSG_KEY = 3
+MSG_REDRAW = 4
+MSG_CHUNK = 5
+MSG_DEFLATE = 6
+MAX_MESSAGE_SIZE = 524288
+# Entries per chunk layer message, keeping messages well under the
+# client's MAX_MESSAGE_SIZE
+MAX_LAYER_ENTRIES = 16384
+# Chunk replies to clients that asked for compression, see COMPRESS
+COMPRESS_LEVEL = 6
+COMPRESS_MIN_SIZE = 256
+# Edits are only sent to clients that asked for their chunk. Chunks further
+# than this from all of a client's players are forgotten, so it should be
+# above the delete radius of the clients.
+INTEREST_RADIUS = 32
+# Seconds between updates of a player in a chunk the other client does not
+# have
+FAR_POSITION_INTERVAL = 1.0
+# Chunks asked for with CHUNKS are only sent while less than this many bytes
+# wait to be sent to the client, so later priorities still count
+CHUNK_SEND_WINDOW = 262144
+# Seconds between looking for clients ready for more chunks
+CHUNK_WAIT = 0.01
+# CSV file the counts of /netstats are added to every NETSTATS_INTERVAL
+# seconds, None to not write them
+NETSTATS_PATH = None
+NETSTATS_INTERVAL = 60
+LAYERS = {BLOCK: 0, EXTRA: 1, SHAPE: 2, TRANSFORM: 3, LIGHT: 4}
+
+# Tables sent in reply to a chunk request, only rows changed since the
+# revision given as the client's key are sent
+CHUNK_TABLES = (
+    (BLOCK, 'block'),
+    (EXTRA, 'extra'),
+    (LIGHT, 'light'),
+    (SHAPE, 'shape'),
+    (TRANSFORM, 'transform'),
+)
+REVISION_TABLES = ('block', 'extra', 'light', 'shape', 'transform', 'sign')
+
 worldgen = ""
 
 try:
@@ -90,6 +139,63 @@ def chunked(x):
 def packet(*args):
     return '%s\n' % ','.join(map(str, args))
 
+def put_varint(buf, value):
+    value = (value << 1) ^ (value >> 63)  # zigzag
+    while value > 0x7f:
+        buf.append((value & 0x7f) | 0x80)
+        value >>= 7
+    buf.append(value)
+
+def framed(body):
+    buf = bytearray()
+    size = len(body)
+    while size > 0x7f:
+        buf.append((size & 0x7f) | 0x80)
+        size >>= 7
+    buf.append(size)
+    return bytes(buf + body)
+
+def message(msg_type, *fields):
+    body = bytearray([msg_type])
+    for value in fields:
+        put_varint(body, int(value))
+    return framed(body)
+
+def text_message(*args):
+    line = ','.join(map(str, args))
+    body = bytearray([MSG_TEXT])
+    body.extend(line if is_py2 else line.encode('utf-8'))
+    return framed(body)
+
+def encode_message(command, *args):
+    if command in LAYERS and len(args) == 6:
+        p, q, x, y, z, w = map(int, args)
+        return message(MSG_EDIT, LAYERS[command], p, q,
+                       x - p * CHUNK_SIZE, y, z - q * CHUNK_SIZE, w)
+    if command == KEY:
+        return message(MSG_KEY, *args)
+    if command == REDRAW:
+        return message(MSG_REDRAW, *args)
+    if command == CHUNK:
+        return message(MSG_CHUNK, *args)
+    return text_message(command, *args)
+
+def chunk_layer_messages(command, p, q, rows):
+    result = []
+    for start in range(0, len(rows), MAX_LAYER_ENTRIES):
+        part = rows[start:start + MAX_LAYER_ENTRIES]
+        body = bytearray([MSG_CHUNK_LAYER])
+        for value in (LAYERS[command], p, q, len(part)):
+            put_varint(body, value)
+        bx, bz = p * CHUNK_SIZE, q * CHUNK_SIZE
+        for x, y, z, w in part:
+            put_varint(body, x - bx)
+            put_varint(body, y)
+            put_varint(body, z - bz)
+            put_varint(body, w)
+        result.append(framed(body))
+    return result
+
 class RateLimiter(object):
     def __init__(self, rate, per):
         self.rate = float(rate)
@@ -127,11 +233,20 @@ class Handler(socketserver.BaseRequestHandler):
         self.position_limiter = RateLimiter(100, 5)
         self.limiter = RateLimiter(1000, 10)
         self.version = None
+        self.compress = False
+        self.raw_bytes = 0
+        self.compressed_bytes = 0
+        self.compress_time = 0
         self.client_id = None
         self.user_id = None
         self.queue = queue.Queue()
+        self.unsent = 0
+        self.unsent_lock = threading.Lock()
         self.running = True
         self.players = []
+        self.chunks = set()
+        self.requests = {}
+        self.position_times = {}
         self.start()
     def handle(self):
         model = self.server.model
@@ -186,38 +301,77 @@ class Handler(socketserver.BaseRequestHandler):
                         pass
                 except queue.Empty:
                     continue
-                data = ''.join(buf)
-                if is_py2:
-                    self.request.sendall(data)
-                else:
-                    self.request.sendall(bytes(data, 'utf-8'))
+                data = b''.join(buf)
+                self.request.sendall(data)
+                with self.unsent_lock:
+                    self.unsent -= len(data)
 
             except Exception:
                 self.request.close()
                 raise
     def send_raw(self, data):
         if data:
+            if not is_py2 and not isinstance(data, bytes):
+                data = bytes(data, 'utf-8')
+            with self.unsent_lock:
+                self.unsent += len(data)
             self.queue.put(data)
+    def deflate(self, data):
+        start = time.time()
+        body = zlib.compress(data, COMPRESS_LEVEL)
+        self.compress_time += time.time() - start
+        if len(body) >= min(len(data), MAX_MESSAGE_SIZE):
+            return data
+        self.raw_bytes += len(data)
+        self.compressed_bytes += len(body)
+        return framed(bytearray([MSG_DEFLATE]) + body)
+    def encode(self, *args):
+        if self.version == PROTOCOL_VERSION:
+            data = encode_message(*args)
+        else:
+            data = packet(*args)
+        self.server.model.add_sent(args[0], len(data))
+        return data
     def send(self, *args):
-        self.send_raw(packet(*args))
+        self.send_raw(self.encode(*args))
     def active_players(self):
         return [x for x in self.players if x.is_active]
+    def ready_for_chunks(self):
+        return self.requests and self.unsent < CHUNK_SEND_WINDOW
+    def interested(self, p, q):
+        return (p, q) in self.chunks
+    def forget_far_chunks(self):
+        centers = [(chunked(x.position[0]), chunked(x.position[2]))
+            for x in self.active_players()]
+        if not centers:
+            return
+        self.chunks = set(chunk for chunk in self.chunks if any(
+            max(abs(chunk[0] - p), abs(chunk[1] - q)) <= INTEREST_RADIUS
+            for p, q in centers))
 
 class Model(object):
     def __init__(self, seed):
         self.world = World(seed)
         self.clients = []
+        self.revisions = {}
         self.queue = queue.Queue()
+        # Name to [count, bytes, seconds, most seconds], commands received
+        # are named by their letter, sent ones with a "sent_" prefix
+        self.netstats = {}
+        self.last_netstats = time.time()
         self.commands = {
             ADD: self.on_add,
             AUTHENTICATE: self.on_authenticate,
             CHUNK: self.on_chunk,
+            CHUNKS: self.on_chunks,
+            COMPRESS: self.on_compress,
             BLOCK: self.on_block,
             EVENT: self.on_control_callback,
             EXTRA: self.on_extra,
             GOTO: self.on_goto,
             LIGHT: self.on_light,
             NICK: self.on_nick,
+            PING: self.on_ping,
             POSITION: self.on_position,
             PQ: self.on_pq,
             REMOVE: self.on_remove,
@@ -231,6 +385,7 @@ class Model(object):
         self.patterns = [
             (re.compile(r'^/help(?:\s+(\S+))?$'), self.on_help),
             (re.compile(r'^/list$'), self.on_list),
+            (re.compile(r'^/netstats$'), self.on_netstats),
         ]
         self.running = True
     def finish(self):
@@ -261,20 +416,71 @@ class Model(object):
             try:
                 if time.time() - self.last_commit > COMMIT_INTERVAL:
                     self.commit()
+                if (NETSTATS_PATH and
+                        time.time() - self.last_netstats > NETSTATS_INTERVAL):
+                    self.write_netstats()
                 self.dequeue()
             except Exception:
                 traceback.print_exc()
         # Commit any pending changes before exiting the thread. This will
         # prevent sqlite leaving behind a journal file.
         self.commit()
+        if NETSTATS_PATH:
+            self.write_netstats()
     def enqueue(self, func, *args, **kwargs):
         self.queue.put((func, args, kwargs))
     def dequeue(self):
+        waiting = any(x.requests for x in self.clients)
         try:
-            func, args, kwargs = self.queue.get(timeout=5)
+            func, args, kwargs = self.queue.get(
+                timeout=CHUNK_WAIT if waiting else 5)
             func(*args, **kwargs)
         except queue.Empty:
             pass
+        self.send_requested_chunks()
+    def send_requested_chunks(self):
+        # Each ready client is sent its most wanted chunk in turn, until
+        # other messages arrive that may change what is wanted
+        while self.queue.empty():
+            clients = [x for x in self.clients if x.ready_for_chunks()]
+            if not clients:
+                return
+            for client in clients:
+                (p, q), (priority, key, asked) = min(
+                    client.requests.items(), key=lambda x: x[1][0])
+                del client.requests[(p, q)]
+                start = time.time()
+                self.on_chunk(client, p, q, key)
+                self.add_stat('chunk_wait', 0, start - asked)
+                self.add_stat('chunk_reply', 0, time.time() - start)
+    def add_stat(self, name, size, elapsed):
+        stats = self.netstats.setdefault(name, [0, 0, 0.0, 0.0])
+        stats[0] += 1
+        stats[1] += size
+        stats[2] += elapsed
+        stats[3] = max(stats[3], elapsed)
+    def add_sent(self, command, size):
+        self.add_stat('sent_' + command, size, 0.0)
+    def unsent_bytes(self):
+        return sum(x.unsent for x in self.clients)
+    def write_netstats(self):
+        # Rows of time,stat,count,bytes,total_ms,max as the client writes
+        # them, send_queue has the messages waiting for the model thread and
+        # the bytes waiting to be sent to clients
+        self.last_netstats = time.time()
+        now = int(self.last_netstats)
+        try:
+            with open(NETSTATS_PATH, 'a') as f:
+                if f.tell() == 0:
+                    f.write('time,stat,count,bytes,total_ms,max\n')
+                for name, (count, size, elapsed, most) in sorted(
+                        self.netstats.items()):
+                    f.write('%d,%s,%d,%d,%.3f,%.3f\n' % (
+                        now, name, count, size, elapsed * 1000, most * 1000))
+                f.write('%d,send_queue,%d,%d,0,0\n' % (
+                    now, self.queue.qsize(), self.unsent_bytes()))
+        except IOError as e:
+            log('NETSTATS', e)
     def execute(self, *args, **kwargs):
         return self.connection.execute(*args, **kwargs)
     def commit(self):
@@ -288,7 +494,8 @@ class Model(object):
             '    x int not null,'
             '    y int not null,'
             '    z int not null,'
-            '    w int not null'
+            '    w int not null,'
+            '    rev int not null default 0'
             ');',
             'create unique index if not exists block_pqxyz_idx on '
             '    block (p, q, x, y, z);',
@@ -298,7 +505,8 @@ class Model(object):
             '    x int not null,'
             '    y int not null,'
             '    z int not null,'
-            '    w int not null'
+            '    w int not null,'
+            '    rev int not null default 0'
             ');',
             'create unique index if not exists extra_pqxyz_idx on '
             '    extra (p, q, x, y, z);',
@@ -308,7 +516,8 @@ class Model(object):
             '    x int not null,'
             '    y int not null,'
             '    z int not null,'
-            '    w int not null'
+            '    w int not null,'
+            '    rev int not null default 0'
             ');',
             'create unique index if not exists light_pqxyz_idx on '
             '    light (p, q, x, y, z);',
@@ -318,7 +527,8 @@ class Model(object):
             '    x int not null,'
             '    y int not null,'
             '    z int not null,'
-            '    w int not null'
+            '    w int not null,'
+            '    rev int not null default 0'
             ');',
             'create unique index if not exists shape_pqxyz_idx on '
             '    shape (p, q, x, y, z);',
@@ -328,7 +538,8 @@ class Model(object):
             '    x int not null,'
             '    y int not null,'
             '    z int not null,'
-            '    w int not null'
+            '    w int not null,'
+            '    rev int not null default 0'
             ');',
             'create unique index if not exists transform_pqxyz_idx on '
             '    transform (p, q, x, y, z);',
@@ -339,11 +550,32 @@ class Model(object):
             '    y int not null,'
             '    z int not null,'
             '    face int not null,'
-            '    text text not null'
+            '    text text not null,'
+            '    rev int not null default 0'
             ');',
             'create index if not exists sign_pq_idx on sign (p, q);',
             'create unique index if not exists sign_xyzface_idx on '
             '    sign (x, y, z, face);',
+            'create table if not exists sign_tombstone ('
+            '    p int not null,'
+            '    q int not null,'
+            '    x int not null,'
+            '    y int not null,'
+            '    z int not null,'
+            '    face int not null,'
+            '    rev int not null'
+            ');',
+            'create index if not exists sign_tombstone_pq_idx on '
+            '    sign_tombstone (p, q);',
+            'create unique index if not exists sign_tombstone_xyzface_idx on '
+            '    sign_tombstone (x, y, z, face);',
+            'create table if not exists revision ('
+            '    p int not null,'
+            '    q int not null,'
+            '    rev int not null'
+            ');',
+            'create unique index if not exists revision_pq_idx on '
+            '    revision (p, q);',
             'create table if not exists block_history ('
             '   timestamp real not null,'
             '   user_id int not null,'
@@ -360,6 +592,47 @@ class Model(object):
         ]
         for query in queries:
             self.execute(query)
+        self.add_revisions()
+    def add_revisions(self):
+        # Worlds saved before chunks had revisions. Clients hold the rowid of
+        # the newest block they have as their key, so blocks keep their rowid
+        # and everything else in a chunk is given a revision after it.
+        columns = [row[1] for row in self.execute('pragma table_info(block);')]
+        if 'rev' in columns:
+            return
+        log('Adding chunk revisions to the world database')
+        for table in REVISION_TABLES:
+            self.execute(
+                'alter table %s add column rev int not null default 0;' %
+                table)
+        self.execute('update block set rev = rowid;')
+        self.execute(
+            'insert into revision (p, q, rev) '
+            'select p, q, max(rowid) + 1 from block group by p, q;')
+        for table in REVISION_TABLES[1:]:
+            self.execute(
+                'insert or ignore into revision (p, q, rev) '
+                'select distinct p, q, 1 from %s;' % table)
+            self.execute(
+                'update %s set rev = (select rev from revision where '
+                'revision.p = %s.p and revision.q = %s.q);' %
+                (table, table, table))
+    def get_revision(self, p, q):
+        key = (p, q)
+        if key not in self.revisions:
+            query = 'select rev from revision where p = :p and q = :q;'
+            rows = list(self.execute(query, dict(p=p, q=q)))
+            self.revisions[key] = rows[0][0] if rows else 0
+        return self.revisions[key]
+    def next_revision(self, p, q):
+        rev = self.get_revision(p, q) + 1
+        self.revisions[(p, q)] = rev
+        query = (
+            'insert or replace into revision (p, q, rev) '
+            'values (:p, :q, :rev);'
+        )
+        self.execute(query, dict(p=p, q=q, rev=rev))
+        return rev
     def get_default_block(self, x, y, z):
         p, q = chunked(x), chunked(z)
         chunk = self.world.get_chunk(p, q)
@@ -404,22 +677,43 @@ class Model(object):
         command, args = args[0], args[1:]
         if command in self.commands:
             func = self.commands[command]
+            start = time.time()
             func(client, *args)
+            self.add_stat(command, len(data) + 1, time.time() - start)
     def on_disconnect(self, client):
         log('DISC', client.client_id, *client.client_address)
+        if client.compressed_bytes:
+            log('ZLIB', client.client_id, '%d -> %d bytes (%.1fx) in %.1fms' % (
+                client.raw_bytes, client.compressed_bytes,
+                float(client.raw_bytes) / client.compressed_bytes,
+                client.compress_time * 1000))
         self.clients.remove(client)
+        for other in self.clients:
+            for player in range(MAX_LOCAL_PLAYERS):
+                other.position_times.pop((client.client_id, player + 1), None)
         self.send_disconnect(client)
         self.send_talk('%s has disconnected from the server.' % client.players[0].nick)
     def on_version(self, client, version):
-        if client.version is not None:
-            return
         version = int(version)
-        if version != 2:
-            client.stop()
-            print("Unmatched client version:", version)
+        if client.version is None:
+            if version not in (2, PROTOCOL_VERSION):
+                client.stop()
+                print("Unmatched client version:", version)
+                return
+            client.version = 2
+            # TODO: client.start() here
+        elif version != PROTOCOL_VERSION or client.version == version:
             return
-        client.version = version
-        # TODO: client.start() here
+        if version == PROTOCOL_VERSION:
+            # Sent as text, everything after it is binary messages
+            client.send(VERSION, PROTOCOL_VERSION)
+            client.version = PROTOCOL_VERSION
+            # Signs are sent by revision only to version 3 clients, they
+            # keep their cached signs only while this is sent
+            client.send(OPTION, "sync", "revision")
+    def on_compress(self, client, method):
+        if client.version == PROTOCOL_VERSION and method == 'deflate':
+            client.compress = True
     def on_authenticate(self, client, username, access_token):
         user_id = None
         #if username and access_token:
@@ -441,68 +735,75 @@ class Model(object):
     def on_chunk(self, client, p, q, key=0):
         packets = []
         p, q, key = map(int, (p, q, key))
-        query = (
-            'select rowid, x, y, z, w from block where '
-            'p = :p and q = :q and rowid > :key;'
-        )
-        rows = self.execute(query, dict(p=p, q=q, key=key))
-        max_rowid = 0
-        blocks = 0
-        for rowid, x, y, z, w in rows:
-            blocks += 1
-            packets.append(packet(BLOCK, p, q, x, y, z, w))
-            max_rowid = max(max_rowid, rowid)
-        query = (
-            'select rowid, x, y, z, w from extra where '
-            'p = :p and q = :q and rowid > :key;'
-        )
-        rows = self.execute(query, dict(p=p, q=q, key=key))
-        extras = 0
-        for rowid, x, y, z, w in rows:
-            extras += 1
-            packets.append(packet(EXTRA, p, q, x, y, z, w))
-        query = (
-            'select x, y, z, w from light where '
-            'p = :p and q = :q;'
-        )
-        rows = self.execute(query, dict(p=p, q=q))
-        lights = 0
-        for x, y, z, w in rows:
-            lights += 1
-            packets.append(packet(LIGHT, p, q, x, y, z, w))
-        query = (
-            'select rowid, x, y, z, w from shape where '
-            'p = :p and q = :q and rowid > :key;'
-        )
-        rows = self.execute(query, dict(p=p, q=q, key=key))
-        shapes = 0
-        for rowid, x, y, z, w in rows:
-            shapes += 1
-            packets.append(packet(SHAPE, p, q, x, y, z, w))
-        query = (
-            'select rowid, x, y, z, w from transform where '
-            'p = :p and q = :q and rowid > :key;'
-        )
-        rows = self.execute(query, dict(p=p, q=q, key=key))
-        transforms = 0
-        for rowid, x, y, z, w in rows:
-            transforms += 1
-            packets.append(packet(TRANSFORM, p, q, x, y, z, w))
+        client.chunks.add((p, q))
+        binary = client.version == PROTOCOL_VERSION
+        revision = self.get_revision(p, q)
+        if key > revision:
+            # The client's copy came from another world, send it all
+            key = 0
+        # Older clients drop their cached signs on every start, so they
+        # are sent all of them
+        sign_key = key if binary else 0
+        changed = False
+        for command, table in CHUNK_TABLES:
+            query = (
+                'select x, y, z, w from %s where '
+                'p = :p and q = :q and rev > :key;' % table
+            )
+            rows = list(self.execute(query, dict(p=p, q=q, key=key)))
+            if not rows:
+                continue
+            changed = True
+            if binary:
+                layers = chunk_layer_messages(command, p, q, rows)
+            else:
+                layers = [packet(command, p, q, x, y, z, w)
+                    for x, y, z, w in rows]
+            for data in layers:
+                self.add_sent(command, len(data))
+            packets.extend(layers)
+        # Removed signs go first, as a sign may have been put back since
+        if sign_key:
+            query = (
+                'select x, y, z, face from sign_tombstone where '
+                'p = :p and q = :q and rev > :key;'
+            )
+            rows = self.execute(query, dict(p=p, q=q, key=sign_key))
+            for x, y, z, face in rows:
+                changed = True
+                packets.append(client.encode(SIGN, p, q, x, y, z, face, ''))
         query = (
             'select x, y, z, face, text from sign where '
-            'p = :p and q = :q;'
+            'p = :p and q = :q and rev > :key;'
         )
-        rows = self.execute(query, dict(p=p, q=q))
-        signs = 0
+        rows = self.execute(query, dict(p=p, q=q, key=sign_key))
         for x, y, z, face, text in rows:
-            signs += 1
-            packets.append(packet(SIGN, p, q, x, y, z, face, text))
-        if blocks:
-            packets.append(packet(KEY, p, q, max_rowid))
-        if blocks or extras or lights or shapes or signs or transforms:
-            packets.append(packet(REDRAW, p, q))
-        packets.append(packet(CHUNK, p, q))
-        client.send_raw(''.join(packets))
+            changed = True
+            packets.append(client.encode(SIGN, p, q, x, y, z, face, text))
+        if revision > key:
+            packets.append(client.encode(KEY, p, q, revision))
+        if changed:
+            packets.append(client.encode(REDRAW, p, q))
+        packets.append(client.encode(CHUNK, p, q))
+        if binary:
+            data = b''.join(packets)
+            if client.compress and len(data) >= COMPRESS_MIN_SIZE:
+                data = client.deflate(data)
+            client.send_raw(data)
+        else:
+            client.send_raw(''.join(packets))
+    def on_chunks(self, client, *args):
+        # Groups of p, q, key and priority, a negative priority cancels
+        values = list(map(int, args))
+        for i in range(0, len(values) - 3, 4):
+            p, q, key, priority = values[i:i + 4]
+            if priority < 0:
+                client.requests.pop((p, q), None)
+            else:
+                asked = client.requests.get((p, q), (0, 0, time.time()))[2]
+                client.requests[(p, q)] = (priority, key, asked)
+    def on_ping(self, client, *args):
+        client.send(PING, *args)
     def on_block(self, client, x, y, z, w):
         x, y, z, w = map(int, (x, y, z, w))
         p, q = chunked(x), chunked(z)
@@ -533,10 +834,11 @@ class Model(object):
             self.execute(query, dict(timestamp=time.time(),
                 user_id=client.user_id, x=x, y=y, z=z, w=w))
         query = (
-            'insert or replace into block (p, q, x, y, z, w) '
-            'values (:p, :q, :x, :y, :z, :w);'
+            'insert or replace into block (p, q, x, y, z, w, rev) '
+            'values (:p, :q, :x, :y, :z, :w, :rev);'
         )
-        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w))
+        rev = self.next_revision(p, q)
+        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w, rev=rev))
         self.send_block(client, p, q, x, y, z, w)
         for dx in (-1, 0, 1):
             for dz in (-1, 0, 1):
@@ -547,34 +849,42 @@ class Model(object):
                 if dz and chunked(z + dz) == q:
                     continue
                 np, nq = p + dx, q + dz
-                self.execute(query, dict(p=np, q=nq, x=x, y=y, z=z, w=-w))
+                self.execute(query, dict(p=np, q=nq, x=x, y=y, z=z, w=-w,
+                    rev=self.next_revision(np, nq)))
                 self.send_block(client, np, nq, x, y, z, -w)
         if w == 0:
             query = (
-                'delete from sign where '
+                'insert or replace into sign_tombstone '
+                '(p, q, x, y, z, face, rev) '
+                'select p, q, x, y, z, face, :rev from sign where '
                 'x = :x and y = :y and z = :z;'
             )
-            self.execute(query, dict(x=x, y=y, z=z))
+            self.execute(query, dict(x=x, y=y, z=z, rev=rev))
             query = (
-                'update extra set w = 0 where '
+                'delete from sign where '
                 'x = :x and y = :y and z = :z;'
             )
             self.execute(query, dict(x=x, y=y, z=z))
             query = (
-                'update light set w = 0 where '
-                'x = :x and y = :y and z = :z;'
+                'update extra set w = 0, rev = :rev where '
+                'p = :p and q = :q and x = :x and y = :y and z = :z;'
             )
-            self.execute(query, dict(x=x, y=y, z=z))
+            self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, rev=rev))
             query = (
-                'update shape set w = 0 where '
-                'x = :x and y = :y and z = :z;'
+                'update light set w = 0, rev = :rev where '
+                'p = :p and q = :q and x = :x and y = :y and z = :z;'
             )
-            self.execute(query, dict(x=x, y=y, z=z))
+            self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, rev=rev))
             query = (
-                'update transform set w = 0 where '
-                'x = :x and y = :y and z = :z;'
+                'update shape set w = 0, rev = :rev where '
+                'p = :p and q = :q and x = :x and y = :y and z = :z;'
             )
-            self.execute(query, dict(x=x, y=y, z=z))
+            self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, rev=rev))
+            query = (
+                'update transform set w = 0, rev = :rev where '
+                'p = :p and q = :q and x = :x and y = :y and z = :z;'
+            )
+            self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, rev=rev))
     def on_extra(self, client, x, y, z, w):
         x, y, z, w = map(int, (x, y, z, w))
         p, q = chunked(x), chunked(z)
@@ -592,10 +902,11 @@ class Model(object):
             client.send(TALK, message)
             return
         query = (
-            'insert or replace into extra (p, q, x, y, z, w) '
-            'values (:p, :q, :x, :y, :z, :w);'
+            'insert or replace into extra (p, q, x, y, z, w, rev) '
+            'values (:p, :q, :x, :y, :z, :w, :rev);'
         )
-        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w))
+        rev = self.next_revision(p, q)
+        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w, rev=rev))
         self.send_extra(client, p, q, x, y, z, w)
     def on_light(self, client, x, y, z, w):
         x, y, z, w = map(int, (x, y, z, w))
@@ -614,10 +925,11 @@ class Model(object):
             client.send(TALK, message)
             return
         query = (
-            'insert or replace into light (p, q, x, y, z, w) '
-            'values (:p, :q, :x, :y, :z, :w);'
+            'insert or replace into light (p, q, x, y, z, w, rev) '
+            'values (:p, :q, :x, :y, :z, :w, :rev);'
         )
-        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w))
+        rev = self.next_revision(p, q)
+        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w, rev=rev))
         self.send_light(client, p, q, x, y, z, w)
     def on_shape(self, client, x, y, z, w):
         x, y, z, w = map(int, (x, y, z, w))
@@ -636,10 +948,11 @@ class Model(object):
             client.send(TALK, message)
             return
         query = (
-            'insert or replace into shape (p, q, x, y, z, w) '
-            'values (:p, :q, :x, :y, :z, :w);'
+            'insert or replace into shape (p, q, x, y, z, w, rev) '
+            'values (:p, :q, :x, :y, :z, :w, :rev);'
         )
-        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w))
+        rev = self.next_revision(p, q)
+        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w, rev=rev))
         self.send_shape(client, p, q, x, y, z, w)
     def on_transform(self, client, x, y, z, w):
         x, y, z, w = map(int, (x, y, z, w))
@@ -658,10 +971,11 @@ class Model(object):
             client.send(TALK, message)
             return
         query = (
-            'insert or replace into transform (p, q, x, y, z, w) '
-            'values (:p, :q, :x, :y, :z, :w);'
+            'insert or replace into transform (p, q, x, y, z, w, rev) '
+            'values (:p, :q, :x, :y, :z, :w, :rev);'
         )
-        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w))
+        rev = self.next_revision(p, q)
+        self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w, rev=rev))
         self.send_transform(client, p, q, x, y, z, w)
     def on_sign(self, client, x, y, z, face, *args):
         if AUTH_REQUIRED and client.user_id is None:
@@ -677,14 +991,22 @@ class Model(object):
             text = text[:MAX_SIGN_LENGTH-1]
             print("Truncating long sign text.")
         p, q = chunked(x), chunked(z)
+        rev = self.next_revision(p, q)
         if text:
             query = (
-                'insert or replace into sign (p, q, x, y, z, face, text) '
-                'values (:p, :q, :x, :y, :z, :face, :text);'
+                'insert or replace into sign (p, q, x, y, z, face, text, rev) '
+                'values (:p, :q, :x, :y, :z, :face, :text, :rev);'
             )
             self.execute(query,
-                dict(p=p, q=q, x=x, y=y, z=z, face=face, text=text))
+                dict(p=p, q=q, x=x, y=y, z=z, face=face, text=text, rev=rev))
         else:
+            query = (
+                'insert or replace into sign_tombstone '
+                '(p, q, x, y, z, face, rev) '
+                'values (:p, :q, :x, :y, :z, :face, :rev);'
+            )
+            self.execute(query,
+                dict(p=p, q=q, x=x, y=y, z=z, face=face, rev=rev))
             query = (
                 'delete from sign where '
                 'x = :x and y = :y and z = :z and face = :face;'
@@ -694,7 +1016,10 @@ class Model(object):
     def on_position(self, client, player, x, y, z, rx, ry):
         player = int(player)
         x, y, z, rx, ry = map(float, (x, y, z, rx, ry))
+        previous = client.players[player - 1].position
         client.players[player - 1].position = (x, y, z, rx, ry)
+        if (chunked(x), chunked(z)) != (chunked(previous[0]), chunked(previous[2])):
+            client.forget_far_chunks()
         self.send_position(client, player)
     def on_add(self, client, player):
         player = int(player)
@@ -772,7 +1097,7 @@ class Model(object):
     def on_help(self, client, topic=None):
         if topic is None:
             client.send(TALK, 'Type "t" to chat. Type "/" to type commands:')
-            client.send(TALK, '/goto [NAME], /help [TOPIC], /list, /login NAME, /logout, /nick')
+            client.send(TALK, '/goto [NAME], /help [TOPIC], /list, /login NAME, /logout, /netstats, /nick')
             client.send(TALK, '/offline [FILE], /online HOST [PORT], /pq P Q, /spawn, /view N')
             return
         topic = topic.lower().strip()
@@ -798,6 +1123,9 @@ class Model(object):
         elif topic == 'online':
             client.send(TALK, 'Help: /online HOST [PORT]')
             client.send(TALK, 'Connect to the specified server.')
+        elif topic == 'netstats':
+            client.send(TALK, 'Help: /netstats')
+            client.send(TALK, 'Show counts of network traffic and the time taken to handle it.')
         elif topic == 'nick':
             client.send(TALK, 'Help: /nick [NICK]')
             client.send(TALK, 'Get or set your nickname.')
@@ -815,6 +1143,18 @@ class Model(object):
         for c in self.clients:
             players.extend(x.nick for x in c.active_players())
         client.send(TALK, 'Players: %s' % ', '.join(players))
+    def on_netstats(self, client):
+        wait = self.netstats.get('chunk_wait', [0, 0, 0.0, 0.0])
+        client.send(TALK, 'Server: %d clients, %d messages queued, '
+            '%d KB unsent, chunks waited %.1f ms (%.1f max)' % (
+            len(self.clients), self.queue.qsize(), self.unsent_bytes() / 1024,
+            wait[2] * 1000 / max(wait[0], 1), wait[3] * 1000))
+        received = [(k, v) for k, v in self.netstats.items()
+            if not k.startswith('sent_') and k != 'chunk_wait']
+        received.sort(key=lambda x: x[1][2], reverse=True)
+        client.send(TALK, 'Server: %s' % ', '.join(
+            '%s %d in %.1f ms' % (k, v[0], v[2] * 1000)
+            for k, v in received[:4]))
     def on_control_callback(self, client, player, x, y, z, face):
         print("Control callback: ", player, x, y, z, face)
     def send_positions(self, client, player):
@@ -824,10 +1164,18 @@ class Model(object):
                 continue
             client.send(POSITION, other.client_id, player, *other_player.position)
     def send_position(self, client, player):
+        position = client.players[player - 1].position
+        p, q = chunked(position[0]), chunked(position[2])
+        key = (client.client_id, player)
+        now = time.time()
         for other in self.clients:
             if other == client:
                 continue
-            other.send(POSITION, client.client_id, player, *client.players[player - 1].position)
+            if not other.interested(p, q):
+                if now - other.position_times.get(key, 0) < FAR_POSITION_INTERVAL:
+                    continue
+                other.position_times[key] = now
+            other.send(POSITION, client.client_id, player, *position)
     def send_add(self, client, player):
         for other in self.clients:
             if other == client:
@@ -867,42 +1215,29 @@ class Model(object):
             if other == client:
                 continue
             other.send(DISCONNECT, client.client_id)
-    def send_block(self, client, p, q, x, y, z, w):
+    def send_edit(self, client, command, p, q, *args):
+        # The client making the edit has already applied it, it only needs
+        # the new revision of the chunk
+        rev = self.get_revision(p, q)
         for other in self.clients:
-            if other == client:
+            if not other.interested(p, q):
                 continue
-            other.send(BLOCK, p, q, x, y, z, w)
-            other.send(REDRAW, p, q)
+            if other != client:
+                other.send(command, p, q, *args)
+                other.send(REDRAW, p, q)
+            other.send(KEY, p, q, rev)
+    def send_block(self, client, p, q, x, y, z, w):
+        self.send_edit(client, BLOCK, p, q, x, y, z, w)
     def send_extra(self, client, p, q, x, y, z, w):
-        for other in self.clients:
-            if other == client:
-                continue
-            other.send(EXTRA, p, q, x, y, z, w)
-            other.send(REDRAW, p, q)
+        self.send_edit(client, EXTRA, p, q, x, y, z, w)
     def send_light(self, client, p, q, x, y, z, w):
-        for other in self.clients:
-            if other == client:
-                continue
-            other.send(LIGHT, p, q, x, y, z, w)
-            other.send(REDRAW, p, q)
+        self.send_edit(client, LIGHT, p, q, x, y, z, w)
     def send_shape(self, client, p, q, x, y, z, w):
-        for other in self.clients:
-            if other == client:
-                continue
-            other.send(SHAPE, p, q, x, y, z, w)
-            other.send(REDRAW, p, q)
+        self.send_edit(client, SHAPE, p, q, x, y, z, w)
     def send_transform(self, client, p, q, x, y, z, w):
-        for other in self.clients:
-            if other == client:
-                continue
-            other.send(TRANSFORM, p, q, x, y, z, w)
-            other.send(REDRAW, p, q)
+        self.send_edit(client, TRANSFORM, p, q, x, y, z, w)
     def send_sign(self, client, p, q, x, y, z, face, text):
-        for other in self.clients:
-            if other == client:
-                continue
-            other.send(SIGN, p, q, x, y, z, face, text)
-            other.send(REDRAW, p, q)
+        self.send_edit(client, SIGN, p, q, x, y, z, face, text)
     def send_talk(self, text):
         log(text)
         for client in self.clients:
@@ -0,0 +1,9 @@
+precision highp float;
+
+uniform sampler2D sampler;
+
+varying vec2 fragment_uv;
+
+void main() {
+    gl_FragColor = vec4(vec3(texture2D(sampler, fragment_uv)), 1.0);
+}
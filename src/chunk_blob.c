@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <string.h>
+#include "chunk_blob.h"
+#include "config.h"
+
+/*
+ * Encoded chunk format, all integers little endian:
+ *
+ *   "PWB" version(u8)
+ *   for each of the CHUNK_BLOB_LAYERS layers:
+ *     count(u32), then count entries of dx(u8) y(u8) dz(u8) w(s16)
+ *   sign count(u16), then for each sign:
+ *     dx(u8) y(u8) dz(u8) face(u8) length(u16) text(length bytes)
+ *
+ * dx and dz are relative to the chunk's map origin (p * CHUNK_SIZE - 1), so
+ * they cover the one block border kept around each chunk. Entries are stored
+ * sorted by (x, y, z) and entries with w = 0 are kept, as they record
+ * blocks that were removed from the generated world.
+ */
+
+#define BLOB_VERSION 1
+#define BLOB_HEADER_SIZE 4
+#define BLOB_ENTRY_SIZE 5
+
+void chunk_blob_alloc(ChunkBlob *blob) {
+    memset(blob, 0, sizeof(ChunkBlob));
+    sign_list_alloc(&blob->signs, 16);
+}
+
+void chunk_blob_free(ChunkBlob *blob) {
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        free(blob->layers[i].data);
+    }
+    sign_list_free(&blob->signs);
+    memset(blob, 0, sizeof(ChunkBlob));
+}
+
+void chunk_blob_clear(ChunkBlob *blob) {
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        blob->layers[i].size = 0;
+    }
+    blob->signs.size = 0;
+}
+
+int chunk_blob_empty(ChunkBlob *blob) {
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        if (blob->layers[i].size) {
+            return 0;
+        }
+    }
+    return blob->signs.size == 0;
+}
+
+static BlobEntry *blob_layer_insert(BlobLayer *layer, unsigned int index) {
+    if (layer->size == layer->capacity) {
+        layer->capacity = layer->capacity ? layer->capacity * 2 : 64;
+        layer->data = realloc(layer->data,
+                              sizeof(BlobEntry) * layer->capacity);
+    }
+    memmove(layer->data + index + 1, layer->data + index,
+            sizeof(BlobEntry) * (layer->size - index));
+    layer->size++;
+    return layer->data + index;
+}
+
+void chunk_blob_add(ChunkBlob *blob, int layer, int x, int y, int z, int w) {
+    BlobLayer *l = blob->layers + layer;
+    BlobEntry *e = blob_layer_insert(l, l->size);
+    e->x = x;
+    e->y = y;
+    e->z = z;
+    e->w = w;
+}
+
+static int blob_entry_cmp(const void *a, const void *b) {
+    const BlobEntry *ea = a;
+    const BlobEntry *eb = b;
+    if (ea->x != eb->x) return ea->x < eb->x ? -1 : 1;
+    if (ea->y != eb->y) return ea->y < eb->y ? -1 : 1;
+    if (ea->z != eb->z) return ea->z < eb->z ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Insert or replace an entry, keeping the layer sorted. The layer must
+ * already be sorted, as it is after chunk_blob_decode.
+ */
+void chunk_blob_set(ChunkBlob *blob, int layer, int x, int y, int z, int w) {
+    BlobLayer *l = blob->layers + layer;
+    BlobEntry key = {x, y, z, w};
+    unsigned int lo = 0;
+    unsigned int hi = l->size;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        int cmp = blob_entry_cmp(l->data + mid, &key);
+        if (cmp == 0) {
+            l->data[mid].w = w;
+            return;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *blob_layer_insert(l, lo) = key;
+}
+
+void chunk_blob_add_map(ChunkBlob *blob, int layer, Map *map) {
+    MAP_FOR_EACH(map, ex, ey, ez, ew) {
+        chunk_blob_add(blob, layer, ex, ey, ez, ew);
+    } END_MAP_FOR_EACH;
+}
+
+static void put_u16(unsigned char *b, int v) {
+    b[0] = v & 0xff;
+    b[1] = (v >> 8) & 0xff;
+}
+
+static void put_u32(unsigned char *b, unsigned int v) {
+    put_u16(b, v & 0xffff);
+    put_u16(b + 2, v >> 16);
+}
+
+static int get_u16(const unsigned char *b) {
+    return b[0] | (b[1] << 8);
+}
+
+static unsigned int get_u32(const unsigned char *b) {
+    return get_u16(b) | ((unsigned int)get_u16(b + 2) << 16);
+}
+
+/*
+ * Encode the blob into a newly allocated buffer, which the caller frees.
+ * Entries that do not fit the chunk (p, q) are dropped.
+ */
+unsigned char *chunk_blob_encode(ChunkBlob *blob, int p, int q, int *size) {
+    int dx = p * CHUNK_SIZE - 1;
+    int dz = q * CHUNK_SIZE - 1;
+    int max_size = BLOB_HEADER_SIZE + CHUNK_BLOB_LAYERS * 4 + 2;
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        max_size += blob->layers[i].size * BLOB_ENTRY_SIZE;
+    }
+    for (unsigned int i = 0; i < blob->signs.size; i++) {
+        max_size += 6 + strlen(blob->signs.data[i].text);
+    }
+    unsigned char *data = malloc(max_size);
+    unsigned char *b = data;
+    *b++ = 'P';
+    *b++ = 'W';
+    *b++ = 'B';
+    *b++ = BLOB_VERSION;
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        BlobLayer *l = blob->layers + i;
+        qsort(l->data, l->size, sizeof(BlobEntry), blob_entry_cmp);
+        unsigned char *count_pos = b;
+        unsigned int count = 0;
+        b += 4;
+        for (unsigned int j = 0; j < l->size; j++) {
+            BlobEntry *e = l->data + j;
+            int ex = e->x - dx;
+            int ez = e->z - dz;
+            if (ex < 0 || ex > 255 || ez < 0 || ez > 255 ||
+                e->y < 0 || e->y > 255) {
+                continue;
+            }
+            b[0] = ex;
+            b[1] = e->y;
+            b[2] = ez;
+            put_u16(b + 3, e->w);
+            b += BLOB_ENTRY_SIZE;
+            count++;
+        }
+        put_u32(count_pos, count);
+    }
+    unsigned char *count_pos = b;
+    int sign_count = 0;
+    b += 2;
+    for (unsigned int i = 0; i < blob->signs.size; i++) {
+        Sign *e = blob->signs.data + i;
+        int ex = e->x - dx;
+        int ez = e->z - dz;
+        if (ex < 0 || ex > 255 || ez < 0 || ez > 255 ||
+            e->y < 0 || e->y > 255 || sign_count == 0xffff) {
+            continue;
+        }
+        int length = strlen(e->text);
+        b[0] = ex;
+        b[1] = e->y;
+        b[2] = ez;
+        b[3] = e->face;
+        put_u16(b + 4, length);
+        memcpy(b + 6, e->text, length);
+        b += 6 + length;
+        sign_count++;
+    }
+    put_u16(count_pos, sign_count);
+    *size = b - data;
+    return data;
+}
+
+/*
+ * Walk an encoded blob, calling the given functions for each layer entry
+ * and each sign. Returns 0 on success or -1 if the data is malformed.
+ */
+typedef int (*blob_entry_func)(void *arg, int layer, int x, int y, int z,
+                               int w);
+typedef void (*blob_sign_func)(void *arg, int x, int y, int z, int face,
+                               const char *text);
+
+static int blob_walk(
+    const unsigned char *data, int size, int p, int q, void *arg,
+    unsigned int layer_mask, blob_entry_func entry_func,
+    blob_sign_func sign_func)
+{
+    int dx = p * CHUNK_SIZE - 1;
+    int dz = q * CHUNK_SIZE - 1;
+    if (size < BLOB_HEADER_SIZE || data[0] != 'P' || data[1] != 'W' ||
+        data[2] != 'B' || data[3] != BLOB_VERSION) {
+        return -1;
+    }
+    const unsigned char *b = data + BLOB_HEADER_SIZE;
+    const unsigned char *end = data + size;
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        if (end - b < 4) {
+            return -1;
+        }
+        unsigned int count = get_u32(b);
+        b += 4;
+        if ((unsigned int)(end - b) / BLOB_ENTRY_SIZE < count) {
+            return -1;
+        }
+        if (!(layer_mask & (1 << i)) || !entry_func) {
+            b += count * BLOB_ENTRY_SIZE;
+            continue;
+        }
+        for (unsigned int j = 0; j < count; j++) {
+            if (entry_func(arg, i, b[0] + dx, b[1], b[2] + dz,
+                           (short)get_u16(b + 3))) {
+                return 0;
+            }
+            b += BLOB_ENTRY_SIZE;
+        }
+    }
+    if (!sign_func) {
+        return 0;
+    }
+    if (end - b < 2) {
+        return -1;
+    }
+    int sign_count = get_u16(b);
+    b += 2;
+    for (int i = 0; i < sign_count; i++) {
+        if (end - b < 6) {
+            return -1;
+        }
+        int length = get_u16(b + 4);
+        if (end - b - 6 < length) {
+            return -1;
+        }
+        char text[MAX_SIGN_LENGTH];
+        int n = length < MAX_SIGN_LENGTH ? length : MAX_SIGN_LENGTH - 1;
+        memcpy(text, b + 6, n);
+        text[n] = '\0';
+        sign_func(arg, b[0] + dx, b[1], b[2] + dz, b[3], text);
+        b += 6 + length;
+    }
+    return 0;
+}
+
+static int decode_entry(void *arg, int layer, int x, int y, int z, int w) {
+    chunk_blob_add(arg, layer, x, y, z, w);
+    return 0;
+}
+
+static void decode_sign(void *arg, int x, int y, int z, int face,
+                        const char *text)
+{
+    ChunkBlob *blob = arg;
+    sign_list_add(&blob->signs, x, y, z, face, text);
+}
+
+int chunk_blob_decode(
+    ChunkBlob *blob, int p, int q, const unsigned char *data, int size)
+{
+    chunk_blob_clear(blob);
+    return blob_walk(data, size, p, q, blob, ~0u, decode_entry, decode_sign);
+}
+
+static int load_maps_entry(void *arg, int layer, int x, int y, int z, int w) {
+    Map **maps = arg;
+    map_set(maps[layer], x, y, z, w);
+    return 0;
+}
+
+int chunk_blob_load_maps(
+    const unsigned char *data, int size, int p, int q, Map **maps)
+{
+    return blob_walk(data, size, p, q, maps, ~0u, load_maps_entry, NULL);
+}
+
+static void load_sign(void *arg, int x, int y, int z, int face,
+                      const char *text)
+{
+    sign_list_add(arg, x, y, z, face, text);
+}
+
+int chunk_blob_load_signs(
+    const unsigned char *data, int size, int p, int q, SignList *list)
+{
+    return blob_walk(data, size, p, q, list, 0, NULL, load_sign);
+}
+
+typedef struct {
+    int x;
+    int y;
+    int z;
+    int w;
+    int found;
+} BlobLookup;
+
+static int lookup_entry(void *arg, __attribute__((unused)) int layer,
+                        int x, int y, int z, int w)
+{
+    BlobLookup *lookup = arg;
+    if (x == lookup->x && y == lookup->y && z == lookup->z) {
+        lookup->w = w;
+        lookup->found = 1;
+        return 1;
+    }
+    return 0;
+}
+
+int chunk_blob_get(
+    const unsigned char *data, int size, int p, int q, int layer,
+    int x, int y, int z, int *w)
+{
+    BlobLookup lookup = {x, y, z, 0, 0};
+    if (blob_walk(data, size, p, q, &lookup, 1 << layer, lookup_entry,
+                  NULL) || !lookup.found) {
+        return 0;
+    }
+    *w = lookup.w;
+    return 1;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "map.h"
+#include "sign.h"
+
+// Layers are stored in RingEntryType order: block, extra, shape, transform,
+// light.
+#define CHUNK_BLOB_LAYERS 5
+
+typedef struct {
+    int x;
+    int y;
+    int z;
+    int w;
+} BlobEntry;
+
+typedef struct {
+    unsigned int capacity;
+    unsigned int size;
+    BlobEntry *data;
+} BlobLayer;
+
+typedef struct {
+    BlobLayer layers[CHUNK_BLOB_LAYERS];
+    SignList signs;
+} ChunkBlob;
+
+void chunk_blob_alloc(ChunkBlob *blob);
+void chunk_blob_free(ChunkBlob *blob);
+void chunk_blob_clear(ChunkBlob *blob);
+int chunk_blob_empty(ChunkBlob *blob);
+void chunk_blob_add(ChunkBlob *blob, int layer, int x, int y, int z, int w);
+void chunk_blob_set(ChunkBlob *blob, int layer, int x, int y, int z, int w);
+void chunk_blob_add_map(ChunkBlob *blob, int layer, Map *map);
+unsigned char *chunk_blob_encode(ChunkBlob *blob, int p, int q, int *size);
+int chunk_blob_decode(
+    ChunkBlob *blob, int p, int q, const unsigned char *data, int size);
+int chunk_blob_load_maps(
+    const unsigned char *data, int size, int p, int q, Map **maps);
+int chunk_blob_load_signs(
+    const unsigned char *data, int size, int p, int q, SignList *list);
+int chunk_blob_get(
+    const unsigned char *data, int size, int p, int q, int layer,
+    int x, int y, int z, int *w);
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GLES2/gl2.h>
+#include "chunk_blob.h"
+#include "chunk_cache.h"
+#include "config.h"
+#include "lodepng.h"
+#include "util.h"
+
+/*
+ * Keeps recently unloaded chunks in memory, so walking back over the
+ * delete radius does not load and generate them again. The layers and signs
+ * of each chunk are stored as a deflated chunk_blob, and optionally its GL
+ * buffer and door data are kept too so it can be drawn without meshing.
+ * Entries are found through a hash of (p, q) and kept in a list in the order
+ * they were added, the oldest are dropped when over the size limit.
+ *
+ * Only used from the main thread.
+ */
+
+#define BUCKET_COUNT 1024
+#define STATS_INTERVAL 256
+
+typedef struct CacheEntry {
+    int p;
+    int q;
+    unsigned char *data;
+    size_t size;
+    int has_mesh;
+    ChunkMesh mesh;
+    struct CacheEntry *hash_next;
+    struct CacheEntry *prev;
+    struct CacheEntry *next;
+} CacheEntry;
+
+static CacheEntry *buckets[BUCKET_COUNT];
+static CacheEntry *newest;
+static CacheEntry *oldest;
+static long long cache_size;
+static long long cache_max_size;
+static int cache_meshes;
+static int entry_count;
+static int hits;
+static int misses;
+
+static unsigned int bucket_index(int p, int q) {
+    unsigned int h = (unsigned int)p * 73856093u ^ (unsigned int)q * 19349663u;
+    return h % BUCKET_COUNT;
+}
+
+static CacheEntry **find_link(int p, int q) {
+    CacheEntry **link = buckets + bucket_index(p, q);
+    while (*link && ((*link)->p != p || (*link)->q != q)) {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+static long long entry_size(CacheEntry *e) {
+    return sizeof(CacheEntry) + e->size + (e->has_mesh ? e->mesh.size : 0);
+}
+
+static void free_mesh(CacheEntry *e) {
+    if (e->has_mesh) {
+        cache_size -= e->mesh.size;
+        del_buffer(e->mesh.buffer);
+        door_map_free(&e->mesh.doors);
+        e->has_mesh = 0;
+    }
+}
+
+static void unlink_entry(CacheEntry **link) {
+    CacheEntry *e = *link;
+    *link = e->hash_next;
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        newest = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        oldest = e->prev;
+    }
+    cache_size -= entry_size(e);
+    entry_count--;
+}
+
+static void free_entry(CacheEntry *e) {
+    free(e->data);
+    if (e->has_mesh) {
+        del_buffer(e->mesh.buffer);
+        door_map_free(&e->mesh.doors);
+    }
+    free(e);
+}
+
+static void print_stats(void) {
+    printf("chunk cache: %d hits, %d misses, %d chunks, %lld KB\n",
+           hits, misses, entry_count, cache_size / 1024);
+}
+
+static void count_lookup(int hit) {
+    if (hit) {
+        hits++;
+    } else {
+        misses++;
+    }
+    if (config->verbose && (hits + misses) % STATS_INTERVAL == 0) {
+        print_stats();
+    }
+}
+
+/*
+ * Set the size limit in bytes, 0 disables the cache. When keep_meshes is
+ * set the GL buffers of cached chunks are kept and counted in the limit.
+ */
+void chunk_cache_init(long long max_size, int keep_meshes) {
+    chunk_cache_clear();
+    cache_max_size = max_size;
+    cache_meshes = keep_meshes;
+}
+
+void chunk_cache_clear(void) {
+    if (config->verbose && hits + misses > 0) {
+        print_stats();
+    }
+    while (oldest) {
+        CacheEntry *e = oldest;
+        unlink_entry(find_link(e->p, e->q));
+        free_entry(e);
+    }
+    hits = misses = 0;
+}
+
+int chunk_cache_keeps_meshes(void) {
+    return cache_max_size > 0 && cache_meshes;
+}
+
+/*
+ * Store a chunk being unloaded, maps are in RingEntryType order. If mesh is
+ * given the cache takes ownership of its buffer and doors.
+ */
+void chunk_cache_put(int p, int q, Map **maps, SignList *signs,
+                     ChunkMesh *mesh)
+{
+    chunk_cache_remove(p, q);
+    if (cache_max_size <= 0) {
+        if (mesh) {
+            del_buffer(mesh->buffer);
+            door_map_free(&mesh->doors);
+        }
+        return;
+    }
+    ChunkBlob blob;
+    chunk_blob_alloc(&blob);
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        chunk_blob_add_map(&blob, i, maps[i]);
+    }
+    for (unsigned int i = 0; i < signs->size; i++) {
+        Sign *s = signs->data + i;
+        sign_list_add(&blob.signs, s->x, s->y, s->z, s->face, s->text);
+    }
+    int raw_size;
+    unsigned char *raw = chunk_blob_encode(&blob, p, q, &raw_size);
+    chunk_blob_free(&blob);
+
+    CacheEntry *e = calloc(1, sizeof(CacheEntry));
+    e->p = p;
+    e->q = q;
+    // Favour speed over size, this runs while the player is moving
+    LodePNGCompressSettings settings = lodepng_default_compress_settings;
+    settings.lazymatching = 0;
+    if (lodepng_zlib_compress(&e->data, &e->size, raw, raw_size, &settings)) {
+        free(raw);
+        free(e->data);
+        free(e);
+        if (mesh) {
+            del_buffer(mesh->buffer);
+            door_map_free(&mesh->doors);
+        }
+        return;
+    }
+    free(raw);
+    if (mesh) {
+        e->mesh = *mesh;
+        e->has_mesh = 1;
+    }
+
+    e->hash_next = NULL;
+    *find_link(p, q) = e;
+    e->prev = NULL;
+    e->next = newest;
+    if (newest) {
+        newest->prev = e;
+    } else {
+        oldest = e;
+    }
+    newest = e;
+    cache_size += entry_size(e);
+    entry_count++;
+
+    while (cache_size > cache_max_size && oldest) {
+        CacheEntry *old = oldest;
+        unlink_entry(find_link(old->p, old->q));
+        free_entry(old);
+    }
+}
+
+/*
+ * Move a cached chunk into maps and signs, removing it from the cache.
+ * Returns 1 on a hit. mesh->buffer is 0 unless its mesh was kept, in which
+ * case the caller owns the buffer and doors.
+ */
+int chunk_cache_take(int p, int q, Map **maps, SignList *signs,
+                     ChunkMesh *mesh)
+{
+    mesh->buffer = 0;
+    if (cache_max_size <= 0) {
+        return 0;
+    }
+    CacheEntry **link = find_link(p, q);
+    CacheEntry *e = *link;
+    if (!e) {
+        count_lookup(0);
+        return 0;
+    }
+    unlink_entry(link);
+    unsigned char *raw = NULL;
+    size_t raw_size = 0;
+    int hit = 0;
+    if (lodepng_zlib_decompress(&raw, &raw_size, e->data, e->size,
+                                &lodepng_default_decompress_settings) == 0 &&
+        chunk_blob_load_signs(raw, raw_size, p, q, signs) == 0) {
+        chunk_blob_load_maps(raw, raw_size, p, q, maps);
+        if (e->has_mesh) {
+            *mesh = e->mesh;
+            e->has_mesh = 0;
+        }
+        hit = 1;
+    }
+    free(raw);
+    free_entry(e);
+    count_lookup(hit);
+    return hit;
+}
+
+/*
+ * Drop a chunk whose saved data changed while it was not loaded.
+ */
+void chunk_cache_remove(int p, int q) {
+    CacheEntry **link = find_link(p, q);
+    if (*link) {
+        CacheEntry *e = *link;
+        unlink_entry(link);
+        free_entry(e);
+    }
+}
+
+/*
+ * Drop only the mesh of a chunk, when a neighbour change altered its look.
+ */
+void chunk_cache_drop_mesh(int p, int q) {
+    CacheEntry *e = *find_link(p, q);
+    if (e) {
+        free_mesh(e);
+    }
+}
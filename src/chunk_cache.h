@@ -0,0 +1,26 @@
+#pragma once
+
+#include <GLES2/gl2.h>
+#include "door.h"
+#include "map.h"
+#include "sign.h"
+
+// GL data of a chunk that can be kept while the chunk is not loaded.
+typedef struct {
+    GLuint buffer;
+    int faces;
+    int miny;
+    int maxy;
+    int size;
+    DoorMap doors;
+} ChunkMesh;
+
+void chunk_cache_init(long long max_size, int keep_meshes);
+void chunk_cache_clear(void);
+int chunk_cache_keeps_meshes(void);
+void chunk_cache_put(int p, int q, Map **maps, SignList *signs,
+                     ChunkMesh *mesh);
+int chunk_cache_take(int p, int q, Map **maps, SignList *signs,
+                     ChunkMesh *mesh);
+void chunk_cache_remove(int p, int q);
+void chunk_cache_drop_mesh(int p, int q);
@@ -1,24 +1,72 @@
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "client.h"
+#include "config.h"
+#include "lodepng.h"
+#include "protocol.h"
 #include "tinycthread.h"
 
+// The receive thread waits while this much data is not taken yet
 #define QUEUE_SIZE 1048576
 #define RECV_SIZE 4096
+// Queued messages are sent early once this much is waiting, and senders wait
+// while SEND_QUEUE_SIZE is
+#define SEND_FLUSH_SIZE 65536
+#define SEND_QUEUE_SIZE 1048576
+// Batched chunk requests are sent in lines of up to this size
+#define MAX_REQUEST_LINE 4096
 
 static int client_enabled = 0;
 static int running = 0;
 static int sd = 0;
-static int bytes_sent = 0;
-static int bytes_received = 0;
-static char *queue = 0;
-static int qsize = 0;
+static long long bytes_sent = 0;
+static long long bytes_received = 0;
+static int max_received_queued = 0;
+
+// Received data is added to one buffer while the main thread reads the last
+// data it took from the other, taking data swaps them.
+typedef struct {
+    char *data;
+    int size;
+    int capacity;
+} Buffer;
+
+static Buffer buffers[2];
+static Buffer *filling;
+static Buffer *reading;
+static int upgrade_requested = 0;
+static long long compressed_bytes = 0;
+static long long inflated_bytes = 0;
+static double inflate_time = 0;
+// Offset in filling where binary messages begin, -1 while the server is
+// sending text lines
+static int binary_start = -1;
 static thrd_t recv_thread;
 static mtx_t mutex;
+static cnd_t room;
+
+// Messages are added to the queued buffer by the main thread and sent from
+// the other one by the send thread, at the end of each frame.
+static Buffer send_buffers[2];
+static Buffer *queued;
+static Buffer *sending;
+static int sending_running = 0;
+static int flush_requested = 0;
+static ClientSendStats send_stats;
+static thrd_t send_thread;
+static mtx_t send_mutex;
+static cnd_t send_ready;
+static cnd_t send_room;
+static char request_line[MAX_REQUEST_LINE];
+static int request_length = 0;
 
 void client_enable() {
     client_enabled = 1;
@@ -32,6 +80,13 @@ int get_client_enabled() {
     return client_enabled;
 }
 
+static void buffer_reserve(Buffer *b, int size) {
+    if (size + 1 > b->capacity) {
+        b->capacity = size + 1 > b->capacity * 2 ? size + 1 : b->capacity * 2;
+        b->data = realloc(b->data, b->capacity);
+    }
+}
+
 int client_sendall(int sd, char *data, int length) {
     if (!client_enabled) {
         return 0;
@@ -45,18 +100,118 @@ int client_sendall(int sd, char *data, int length) {
         count += n;
         length -= n;
         bytes_sent += n;
+        mtx_lock(&send_mutex);
+        send_stats.send_calls++;
+        mtx_unlock(&send_mutex);
+    }
+    return 0;
+}
+
+int send_worker(__attribute__((unused)) void *arg) {
+    mtx_lock(&send_mutex);
+    while (sending_running || queued->size > 0) {
+        if (queued->size == 0 || (!flush_requested && sending_running)) {
+            cnd_wait(&send_ready, &send_mutex);
+            continue;
+        }
+        Buffer *b = queued;
+        queued = sending;
+        sending = b;
+        flush_requested = 0;
+        send_stats.flushes++;
+        cnd_broadcast(&send_room);
+        mtx_unlock(&send_mutex);
+        if (client_sendall(sd, sending->data, sending->size) == -1) {
+            perror("client_sendall");
+            exit(1);
+        }
+        mtx_lock(&send_mutex);
+        sending->size = 0;
     }
+    mtx_unlock(&send_mutex);
     return 0;
 }
 
+/*
+ * Queue data to be sent with the next flush, it is sent right away when a
+ * lot is queued.
+ */
 void client_send(char *data) {
     if (!client_enabled) {
         return;
     }
-    if (client_sendall(sd, data, strlen(data)) == -1) {
-        perror("client_sendall");
-        exit(1);
+    int length = strlen(data);
+    mtx_lock(&send_mutex);
+    if (queued->size >= SEND_QUEUE_SIZE) {
+        send_stats.waits++;
+        flush_requested = 1;
+        cnd_signal(&send_ready);
+        while (queued->size >= SEND_QUEUE_SIZE) {
+            cnd_wait(&send_room, &send_mutex);
+        }
+    }
+    buffer_reserve(queued, queued->size + length);
+    memcpy(queued->data + queued->size, data, length);
+    queued->size += length;
+    send_stats.messages++;
+    send_stats.bytes += length;
+    if (queued->size > send_stats.max_queued) {
+        send_stats.max_queued = queued->size;
+    }
+    if (queued->size >= SEND_FLUSH_SIZE) {
+        flush_requested = 1;
+        cnd_signal(&send_ready);
     }
+    mtx_unlock(&send_mutex);
+}
+
+static void send_chunk_requests(void) {
+    if (request_length > 0) {
+        request_line[request_length++] = '\n';
+        request_line[request_length] = '\0';
+        client_send(request_line);
+        request_length = 0;
+    }
+}
+
+// Send the messages queued so far, called once per frame.
+void client_flush(void) {
+    if (!client_enabled) {
+        return;
+    }
+    send_chunk_requests();
+    mtx_lock(&send_mutex);
+    if (queued->size > 0) {
+        flush_requested = 1;
+        cnd_signal(&send_ready);
+    }
+    mtx_unlock(&send_mutex);
+}
+
+void client_send_stats(ClientSendStats *stats) {
+    if (!client_enabled || !running) {
+        memset(stats, 0, sizeof(ClientSendStats));
+        return;
+    }
+    mtx_lock(&send_mutex);
+    *stats = send_stats;
+    stats->queued = queued->size + sending->size;
+    mtx_unlock(&send_mutex);
+}
+
+void client_recv_stats(ClientRecvStats *stats) {
+    memset(stats, 0, sizeof(ClientRecvStats));
+    if (!client_enabled || !running) {
+        return;
+    }
+    mtx_lock(&mutex);
+    stats->bytes = bytes_received;
+    stats->compressed_bytes = compressed_bytes;
+    stats->inflated_bytes = inflated_bytes;
+    stats->inflate_time = inflate_time;
+    stats->queued = filling->size;
+    stats->max_queued = max_received_queued;
+    mtx_unlock(&mutex);
 }
 
 void client_version(int version) {
@@ -66,6 +221,36 @@ void client_version(int version) {
     char buffer[1024];
     snprintf(buffer, 1024, "V,%d\n", version);
     client_send(buffer);
+    if (version >= PROTOCOL_VERSION) {
+        upgrade_requested = 1;
+    }
+}
+
+/*
+ * Return the protocol version the server agreed to, 2 until it answers a
+ * request for version 3.
+ */
+int client_server_version(void) {
+    if (!client_enabled) {
+        return 0;
+    }
+    mtx_lock(&mutex);
+    int version = binary_start >= 0 ? PROTOCOL_VERSION : 2;
+    mtx_unlock(&mutex);
+    return version;
+}
+
+/*
+ * Tell the server that chunk replies can be compressed with method, it is
+ * only used once protocol version 3 has been agreed.
+ */
+void client_compress(const char *method) {
+    if (!client_enabled) {
+        return;
+    }
+    char buffer[1024];
+    snprintf(buffer, 1024, "Z,%s\n", method);
+    client_send(buffer);
 }
 
 void client_login(const char *username, const char *identity_token) {
@@ -150,6 +335,41 @@ void client_chunk(int p, int q, int key) {
     client_send(buffer);
 }
 
+/*
+ * Ask for chunk (p, q) in a batch with the other requests of this frame, the
+ * server answers lower priorities first. Asking again for a chunk not
+ * answered yet changes its priority, a negative priority cancels it. Only
+ * protocol version 3 servers understand these.
+ */
+void client_chunk_request(int p, int q, int key, int priority) {
+    if (!client_enabled) {
+        return;
+    }
+    char entry[64];
+    int length = snprintf(entry, sizeof(entry), ",%d,%d,%d,%d",
+                          p, q, key, priority);
+    if (request_length + length + 2 > MAX_REQUEST_LINE) {
+        send_chunk_requests();
+    }
+    if (request_length == 0) {
+        request_line[request_length++] = 'c';
+    }
+    memcpy(request_line + request_length, entry, length);
+    request_length += length;
+}
+
+/*
+ * Ask the server to echo time back, for measuring the round trip time.
+ */
+void client_ping(double time) {
+    if (!client_enabled) {
+        return;
+    }
+    char buffer[1024];
+    snprintf(buffer, 1024, "p,%f\n", time);
+    client_send(buffer);
+}
+
 void client_block(int x, int y, int z, int w) {
     if (!client_enabled) {
         return;
@@ -225,32 +445,200 @@ void client_control_callback(int player, int x, int y, int z, int face) {
     client_send(buffer);
 }
 
+// Wait while the main thread is behind, called with mutex held.
+static void wait_for_room(void) {
+    while (running && filling->size >= QUEUE_SIZE) {
+        cnd_wait(&room, &mutex);
+    }
+}
+
+/*
+ * Hand the first length bytes of the filling buffer to the main thread and
+ * carry the rest, at most part of a line, over to the other buffer. Called
+ * with mutex held.
+ */
+static char *take(int length) {
+    Buffer *b = filling;
+    int rest = b->size - length;
+    buffer_reserve(reading, rest);
+    memcpy(reading->data, b->data + length, rest);
+    reading->size = rest;
+    filling = reading;
+    reading = b;
+    b->data[length] = '\0';
+    b->size = length;
+    bytes_received += length;
+    cnd_signal(&room);
+    return b->data;
+}
+
+/*
+ * Take the complete lines received so far. The result is owned by the
+ * client and stays valid until the next call to client_recv or
+ * client_recv_messages.
+ */
 char *client_recv() {
     if (!client_enabled) {
         return 0;
     }
     char *result = 0;
     mtx_lock(&mutex);
-    char *p = queue + qsize - 1;
-    while (p >= queue && *p != '\n') {
+    int text_size = binary_start >= 0 ? binary_start : filling->size;
+    char *p = filling->data + text_size - 1;
+    while (p >= filling->data && *p != '\n') {
         p--;
     }
-    if (p >= queue) {
-        int length = p - queue + 1;
-        result = malloc(sizeof(char) * (length + 1));
-        memcpy(result, queue, sizeof(char) * length);
-        result[length] = '\0';
-        int remaining = qsize - length;
-        memmove(queue, p + 1, remaining);
-        qsize -= length;
-        bytes_received += length;
+    if (p >= filling->data) {
+        int length = p - filling->data + 1;
+        result = take(length);
+        if (binary_start >= 0) {
+            binary_start -= length;
+        }
+    }
+    mtx_unlock(&mutex);
+    return result;
+}
+
+/*
+ * Take the binary messages received so far, once the server has switched to
+ * protocol version 3 and all text before that has been taken. Only whole
+ * messages are queued, the result is owned as for client_recv.
+ */
+unsigned char *client_recv_messages(int *length) {
+    if (!client_enabled) {
+        return 0;
+    }
+    unsigned char *result = 0;
+    mtx_lock(&mutex);
+    if (binary_start == 0 && filling->size > 0) {
+        *length = filling->size;
+        result = (unsigned char *)take(*length);
     }
     mtx_unlock(&mutex);
     return result;
 }
 
+/*
+ * Look for the "V,3" line a server sends when switching to binary messages,
+ * in the data just added to the queue at offset start.
+ */
+static void find_upgrade(int start) {
+    static const char *line = "V,3\n";
+    int n = strlen(line);
+    char *data = filling->data;
+    for (int i = start > n ? start - n + 1 : 0; i + n <= filling->size; i++) {
+        if ((i == 0 || data[i - 1] == '\n') &&
+            memcmp(data + i, line, n) == 0) {
+            binary_start = i + n;
+            upgrade_requested = 0;
+            return;
+        }
+    }
+}
+
+/*
+ * Add data received while the server sends text lines. Returns the offset in
+ * data where binary messages begin, or -1 if it is all text.
+ */
+static int put_text(const char *data, int length) {
+    int offset = -1;
+    mtx_lock(&mutex);
+    wait_for_room();
+    buffer_reserve(filling, filling->size + length);
+    memcpy(filling->data + filling->size, data, length);
+    filling->size += length;
+    if (filling->size > max_received_queued) {
+        max_received_queued = filling->size;
+    }
+    if (upgrade_requested) {
+        find_upgrade(filling->size - length);
+        if (binary_start >= 0) {
+            // Binary messages are queued once they are complete
+            offset = length - (filling->size - binary_start);
+            filling->size = binary_start;
+        }
+    }
+    mtx_unlock(&mutex);
+    return offset;
+}
+
+static void put_data(const unsigned char *data, int length) {
+    if (length == 0) {
+        return;
+    }
+    mtx_lock(&mutex);
+    wait_for_room();
+    buffer_reserve(filling, filling->size + length);
+    memcpy(filling->data + filling->size, data, length);
+    filling->size += length;
+    if (filling->size > max_received_queued) {
+        max_received_queued = filling->size;
+    }
+    mtx_unlock(&mutex);
+}
+
+static double thread_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put_deflated(const unsigned char *data, int length) {
+    double start = thread_time();
+    unsigned char *out = NULL;
+    size_t out_size = 0;
+    if (lodepng_zlib_decompress(&out, &out_size, data, length,
+                                &lodepng_default_decompress_settings)) {
+        fprintf(stderr, "Invalid compressed message from server\n");
+        exit(1);
+    }
+    mtx_lock(&mutex);
+    inflate_time += thread_time() - start;
+    compressed_bytes += length;
+    inflated_bytes += out_size;
+    mtx_unlock(&mutex);
+    put_data(out, out_size);
+    free(out);
+}
+
+/*
+ * Queue the complete messages at the start of data, inflating compressed
+ * ones, and move what is left to the start.
+ */
+static void put_messages(unsigned char *data, int *length) {
+    const unsigned char *end = data + *length;
+    const unsigned char *start = data;
+    const unsigned char *p = data;
+    int size;
+    while ((size = protocol_message_size(p, end)) > 0) {
+        const unsigned char *body = p;
+        unsigned int body_size;
+        protocol_read_uint(&body, end, &body_size);
+        if (*body == MSG_DEFLATE) {
+            put_data(start, p - start);
+            put_deflated(body + 1, body_size - 1);
+            start = p + size;
+        }
+        p += size;
+    }
+    if (size < 0) {
+        fprintf(stderr, "Invalid message from server\n");
+        exit(1);
+    }
+    put_data(start, p - start);
+    if (p > data) {
+        *length = end - p;
+        memmove(data, p, *length);
+    }
+}
+
 int recv_worker(__attribute__((unused)) void *arg) {
     char *data = malloc(sizeof(char) * RECV_SIZE);
+    // Binary data waiting for the rest of its message
+    unsigned char *pending = NULL;
+    int pending_size = 0;
+    int pending_capacity = 0;
+    int binary = 0;
     while (1) {
         int length;
         if ((length = recv(sd, data, RECV_SIZE - 1, 0)) <= 0) {
@@ -262,22 +650,23 @@ int recv_worker(__attribute__((unused)) void *arg) {
                 break;
             }
         }
-        data[length] = '\0';
-        while (1) {
-            int done = 0;
-            mtx_lock(&mutex);
-            if (qsize + length < QUEUE_SIZE) {
-                memcpy(queue + qsize, data, sizeof(char) * (length + 1));
-                qsize += length;
-                done = 1;
-            }
-            mtx_unlock(&mutex);
-            if (done) {
-                break;
-            }
-            sleep(0);
+        int offset = binary ? 0 : put_text(data, length);
+        if (offset < 0) {
+            continue;
+        }
+        binary = 1;
+        if (offset == length) {
+            continue;
         }
+        if (pending_size + length - offset > pending_capacity) {
+            pending_capacity = pending_size + length - offset + RECV_SIZE;
+            pending = realloc(pending, pending_capacity);
+        }
+        memcpy(pending + pending_size, data + offset, length - offset);
+        pending_size += length - offset;
+        put_messages(pending, &pending_size);
     }
+    free(pending);
     free(data);
     return 0;
 }
@@ -304,6 +693,9 @@ void client_connect(char *hostname, int port) {
         perror("connect");
         exit(1);
     }
+    // Messages are already gathered into one send per frame
+    int flag = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
 }
 
 void client_start() {
@@ -311,28 +703,97 @@ void client_start() {
         return;
     }
     running = 1;
-    queue = (char *)calloc(QUEUE_SIZE, sizeof(char));
-    qsize = 0;
+    filling = buffers;
+    reading = buffers + 1;
+    for (int i = 0; i < 2; i++) {
+        buffers[i].size = 0;
+        buffer_reserve(buffers + i, RECV_SIZE);
+    }
+    upgrade_requested = 0;
+    binary_start = -1;
+    compressed_bytes = inflated_bytes = 0;
+    inflate_time = 0;
+    bytes_sent = bytes_received = 0;
+    max_received_queued = 0;
     mtx_init(&mutex, mtx_plain);
+    cnd_init(&room);
     if (thrd_create(&recv_thread, recv_worker, NULL) != thrd_success) {
         perror("thrd_create");
         exit(1);
     }
+    queued = send_buffers;
+    sending = send_buffers + 1;
+    for (int i = 0; i < 2; i++) {
+        send_buffers[i].size = 0;
+        buffer_reserve(send_buffers + i, SEND_FLUSH_SIZE);
+    }
+    memset(&send_stats, 0, sizeof(send_stats));
+    flush_requested = 0;
+    sending_running = 1;
+    mtx_init(&send_mutex, mtx_plain);
+    cnd_init(&send_ready);
+    cnd_init(&send_room);
+    if (thrd_create(&send_thread, send_worker, NULL) != thrd_success) {
+        perror("thrd_create");
+        exit(1);
+    }
 }
 
 void client_stop() {
     if (!client_enabled) {
         return;
     }
+    request_length = 0;
+    // Send what is still queued before closing the connection
+    mtx_lock(&send_mutex);
+    sending_running = 0;
+    cnd_signal(&send_ready);
+    mtx_unlock(&send_mutex);
+    if (thrd_join(send_thread, NULL) != thrd_success) {
+        perror("thrd_join");
+        exit(1);
+    }
+    cnd_destroy(&send_ready);
+    cnd_destroy(&send_room);
+    mtx_destroy(&send_mutex);
     running = 0;
+    // Wake the receive thread whether it waits in recv or for room
+    shutdown(sd, SHUT_RDWR);
+    mtx_lock(&mutex);
+    cnd_signal(&room);
+    mtx_unlock(&mutex);
+    if (thrd_join(recv_thread, NULL) != thrd_success) {
+        perror("thrd_join");
+        exit(1);
+    }
     close(sd);
-    // if (thrd_join(recv_thread, NULL) != thrd_success) {
-    //     perror("thrd_join");
-    //     exit(1);
-    // }
-    // mtx_destroy(&mutex);
-    qsize = 0;
-    free(queue);
-    // printf("Bytes Sent: %d, Bytes Received: %d\n",
-    //     bytes_sent, bytes_received);
+    cnd_destroy(&room);
+    mtx_destroy(&mutex);
+    for (int i = 0; i < 2; i++) {
+        free(buffers[i].data);
+        buffers[i].data = NULL;
+        buffers[i].capacity = 0;
+        free(send_buffers[i].data);
+        send_buffers[i].data = NULL;
+        send_buffers[i].capacity = 0;
+    }
+    if (config->verbose && send_stats.messages > 0) {
+        printf("Sent %lld messages, %lld KB in %lld flushes and %lld send "
+               "calls, %d KB queued at most, waited for room %lld times\n",
+               send_stats.messages, send_stats.bytes / 1024,
+               send_stats.flushes, send_stats.send_calls,
+               send_stats.max_queued / 1024, send_stats.waits);
+    }
+    if (config->verbose && compressed_bytes > 0) {
+        printf("Compressed chunks: %lld KB inflated to %lld KB (%.1fx), "
+               "%.1fms inflating\n", compressed_bytes / 1024,
+               inflated_bytes / 1024,
+               (double)inflated_bytes / compressed_bytes,
+               inflate_time * 1000);
+    }
+    if (config->verbose) {
+        printf("Bytes sent: %lld, bytes received: %lld, %d KB queued at "
+               "most\n", bytes_sent, bytes_received,
+               max_received_queued / 1024);
+    }
 }
@@ -1,5 +1,26 @@
 #pragma once
 
+// Counts of messages queued to send to the server
+typedef struct {
+    long long messages;
+    long long bytes;
+    long long flushes;
+    long long send_calls;
+    long long waits;
+    int queued;
+    int max_queued;
+} ClientSendStats;
+
+// Counts of data received from the server
+typedef struct {
+    long long bytes;  // taken by the main thread, after inflating
+    long long compressed_bytes;
+    long long inflated_bytes;
+    double inflate_time;
+    int queued;       // received but not taken yet
+    int max_queued;
+} ClientRecvStats;
+
 void client_enable(void);
 void client_disable(void);
 int get_client_enabled(void);
@@ -7,8 +28,14 @@ void client_connect(char *hostname, int port);
 void client_start(void);
 void client_stop(void);
 void client_send(char *data);
+void client_flush(void);
+void client_send_stats(ClientSendStats *stats);
+void client_recv_stats(ClientRecvStats *stats);
 char *client_recv(void);
+unsigned char *client_recv_messages(int *length);
 void client_version(int version);
+int client_server_version(void);
+void client_compress(const char *method);
 void client_login(const char *username, const char *identity_token);
 void client_nick(const int player, const char *name);
 void client_spawn(const int player);
@@ -18,6 +45,8 @@ void client_position(int player, float x, float y, float z, float rx, float ry);
 void client_add_player(int player);
 void client_remove_player(int player);
 void client_chunk(int p, int q, int key);
+void client_chunk_request(int p, int q, int key, int priority);
+void client_ping(double time);
 void client_block(int x, int y, int z, int w);
 void client_extra(int x, int y, int z, int w);
 void client_light(int x, int y, int z, int w);
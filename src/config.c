@@ -55,6 +55,17 @@ void reset_config() {
     config->use_hfloat = HFLOAT_CONFIG;
     strncpy(config->worldgen_path, WORLDGEN_PATH, sizeof(config->worldgen_path));
     config->worldgen_path[sizeof(WORLDGEN_PATH)] = '\0';
+    config->observe_interval = OBSERVE_INTERVAL;
+    config->convert_storage[0] = '\0';
+    config->prune_db = 0;
+    config->pregenerate_radius = -1;
+    config->worldgen_cache_size = WORLDGEN_CACHE_SIZE;
+    config->chunk_cache_size = CHUNK_CACHE_SIZE;
+    config->chunk_cache_meshes = CHUNK_CACHE_MESHES;
+    snprintf(config->db_backend, sizeof(config->db_backend), "%s", DB_BACKEND);
+    config->compress_chunks = COMPRESS_CHUNKS;
+    config->netstats_file[0] = '\0';
+    config->netstats_interval = NETSTATS_INTERVAL;
 }
 
 void get_config_path(char *path)
@@ -116,6 +127,17 @@ void parse_startup_config(int argc, char **argv) {
             {"time",              required_argument, 0,  0 },
             {"hfloat",            required_argument, 0,  0 },
             {"worldgen",          required_argument, 0,  0 },
+            {"observe-interval",  required_argument, 0,  0 },
+            {"convert-storage",   required_argument, 0,  0 },
+            {"prune-db",          no_argument,       0,  0 },
+            {"pregenerate",       required_argument, 0,  0 },
+            {"worldgen-cache-size", required_argument, 0,  0 },
+            {"chunk-cache-size",  required_argument, 0,  0 },
+            {"chunk-cache-meshes", required_argument, 0,  0 },
+            {"db-backend",        required_argument, 0,  0 },
+            {"compress-chunks",   required_argument, 0,  0 },
+            {"netstats-file",     required_argument, 0,  0 },
+            {"netstats-interval", required_argument, 0,  0 },
             {0,                   0,                 0,  0 }
         };
 
@@ -193,10 +215,34 @@ void parse_startup_config(int argc, char **argv) {
                        sscanf(optarg, "%d", &config->time) == 1) {
             } else if (strncmp(opt_name, "hfloat", 6) == 0 &&
                        sscanf(optarg, "%d", &config->use_hfloat) == 1) {
+            } else if (strncmp(opt_name, "worldgen-cache-size", 19) == 0 &&
+                       sscanf(optarg, "%d",
+                              &config->worldgen_cache_size) == 1) {
             } else if (strncmp(opt_name, "worldgen", 8) == 0 &&
                        sscanf(optarg, "%256c", config->worldgen_path) == 1) {
                 config->worldgen_path[MIN(strlen(optarg),
                                           MAX_PATH_LENGTH - 1)] = '\0';
+            } else if (strncmp(opt_name, "observe-interval", 16) == 0 &&
+                       sscanf(optarg, "%d", &config->observe_interval) == 1) {
+            } else if (strncmp(opt_name, "convert-storage", 15) == 0 &&
+                       sscanf(optarg, "%15s", config->convert_storage) == 1) {
+            } else if (strncmp(opt_name, "prune-db", 8) == 0) {
+                config->prune_db = 1;
+            } else if (strncmp(opt_name, "pregenerate", 11) == 0 &&
+                       sscanf(optarg, "%d", &config->pregenerate_radius) == 1) {
+            } else if (strncmp(opt_name, "chunk-cache-size", 16) == 0 &&
+                       sscanf(optarg, "%d", &config->chunk_cache_size) == 1) {
+            } else if (strncmp(opt_name, "chunk-cache-meshes", 18) == 0 &&
+                       sscanf(optarg, "%d",
+                              &config->chunk_cache_meshes) == 1) {
+            } else if (strncmp(opt_name, "db-backend", 10) == 0 &&
+                       sscanf(optarg, "%15s", config->db_backend) == 1) {
+            } else if (strncmp(opt_name, "compress-chunks", 15) == 0 &&
+                       sscanf(optarg, "%d", &config->compress_chunks) == 1) {
+            } else if (strncmp(opt_name, "netstats-file", 13) == 0) {
+                snprintf(config->netstats_file, MAX_PATH_LENGTH, "%s", optarg);
+            } else if (strncmp(opt_name, "netstats-interval", 17) == 0 &&
+                       sscanf(optarg, "%d", &config->netstats_interval) == 1) {
             } else {
                 printf("Bad argument for: --%s: %s\n", opt_name, optarg);
                 exit(1);
@@ -24,6 +24,13 @@
 #define SHOW_CHAT_TEXT 1
 #define SHOW_PLAYER_NAMES 1
 #define WORLDGEN_PATH ""
+#define OBSERVE_INTERVAL 2
+#define WORLDGEN_CACHE_SIZE 128
+#define CHUNK_CACHE_SIZE 16
+#define CHUNK_CACHE_MESHES 0
+#define DB_BACKEND "sqlite"
+#define COMPRESS_CHUNKS 1
+#define NETSTATS_INTERVAL 10
 
 // key bindings
 #define CRAFT_KEY_CHAT 't'
@@ -83,6 +90,17 @@ typedef struct {
     int time;
     int use_hfloat;
     char worldgen_path[MAX_PATH_LENGTH];
+    int observe_interval;
+    char convert_storage[16];
+    int prune_db;
+    int pregenerate_radius;
+    int worldgen_cache_size;
+    int chunk_cache_size;
+    int chunk_cache_meshes;
+    char db_backend[16];
+    int compress_chunks;
+    char netstats_file[MAX_PATH_LENGTH];
+    int netstats_interval;
 } Config;
 
 extern Config *config;
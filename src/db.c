@@ -1,13 +1,34 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "chunk_blob.h"
 #include "config.h"
 #include "db.h"
 #include "ring.h"
 #include "sqlite3.h"
+#include "storage.h"
 #include "tinycthread.h"
 
 static int db_enabled = 0;
 
+// The game data is kept by the backend chosen by --db-backend, the other
+// functions in this file are only for the SQLite backend.
+static const StorageBackend sqlite_storage;
+static const StorageBackend *backends[] = {
+    &sqlite_storage, &memory_storage, &log_storage
+};
+static const StorageBackend *backend = &sqlite_storage;
+
+static char db_path[MAX_PATH_LENGTH];
+
+// Set when the game file is in WAL mode, so other connections can read it
+// while the writer has a transaction open
+static int wal_mode = 0;
+
+// Set when the world data is stored as one chunk_blob row per chunk
+static int blob_storage = 0;
+
 static sqlite3 *db;
 static sqlite3_stmt *insert_block_stmt;
 static sqlite3_stmt *insert_extra_stmt;
@@ -17,18 +38,89 @@ static sqlite3_stmt *insert_transform_stmt;
 static sqlite3_stmt *insert_sign_stmt;
 static sqlite3_stmt *delete_sign_stmt;
 static sqlite3_stmt *delete_signs_stmt;
-static sqlite3_stmt *load_blocks_stmt;
-static sqlite3_stmt *load_extras_stmt;
-static sqlite3_stmt *load_lights_stmt;
-static sqlite3_stmt *load_shapes_stmt;
-static sqlite3_stmt *load_transforms_stmt;
-static sqlite3_stmt *load_signs_stmt;
 static sqlite3_stmt *get_sign_stmt;
 static sqlite3_stmt *get_light_stmt;
 static sqlite3_stmt *get_key_stmt;
 static sqlite3_stmt *set_key_stmt;
 static sqlite3_stmt *get_option_stmt;
 static sqlite3_stmt *set_option_stmt;
+static sqlite3_stmt *load_blob_stmt;
+static sqlite3_stmt *get_blob_stmt;
+static sqlite3_stmt *set_blob_stmt;
+static sqlite3_stmt *delete_blob_stmt;
+
+// Number of rows written by each multi-row insert statement
+#define DB_BATCH_ROWS 64
+
+// Writes to the per-block layers, indexed by RingEntryType (BLOCK to LIGHT)
+#define DB_LAYERS 5
+static const char *layer_tables[DB_LAYERS] = {
+    "block", "extra", "shape", "transform", "light"
+};
+static sqlite3_stmt *insert_stmts[DB_LAYERS];
+static sqlite3_stmt *insert_batch_stmts[DB_LAYERS];
+static sqlite3_stmt *delete_chunk_stmts[DB_LAYERS];
+
+typedef struct {
+    RingEntry e;
+    unsigned int seq;
+} PendingWrite;
+
+// Writes taken from the ring by the worker and waiting to be flushed
+static PendingWrite *pending;
+static unsigned int pending_size;
+static unsigned int pending_capacity;
+
+typedef struct {
+    unsigned int entries;
+    unsigned int written;
+    unsigned int statements;
+    unsigned int flushes;
+    double flush_time;
+    double max_flush_time;
+} WriterStats;
+
+static WriterStats writer_stats;
+
+// Chunk load timings, the signs are counted as an extra layer
+#define LOAD_STATS_INTERVAL 256
+static const char *load_stats_names[DB_LAYERS + 1] = {
+    "block", "extra", "shape", "transform", "light", "sign"
+};
+
+typedef struct {
+    unsigned int chunks;
+    unsigned int rows[DB_LAYERS + 1];
+    double layer_time[DB_LAYERS + 1];
+    double total_time;
+} LoadStats;
+
+// A connection and the statements used to load chunks
+struct DbReader {
+    sqlite3 *db;
+    sqlite3_stmt *load_chunk_stmt;
+    sqlite3_stmt *load_blob_stmt;
+    sqlite3_stmt *load_signs_stmt;
+    mtx_t *mtx;  // held while loading when the connection is shared
+    LoadStats stats;
+};
+
+// Loads that have no reader of their own use the main connection
+static DbReader shared_reader;
+
+// The chunk being rewritten by the worker in blob storage mode
+static ChunkBlob writer_blob;
+
+// Pages copied by the writer for each step of an online backup
+#define BACKUP_STEP_PAGES 64
+
+// An online backup in progress, guarded by mtx
+static sqlite3 *backup_db;
+static sqlite3_backup *backup;
+static int backup_queued;
+static int backup_status;
+static int backup_remaining;
+static int backup_pagecount;
 
 static Ring ring;
 static thrd_t thrd;
@@ -36,6 +128,12 @@ static mtx_t mtx;
 static cnd_t cnd;
 static mtx_t load_mtx;
 
+static double db_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 void db_enable(void) {
     db_enabled = 1;
 }
@@ -48,13 +146,77 @@ int get_db_enabled(void) {
     return db_enabled;
 }
 
-int db_init(char *path) {
-    if (!db_enabled) {
-        return 0;
+static int sqlite_enabled(void) {
+    return db_enabled && backend == &sqlite_storage;
+}
+
+static int prepare_reader(DbReader *reader) {
+    static const char *load_blob_query =
+        "select data from chunk_blob where p = ? and q = ?;";
+    static const char *load_signs_query =
+        "select x, y, z, face, text from sign where p = ? and q = ?;";
+    char query[1024];
+    int n = 0;
+    for (int i = 0; i < DB_LAYERS; i++) {
+        n += snprintf(query + n, sizeof(query) - n,
+            "select %d, x, y, z, w, null from %s where p = ?1 and q = ?2 "
+            "union all ", i, layer_tables[i]);
     }
-    if (config->verbose) {
-        printf("\nLoading db from: %s\n", path);
+    snprintf(query + n, sizeof(query) - n,
+        "select %d, x, y, z, face, text from sign where p = ?1 and q = ?2;",
+        DB_LAYERS);
+    int rc;
+    rc = sqlite3_prepare_v2(
+        reader->db, query, -1, &reader->load_chunk_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(
+        reader->db, load_blob_query, -1, &reader->load_blob_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(
+        reader->db, load_signs_query, -1, &reader->load_signs_stmt, NULL);
+    if (rc) return rc;
+    return 0;
+}
+
+static void finalize_reader(DbReader *reader) {
+    sqlite3_finalize(reader->load_chunk_stmt);
+    sqlite3_finalize(reader->load_blob_stmt);
+    sqlite3_finalize(reader->load_signs_stmt);
+    memset(reader, 0, sizeof(DbReader));
+}
+
+void db_reader_close(DbReader *reader) {
+    if (!reader) {
+        return;
     }
+    sqlite3 *reader_db = reader->db;
+    finalize_reader(reader);
+    sqlite3_close(reader_db);
+    free(reader);
+}
+
+/*
+ * Open a read-only connection for a chunk loading thread, so that its loads
+ * do not wait for other loads or for the writer. Returns NULL when the game
+ * file is not in WAL mode (or cannot be opened), and db_load_chunk then uses
+ * the main connection.
+ */
+DbReader *db_reader_open(void) {
+    if (!sqlite_enabled() || !wal_mode) {
+        return NULL;
+    }
+    DbReader *reader = calloc(1, sizeof(DbReader));
+    if (sqlite3_open_v2(db_path, &reader->db, SQLITE_OPEN_READONLY, NULL) ||
+        prepare_reader(reader)) {
+        printf("Could not open db reader: %s\n", sqlite3_errmsg(reader->db));
+        db_reader_close(reader);
+        return NULL;
+    }
+    sqlite3_busy_timeout(reader->db, 1000);
+    return reader;
+}
+
+static int sqlite_open(const char *path) {
     static const char *create_query =
         "create table if not exists state ("
         "   x float not null,"
@@ -124,6 +286,11 @@ int db_init(char *path) {
         "    name text not null,"
         "    value text not null"
         ");"
+        "create table if not exists chunk_blob ("
+        "    p int not null,"
+        "    q int not null,"
+        "    data blob not null"
+        ");"
         "create unique index if not exists block_pqxyz_idx on block (p, q, x, y, z);"
         "create unique index if not exists extra_pqxyz_idx on extra (p, q, x, y, z);"
         "create unique index if not exists light_pqxyz_idx on light (p, q, x, y, z);"
@@ -132,7 +299,8 @@ int db_init(char *path) {
         "create unique index if not exists shape_pqxyz_idx on shape (p, q, x, y, z);"
         "create unique index if not exists transform_pqxyz_idx on transform (p, q, x, y, z);"
         "create unique index if not exists sign_xyzface_idx on sign (x, y, z, face);"
-        "create index if not exists sign_pq_idx on sign (p, q);";
+        "create index if not exists sign_pq_idx on sign (p, q);"
+        "create unique index if not exists chunk_blob_pq_idx on chunk_blob (p, q);";
     static const char *insert_block_query =
         "insert or replace into block (p, q, x, y, z, w) "
         "values (?, ?, ?, ?, ?, ?);";
@@ -155,18 +323,6 @@ int db_init(char *path) {
         "delete from sign where x = ? and y = ? and z = ? and face = ?;";
     static const char *delete_signs_query =
         "delete from sign where x = ? and y = ? and z = ?;";
-    static const char *load_blocks_query =
-        "select x, y, z, w from block where p = ? and q = ?;";
-    static const char *load_extras_query =
-        "select x, y, z, w from extra where p = ? and q = ?;";
-    static const char *load_lights_query =
-        "select x, y, z, w from light where p = ? and q = ?;";
-    static const char *load_shapes_query =
-        "select x, y, z, w from shape where p = ? and q = ?;";
-    static const char *load_transforms_query =
-        "select x, y, z, w from transform where p = ? and q = ?;";
-    static const char *load_signs_query =
-        "select x, y, z, face, text from sign where p = ? and q = ?;";
     static const char *get_sign_query =
         "select text from sign where p = ? and q = ? and x = ? and y = ? and z = ? and face = ?;";
     static const char *get_light_query =
@@ -181,9 +337,30 @@ int db_init(char *path) {
     static const char *set_option_query =
         "insert or replace into option (name, value) "
         "values (?, ?);";
+    static const char *get_blob_query =
+        "select data from chunk_blob where p = ? and q = ?;";
+    static const char *set_blob_query =
+        "insert or replace into chunk_blob (p, q, data) "
+        "values (?, ?, ?);";
+    static const char *delete_blob_query =
+        "delete from chunk_blob where p = ? and q = ?;";
     int rc;
     rc = sqlite3_open(path, &db);
     if (rc) return rc;
+    snprintf(db_path, MAX_PATH_LENGTH, "%s", path);
+    wal_mode = 0;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "pragma journal_mode = wal;", -1, &stmt,
+                           NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *mode = (const char *)sqlite3_column_text(stmt, 0);
+            wal_mode = mode && strcmp(mode, "wal") == 0;
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (wal_mode) {
+        sqlite3_exec(db, "pragma synchronous = normal;", NULL, NULL, NULL);
+    }
     rc = sqlite3_exec(db, create_query, NULL, NULL, NULL);
     if (rc) return rc;
     rc = sqlite3_prepare_v2(
@@ -210,18 +387,6 @@ int db_init(char *path) {
     rc = sqlite3_prepare_v2(
         db, delete_signs_query, -1, &delete_signs_stmt, NULL);
     if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, load_blocks_query, -1, &load_blocks_stmt, NULL);
-    if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, load_extras_query, -1, &load_extras_stmt, NULL);
-    if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, load_lights_query, -1, &load_lights_stmt, NULL);
-    if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, load_shapes_query, -1, &load_shapes_stmt, NULL);
-    if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, load_transforms_query, -1, &load_transforms_stmt, NULL);
-    if (rc) return rc;
-    rc = sqlite3_prepare_v2(db, load_signs_query, -1, &load_signs_stmt, NULL);
-    if (rc) return rc;
     rc = sqlite3_prepare_v2(db, get_sign_query, -1, &get_sign_stmt, NULL);
     if (rc) return rc;
     rc = sqlite3_prepare_v2(db, get_light_query, -1, &get_light_stmt, NULL);
@@ -234,16 +399,60 @@ int db_init(char *path) {
     if (rc) return rc;
     rc = sqlite3_prepare_v2(db, set_option_query, -1, &set_option_stmt, NULL);
     if (rc) return rc;
+    rc = sqlite3_prepare_v2(db, get_blob_query, -1, &load_blob_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(db, get_blob_query, -1, &get_blob_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(db, set_blob_query, -1, &set_blob_stmt, NULL);
+    if (rc) return rc;
+    rc = sqlite3_prepare_v2(
+        db, delete_blob_query, -1, &delete_blob_stmt, NULL);
+    if (rc) return rc;
+    insert_stmts[BLOCK] = insert_block_stmt;
+    insert_stmts[EXTRA] = insert_extra_stmt;
+    insert_stmts[SHAPE] = insert_shape_stmt;
+    insert_stmts[TRANSFORM] = insert_transform_stmt;
+    insert_stmts[LIGHT] = insert_light_stmt;
+    for (int i = 0; i < DB_LAYERS; i++) {
+        char query[64 + DB_BATCH_ROWS * 20];
+        int n = snprintf(query, sizeof(query),
+            "insert or replace into %s (p, q, x, y, z, w) values ",
+            layer_tables[i]);
+        for (int j = 0; j < DB_BATCH_ROWS; j++) {
+            n += snprintf(query + n, sizeof(query) - n, "%s(?,?,?,?,?,?)",
+                          j ? "," : "");
+        }
+        rc = sqlite3_prepare_v2(db, query, -1, &insert_batch_stmts[i], NULL);
+        if (rc) return rc;
+        snprintf(query, sizeof(query), "delete from %s where p = ? and q = ?;",
+                 layer_tables[i]);
+        rc = sqlite3_prepare_v2(db, query, -1, &delete_chunk_stmts[i], NULL);
+        if (rc) return rc;
+    }
+    shared_reader.db = db;
+    shared_reader.mtx = &load_mtx;
+    rc = prepare_reader(&shared_reader);
+    if (rc) return rc;
+    const unsigned char *storage = db_get_option("storage");
+    blob_storage = storage && strcmp((const char *)storage, "blob") == 0;
+    if (config->verbose && blob_storage) {
+        printf("Using chunk blob storage\n");
+    }
     sqlite3_exec(db, "begin;", NULL, NULL, NULL);
     db_worker_start();
     return 0;
 }
 
-void db_close(void) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_close(void) {
     db_worker_stop();
+    if (backup) {
+        printf("Backup cancelled, the game was closed\n");
+        sqlite3_backup_finish(backup);
+        sqlite3_close(backup_db);
+        backup = NULL;
+        backup_db = NULL;
+    }
+    backup_status = DB_BACKUP_NONE;
     sqlite3_exec(db, "commit;", NULL, NULL, NULL);
     sqlite3_finalize(insert_block_stmt);
     sqlite3_finalize(insert_extra_stmt);
@@ -253,25 +462,25 @@ void db_close(void) {
     sqlite3_finalize(insert_sign_stmt);
     sqlite3_finalize(delete_sign_stmt);
     sqlite3_finalize(delete_signs_stmt);
-    sqlite3_finalize(load_blocks_stmt);
-    sqlite3_finalize(load_extras_stmt);
-    sqlite3_finalize(load_lights_stmt);
-    sqlite3_finalize(load_shapes_stmt);
-    sqlite3_finalize(load_transforms_stmt);
-    sqlite3_finalize(load_signs_stmt);
     sqlite3_finalize(get_sign_stmt);
     sqlite3_finalize(get_light_stmt);
     sqlite3_finalize(get_key_stmt);
     sqlite3_finalize(set_key_stmt);
     sqlite3_finalize(get_option_stmt);
     sqlite3_finalize(set_option_stmt);
+    sqlite3_finalize(load_blob_stmt);
+    finalize_reader(&shared_reader);
+    sqlite3_finalize(get_blob_stmt);
+    sqlite3_finalize(set_blob_stmt);
+    sqlite3_finalize(delete_blob_stmt);
+    for (int i = 0; i < DB_LAYERS; i++) {
+        sqlite3_finalize(insert_batch_stmts[i]);
+        sqlite3_finalize(delete_chunk_stmts[i]);
+    }
     sqlite3_close(db);
 }
 
-void db_commit(void) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_commit(void) {
     mtx_lock(&mtx);
     ring_put_commit(&ring);
     cnd_signal(&cnd);
@@ -282,17 +491,11 @@ void _db_commit(void) {
     sqlite3_exec(db, "commit; begin;", NULL, NULL, NULL);
 }
 
-void db_clear_state(void) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_clear_state(void) {
     sqlite3_exec(db, "delete from state;", NULL, NULL, NULL);
 }
 
-void db_save_state(float x, float y, float z, float rx, float ry) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_save_state(float x, float y, float z, float rx, float ry) {
     static const char *query =
         "insert into state (x, y, z, rx, ry) values (?, ?, ?, ?, ?);";
     sqlite3_stmt *stmt;
@@ -306,11 +509,9 @@ void db_save_state(float x, float y, float z, float rx, float ry) {
     sqlite3_finalize(stmt);
 }
 
-int db_load_state(float *x, float *y, float *z, float *rx, float *ry,
-                  int player) {
-    if (!db_enabled) {
-        return 0;
-    }
+static int sqlite_load_state(
+    float *x, float *y, float *z, float *rx, float *ry, int player)
+{
     static const char *query =
         "select x, y, z, rx, ry from state;";
     int result = 0;
@@ -333,17 +534,11 @@ int db_load_state(float *x, float *y, float *z, float *rx, float *ry,
     return result;
 }
 
-void db_clear_player_names(void) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_clear_player_names(void) {
     sqlite3_exec(db, "delete from player_name;", NULL, NULL, NULL);
 }
 
-void db_save_player_name(const char *name) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_save_player_name(const char *name) {
     static const char *query = "insert into player_name (name) values (?);";
     sqlite3_stmt *stmt;
     sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
@@ -352,10 +547,9 @@ void db_save_player_name(const char *name) {
     sqlite3_finalize(stmt);
 }
 
-int db_load_player_name(char *name, int max_name_length, int player) {
-    if (!db_enabled) {
-        return 0;
-    }
+static int sqlite_load_player_name(
+    char *name, int max_name_length, int player)
+{
     static const char *query = "select name from player_name;";
     int result = 0;
     sqlite3_stmt *stmt;
@@ -374,72 +568,45 @@ int db_load_player_name(char *name, int max_name_length, int player) {
     return result;
 }
 
-void db_insert_block(int p, int q, int x, int y, int z, int w) {
-    if (!db_enabled) {
-        return;
-    }
-    mtx_lock(&mtx);
-    ring_put_block(&ring, p, q, x, y, z, w);
-    cnd_signal(&cnd);
-    mtx_unlock(&mtx);
-}
-
-void _db_insert_block(int p, int q, int x, int y, int z, int w) {
-    sqlite3_reset(insert_block_stmt);
-    sqlite3_bind_int(insert_block_stmt, 1, p);
-    sqlite3_bind_int(insert_block_stmt, 2, q);
-    sqlite3_bind_int(insert_block_stmt, 3, x);
-    sqlite3_bind_int(insert_block_stmt, 4, y);
-    sqlite3_bind_int(insert_block_stmt, 5, z);
-    sqlite3_bind_int(insert_block_stmt, 6, w);
-    sqlite3_step(insert_block_stmt);
-}
-
-void db_insert_extra(int p, int q, int x, int y, int z, int w) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_set_layer(
+    int layer, int p, int q, int x, int y, int z, int w)
+{
     mtx_lock(&mtx);
-    ring_put_extra(&ring, p, q, x, y, z, w);
-    cnd_signal(&cnd);
-    mtx_unlock(&mtx);
-}
-
-void _db_insert_extra(int p, int q, int x, int y, int z, int w) {
-    sqlite3_reset(insert_extra_stmt);
-    sqlite3_bind_int(insert_extra_stmt, 1, p);
-    sqlite3_bind_int(insert_extra_stmt, 2, q);
-    sqlite3_bind_int(insert_extra_stmt, 3, x);
-    sqlite3_bind_int(insert_extra_stmt, 4, y);
-    sqlite3_bind_int(insert_extra_stmt, 5, z);
-    sqlite3_bind_int(insert_extra_stmt, 6, w);
-    sqlite3_step(insert_extra_stmt);
-}
-
-void db_insert_light(int p, int q, int x, int y, int z, int w) {
-    if (!db_enabled) {
-        return;
+    switch (layer) {
+        case BLOCK:
+            ring_put_block(&ring, p, q, x, y, z, w);
+            break;
+        case EXTRA:
+            ring_put_extra(&ring, p, q, x, y, z, w);
+            break;
+        case SHAPE:
+            ring_put_shape(&ring, p, q, x, y, z, w);
+            break;
+        case TRANSFORM:
+            ring_put_transform(&ring, p, q, x, y, z, w);
+            break;
+        case LIGHT:
+            ring_put_light(&ring, p, q, x, y, z, w);
+            break;
     }
-    mtx_lock(&mtx);
-    ring_put_light(&ring, p, q, x, y, z, w);
     cnd_signal(&cnd);
     mtx_unlock(&mtx);
 }
 
-void _db_insert_light(int p, int q, int x, int y, int z, int w) {
-    sqlite3_reset(insert_light_stmt);
-    sqlite3_bind_int(insert_light_stmt, 1, p);
-    sqlite3_bind_int(insert_light_stmt, 2, q);
-    sqlite3_bind_int(insert_light_stmt, 3, x);
-    sqlite3_bind_int(insert_light_stmt, 4, y);
-    sqlite3_bind_int(insert_light_stmt, 5, z);
-    sqlite3_bind_int(insert_light_stmt, 6, w);
-    sqlite3_step(insert_light_stmt);
-}
-
-int db_get_light(int p, int q, int x, int y, int z) {
-    if (!db_enabled) {
-        return 0;
+static int sqlite_get_light(int p, int q, int x, int y, int z) {
+    if (blob_storage) {
+        int w = 0;
+        mtx_lock(&load_mtx);
+        sqlite3_reset(load_blob_stmt);
+        sqlite3_bind_int(load_blob_stmt, 1, p);
+        sqlite3_bind_int(load_blob_stmt, 2, q);
+        if (sqlite3_step(load_blob_stmt) == SQLITE_ROW) {
+            const unsigned char *data = sqlite3_column_blob(load_blob_stmt, 0);
+            int size = sqlite3_column_bytes(load_blob_stmt, 0);
+            chunk_blob_get(data, size, p, q, LIGHT, x, y, z, &w);
+        }
+        mtx_unlock(&load_mtx);
+        return w;
     }
     sqlite3_reset(get_light_stmt);
     sqlite3_bind_int(get_light_stmt, 1, p);
@@ -453,54 +620,9 @@ int db_get_light(int p, int q, int x, int y, int z) {
     return 0;
 }
 
-void db_insert_shape(int p, int q, int x, int y, int z, int w) {
-    if (!db_enabled) {
-        return;
-    }
-    mtx_lock(&mtx);
-    ring_put_shape(&ring, p, q, x, y, z, w);
-    cnd_signal(&cnd);
-    mtx_unlock(&mtx);
-}
-
-void _db_insert_shape(int p, int q, int x, int y, int z, int w) {
-    sqlite3_reset(insert_shape_stmt);
-    sqlite3_bind_int(insert_shape_stmt, 1, p);
-    sqlite3_bind_int(insert_shape_stmt, 2, q);
-    sqlite3_bind_int(insert_shape_stmt, 3, x);
-    sqlite3_bind_int(insert_shape_stmt, 4, y);
-    sqlite3_bind_int(insert_shape_stmt, 5, z);
-    sqlite3_bind_int(insert_shape_stmt, 6, w);
-    sqlite3_step(insert_shape_stmt);
-}
-
-void db_insert_transform(int p, int q, int x, int y, int z, int w) {
-    if (!db_enabled) {
-        return;
-    }
-    mtx_lock(&mtx);
-    ring_put_transform(&ring, p, q, x, y, z, w);
-    cnd_signal(&cnd);
-    mtx_unlock(&mtx);
-}
-
-void _db_insert_transform(int p, int q, int x, int y, int z, int w) {
-    sqlite3_reset(insert_transform_stmt);
-    sqlite3_bind_int(insert_transform_stmt, 1, p);
-    sqlite3_bind_int(insert_transform_stmt, 2, q);
-    sqlite3_bind_int(insert_transform_stmt, 3, x);
-    sqlite3_bind_int(insert_transform_stmt, 4, y);
-    sqlite3_bind_int(insert_transform_stmt, 5, z);
-    sqlite3_bind_int(insert_transform_stmt, 6, w);
-    sqlite3_step(insert_transform_stmt);
-}
-
-void db_insert_sign(
+static void sqlite_set_sign(
     int p, int q, int x, int y, int z, int face, const char *text)
 {
-    if (!db_enabled) {
-        return;
-    }
     sqlite3_reset(insert_sign_stmt);
     sqlite3_bind_int(insert_sign_stmt, 1, p);
     sqlite3_bind_int(insert_sign_stmt, 2, q);
@@ -512,10 +634,7 @@ void db_insert_sign(
     sqlite3_step(insert_sign_stmt);
 }
 
-void db_delete_sign(int x, int y, int z, int face) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_delete_sign(int x, int y, int z, int face) {
     sqlite3_reset(delete_sign_stmt);
     sqlite3_bind_int(delete_sign_stmt, 1, x);
     sqlite3_bind_int(delete_sign_stmt, 2, y);
@@ -524,10 +643,7 @@ void db_delete_sign(int x, int y, int z, int face) {
     sqlite3_step(delete_sign_stmt);
 }
 
-void db_delete_signs(int x, int y, int z) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_delete_signs(int x, int y, int z) {
     sqlite3_reset(delete_signs_stmt);
     sqlite3_bind_int(delete_signs_stmt, 1, x);
     sqlite3_bind_int(delete_signs_stmt, 2, y);
@@ -535,125 +651,118 @@ void db_delete_signs(int x, int y, int z) {
     sqlite3_step(delete_signs_stmt);
 }
 
-void db_delete_all_signs(void) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_delete_all_signs(void) {
     sqlite3_exec(db, "delete from sign;", NULL, NULL, NULL);
 }
 
-void db_load_blocks(Map *map, int p, int q) {
-    if (!db_enabled) {
-        return;
-    }
-    mtx_lock(&load_mtx);
-    sqlite3_reset(load_blocks_stmt);
-    sqlite3_bind_int(load_blocks_stmt, 1, p);
-    sqlite3_bind_int(load_blocks_stmt, 2, q);
-    while (sqlite3_step(load_blocks_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_blocks_stmt, 0);
-        int y = sqlite3_column_int(load_blocks_stmt, 1);
-        int z = sqlite3_column_int(load_blocks_stmt, 2);
-        int w = sqlite3_column_int(load_blocks_stmt, 3);
-        map_set(map, x, y, z, w);
-    }
-    mtx_unlock(&load_mtx);
-}
-
-void db_load_extras(Map *map, int p, int q) {
-    if (!db_enabled) {
-        return;
-    }
-    mtx_lock(&load_mtx);
-    sqlite3_reset(load_extras_stmt);
-    sqlite3_bind_int(load_extras_stmt, 1, p);
-    sqlite3_bind_int(load_extras_stmt, 2, q);
-    while (sqlite3_step(load_extras_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_extras_stmt, 0);
-        int y = sqlite3_column_int(load_extras_stmt, 1);
-        int z = sqlite3_column_int(load_extras_stmt, 2);
-        int w = sqlite3_column_int(load_extras_stmt, 3);
-        map_set(map, x, y, z, w);
-    }
-    mtx_unlock(&load_mtx);
-}
-
-void db_load_lights(Map *map, int p, int q) {
-    if (!db_enabled) {
-        return;
-    }
-    mtx_lock(&load_mtx);
-    sqlite3_reset(load_lights_stmt);
-    sqlite3_bind_int(load_lights_stmt, 1, p);
-    sqlite3_bind_int(load_lights_stmt, 2, q);
-    while (sqlite3_step(load_lights_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_lights_stmt, 0);
-        int y = sqlite3_column_int(load_lights_stmt, 1);
-        int z = sqlite3_column_int(load_lights_stmt, 2);
-        int w = sqlite3_column_int(load_lights_stmt, 3);
-        map_set(map, x, y, z, w);
-    }
-    mtx_unlock(&load_mtx);
-}
-
-void db_load_shapes(Map *map, int p, int q) {
-    if (!db_enabled) {
-        return;
+static void print_load_stats(LoadStats *ls) {
+    printf("db load: %u chunks, %.3fms avg", ls->chunks,
+           ls->total_time * 1000 / ls->chunks);
+    for (int i = 0; i <= DB_LAYERS; i++) {
+        printf(", %s %u rows %.3fms", load_stats_names[i],
+               ls->rows[i], ls->layer_time[i] * 1000 / ls->chunks);
     }
-    mtx_lock(&load_mtx);
-    sqlite3_reset(load_shapes_stmt);
-    sqlite3_bind_int(load_shapes_stmt, 1, p);
-    sqlite3_bind_int(load_shapes_stmt, 2, q);
-    while (sqlite3_step(load_shapes_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_shapes_stmt, 0);
-        int y = sqlite3_column_int(load_shapes_stmt, 1);
-        int z = sqlite3_column_int(load_shapes_stmt, 2);
-        int w = sqlite3_column_int(load_shapes_stmt, 3);
-        map_set(map, x, y, z, w);
-    }
-    mtx_unlock(&load_mtx);
+    printf("\n");
 }
 
-void db_load_transforms(Map *map, int p, int q) {
-    if (!db_enabled) {
-        return;
+/*
+ * Load the changes to every layer of chunk (p, q), and its signs, using a
+ * single statement (or a single blob lookup in blob storage mode). The
+ * layer maps are indexed in RingEntryType order (BLOCK to LIGHT). reader
+ * is the calling thread's own connection, or NULL to use the main one.
+ *
+ * The rows of each layer are returned in turn, so the time between the
+ * first rows of successive layers is counted as the time of the earlier
+ * layer in the verbose load stats.
+ */
+static void sqlite_load_chunk(
+    DbReader *reader, Map **maps, SignList *signs, int p, int q)
+{
+    DbReader *r = reader ? reader : &shared_reader;
+    LoadStats *ls = &r->stats;
+    if (r->mtx) {
+        mtx_lock(r->mtx);
     }
-    mtx_lock(&load_mtx);
-    sqlite3_reset(load_transforms_stmt);
-    sqlite3_bind_int(load_transforms_stmt, 1, p);
-    sqlite3_bind_int(load_transforms_stmt, 2, q);
-    while (sqlite3_step(load_transforms_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_transforms_stmt, 0);
-        int y = sqlite3_column_int(load_transforms_stmt, 1);
-        int z = sqlite3_column_int(load_transforms_stmt, 2);
-        int w = sqlite3_column_int(load_transforms_stmt, 3);
-        map_set(map, x, y, z, w);
+    double start = db_time();
+    double mark = start;
+    if (blob_storage) {
+        sqlite3_stmt *stmt = r->load_blob_stmt;
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, p);
+        sqlite3_bind_int(stmt, 2, q);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char *data = sqlite3_column_blob(stmt, 0);
+            int size = sqlite3_column_bytes(stmt, 0);
+            if (chunk_blob_load_maps(data, size, p, q, maps)) {
+                printf("Invalid chunk blob at: %d,%d\n", p, q);
+            }
+        }
+        sqlite3_reset(stmt);
+        // The lookup and decode of all the layers is counted as block
+        // layer time, the blob rows are not counted.
+        double now = db_time();
+        ls->layer_time[BLOCK] += now - mark;
+        mark = now;
+        stmt = r->load_signs_stmt;
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, p);
+        sqlite3_bind_int(stmt, 2, q);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            int x = sqlite3_column_int(stmt, 0);
+            int y = sqlite3_column_int(stmt, 1);
+            int z = sqlite3_column_int(stmt, 2);
+            int face = sqlite3_column_int(stmt, 3);
+            const char *text = (const char *)sqlite3_column_text(stmt, 4);
+            sign_list_add(signs, x, y, z, face, text);
+            ls->rows[DB_LAYERS]++;
+        }
+        sqlite3_reset(stmt);
+        ls->layer_time[DB_LAYERS] += db_time() - mark;
+    } else {
+        sqlite3_stmt *stmt = r->load_chunk_stmt;
+        int current = 0;
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, p);
+        sqlite3_bind_int(stmt, 2, q);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            int layer = sqlite3_column_int(stmt, 0);
+            int x = sqlite3_column_int(stmt, 1);
+            int y = sqlite3_column_int(stmt, 2);
+            int z = sqlite3_column_int(stmt, 3);
+            int w = sqlite3_column_int(stmt, 4);
+            if (layer != current) {
+                double now = db_time();
+                ls->layer_time[current] += now - mark;
+                mark = now;
+                current = layer;
+            }
+            if (layer == DB_LAYERS) {
+                const char *text = (const char *)sqlite3_column_text(
+                    stmt, 5);
+                sign_list_add(signs, x, y, z, w, text);
+            } else {
+                map_set(maps[layer], x, y, z, w);
+            }
+            ls->rows[layer]++;
+        }
+        sqlite3_reset(stmt);
+        ls->layer_time[current] += db_time() - mark;
     }
-    mtx_unlock(&load_mtx);
-}
-
-void db_load_signs(SignList *list, int p, int q) {
-    if (!db_enabled) {
-        return;
+    ls->total_time += db_time() - start;
+    if (++ls->chunks == LOAD_STATS_INTERVAL) {
+        if (config->verbose) {
+            print_load_stats(ls);
+        }
+        memset(ls, 0, sizeof(LoadStats));
     }
-    sqlite3_reset(load_signs_stmt);
-    sqlite3_bind_int(load_signs_stmt, 1, p);
-    sqlite3_bind_int(load_signs_stmt, 2, q);
-    while (sqlite3_step(load_signs_stmt) == SQLITE_ROW) {
-        int x = sqlite3_column_int(load_signs_stmt, 0);
-        int y = sqlite3_column_int(load_signs_stmt, 1);
-        int z = sqlite3_column_int(load_signs_stmt, 2);
-        int face = sqlite3_column_int(load_signs_stmt, 3);
-        const char *text = (const char *)sqlite3_column_text(
-            load_signs_stmt, 4);
-        sign_list_add(list, x, y, z, face, text);
+    if (r->mtx) {
+        mtx_unlock(r->mtx);
     }
 }
 
-const unsigned char *db_get_sign(int p, int q, int x, int y, int z, int face) {
-    if (!db_enabled) {
-        return NULL;
-    }
+static const unsigned char *sqlite_get_sign(
+    int p, int q, int x, int y, int z, int face)
+{
     sqlite3_reset(get_sign_stmt);
     sqlite3_bind_int(get_sign_stmt, 1, p);
     sqlite3_bind_int(get_sign_stmt, 2, q);
@@ -667,10 +776,7 @@ const unsigned char *db_get_sign(int p, int q, int x, int y, int z, int face) {
     return NULL;
 }
 
-int db_get_key(int p, int q) {
-    if (!db_enabled) {
-        return 0;
-    }
+static int sqlite_get_key(int p, int q) {
     sqlite3_reset(get_key_stmt);
     sqlite3_bind_int(get_key_stmt, 1, p);
     sqlite3_bind_int(get_key_stmt, 2, q);
@@ -680,16 +786,17 @@ int db_get_key(int p, int q) {
     return 0;
 }
 
-void db_set_key(int p, int q, int key) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_set_key(int p, int q, int key) {
     mtx_lock(&mtx);
     ring_put_key(&ring, p, q, key);
     cnd_signal(&cnd);
     mtx_unlock(&mtx);
 }
 
+static void sqlite_delete_all_keys(void) {
+    sqlite3_exec(db, "delete from key;", NULL, NULL, NULL);
+}
+
 void _db_set_key(int p, int q, int key) {
     sqlite3_reset(set_key_stmt);
     sqlite3_bind_int(set_key_stmt, 1, p);
@@ -698,20 +805,14 @@ void _db_set_key(int p, int q, int key) {
     sqlite3_step(set_key_stmt);
 }
 
-void db_set_option(char *name, char *value) {
-    if (!db_enabled) {
-        return;
-    }
+static void sqlite_set_option(const char *name, const char *value) {
     sqlite3_reset(set_option_stmt);
     sqlite3_bind_text(set_option_stmt, 1, name, -1, NULL);
     sqlite3_bind_text(set_option_stmt, 2, value, -1, NULL);
     sqlite3_step(set_option_stmt);
 }
 
-const unsigned char *db_get_option(char *name) {
-    if (!db_enabled) {
-        return NULL;
-    }
+static const unsigned char *sqlite_get_option(const char *name) {
     sqlite3_reset(get_option_stmt);
     sqlite3_bind_text(get_option_stmt, 1, name, -1, NULL);
     if (sqlite3_step(get_option_stmt) == SQLITE_ROW) {
@@ -746,47 +847,850 @@ void db_worker_stop(void) {
     ring_free(&ring);
 }
 
-int db_worker_run(__attribute__((unused)) void *arg) {
-    int running = 1;
-    while (running) {
-        RingEntry e;
-        mtx_lock(&mtx);
-        while (!ring_get(&ring, &e)) {
-            cnd_wait(&cnd, &mtx);
-        }
-        mtx_unlock(&mtx);
-        switch (e.type) {
-            case BLOCK:
-                _db_insert_block(e.p, e.q, e.x, e.y, e.z, e.w);
-                break;
-            case EXTRA:
-                _db_insert_extra(e.p, e.q, e.x, e.y, e.z, e.w);
-                break;
-            case SHAPE:
-                _db_insert_shape(e.p, e.q, e.x, e.y, e.z, e.w);
-                break;
-            case TRANSFORM:
-                _db_insert_transform(e.p, e.q, e.x, e.y, e.z, e.w);
-                break;
-            case LIGHT:
-                _db_insert_light(e.p, e.q, e.x, e.y, e.z, e.w);
-                break;
-            case SIGN:
-                // Signs are directly saved to game DB when setting them, so
-                // this branch is currently never used.
-                // If you change this to support SIGN in Ring here then
-                // remember to call free(e.sign) here as well.
-                break;
-            case KEY:
-                _db_set_key(e.p, e.q, e.key);
-                break;
-            case COMMIT:
-                _db_commit();
-                break;
-            case EXIT:
-                running = 0;
-                break;
-        }
+static int pending_write_cmp(const void *a, const void *b) {
+    const PendingWrite *pa = a;
+    const PendingWrite *pb = b;
+    const RingEntry *ea = &pa->e;
+    const RingEntry *eb = &pb->e;
+    #define CMP(f) if (ea->f != eb->f) return ea->f < eb->f ? -1 : 1
+    CMP(p);
+    CMP(q);
+    CMP(type);
+    if (ea->type != KEY) {
+        CMP(x);
+        CMP(y);
+        CMP(z);
     }
-    return 0;
+    #undef CMP
+    return pa->seq < pb->seq ? -1 : 1;
+}
+
+static int same_write_target(RingEntry *a, RingEntry *b) {
+    return a->type == b->type && a->p == b->p && a->q == b->q &&
+           (a->type == KEY || (a->x == b->x && a->y == b->y && a->z == b->z));
+}
+
+static void pending_add(RingEntry *e) {
+    if (pending_size == pending_capacity) {
+        pending_capacity = pending_capacity ? pending_capacity * 2 : 1024;
+        pending = realloc(pending, sizeof(PendingWrite) * pending_capacity);
+    }
+    PendingWrite *w = pending + pending_size;
+    memcpy(&w->e, e, sizeof(RingEntry));
+    w->seq = pending_size++;
+}
+
+static void bind_layer_row(sqlite3_stmt *stmt, int index, RingEntry *e) {
+    sqlite3_bind_int(stmt, index + 1, e->p);
+    sqlite3_bind_int(stmt, index + 2, e->q);
+    sqlite3_bind_int(stmt, index + 3, e->x);
+    sqlite3_bind_int(stmt, index + 4, e->y);
+    sqlite3_bind_int(stmt, index + 5, e->z);
+    sqlite3_bind_int(stmt, index + 6, e->w);
+}
+
+/*
+ * Write the coalesced rows of each layer in (p, q, x, y, z) order using
+ * multi-row inserts of DB_BATCH_ROWS rows.
+ */
+static void _db_flush_rows(unsigned int count) {
+    for (int layer = 0; layer < DB_LAYERS; layer++) {
+        sqlite3_stmt *batch = insert_batch_stmts[layer];
+        int rows = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            RingEntry *e = &pending[i].e;
+            if ((int)e->type != layer) {
+                continue;
+            }
+            if (rows == 0) {
+                sqlite3_reset(batch);
+            }
+            bind_layer_row(batch, rows * 6, e);
+            if (++rows == DB_BATCH_ROWS) {
+                sqlite3_step(batch);
+                writer_stats.statements++;
+                rows = 0;
+            }
+        }
+        // Rows that did not fill a batch are written one at a time
+        if (rows > 0) {
+            for (unsigned int i = count; i-- > 0 && rows > 0; ) {
+                RingEntry *e = &pending[i].e;
+                if ((int)e->type != layer) {
+                    continue;
+                }
+                sqlite3_reset(insert_stmts[layer]);
+                bind_layer_row(insert_stmts[layer], 0, e);
+                sqlite3_step(insert_stmts[layer]);
+                writer_stats.statements++;
+                rows--;
+            }
+        }
+    }
+}
+
+static void _db_set_blob(int p, int q, ChunkBlob *blob) {
+    int size;
+    unsigned char *data = chunk_blob_encode(blob, p, q, &size);
+    sqlite3_reset(set_blob_stmt);
+    sqlite3_bind_int(set_blob_stmt, 1, p);
+    sqlite3_bind_int(set_blob_stmt, 2, q);
+    sqlite3_bind_blob(set_blob_stmt, 3, data, size, SQLITE_TRANSIENT);
+    sqlite3_step(set_blob_stmt);
+    free(data);
+}
+
+/*
+ * Apply the coalesced writes to the blob of each chunk they touch, each
+ * chunk is read, updated and written back once per flush.
+ */
+static void _db_flush_blobs(unsigned int count) {
+    unsigned int i = 0;
+    while (i < count) {
+        RingEntry *first = &pending[i].e;
+        if (first->type == KEY) {
+            i++;
+            continue;
+        }
+        int p = first->p;
+        int q = first->q;
+        chunk_blob_clear(&writer_blob);
+        sqlite3_reset(get_blob_stmt);
+        sqlite3_bind_int(get_blob_stmt, 1, p);
+        sqlite3_bind_int(get_blob_stmt, 2, q);
+        if (sqlite3_step(get_blob_stmt) == SQLITE_ROW) {
+            const unsigned char *data = sqlite3_column_blob(get_blob_stmt, 0);
+            int size = sqlite3_column_bytes(get_blob_stmt, 0);
+            if (chunk_blob_decode(&writer_blob, p, q, data, size)) {
+                printf("Invalid chunk blob at: %d,%d\n", p, q);
+                chunk_blob_clear(&writer_blob);
+            }
+        }
+        for (; i < count; i++) {
+            RingEntry *e = &pending[i].e;
+            if (e->p != p || e->q != q) {
+                break;
+            }
+            if (e->type != KEY) {
+                chunk_blob_set(&writer_blob, e->type, e->x, e->y, e->z, e->w);
+            }
+        }
+        _db_set_blob(p, q, &writer_blob);
+        writer_stats.statements += 2;
+    }
+}
+
+/*
+ * Write out the pending writes. Only the last write to each (layer, p, q,
+ * x, y, z) is kept.
+ */
+static int _db_flush(void) {
+    if (pending_size == 0) {
+        return 0;
+    }
+    double start = db_time();
+    qsort(pending, pending_size, sizeof(PendingWrite), pending_write_cmp);
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < pending_size; i++) {
+        if (i + 1 < pending_size &&
+            same_write_target(&pending[i].e, &pending[i + 1].e)) {
+            continue;  // superseded by a later write
+        }
+        pending[count++] = pending[i];
+    }
+    if (blob_storage) {
+        _db_flush_blobs(count);
+    } else {
+        _db_flush_rows(count);
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        RingEntry *e = &pending[i].e;
+        if (e->type == KEY) {
+            _db_set_key(e->p, e->q, e->key);
+            writer_stats.statements++;
+        }
+    }
+    double elapsed = db_time() - start;
+    writer_stats.entries += pending_size;
+    writer_stats.written += count;
+    writer_stats.flushes++;
+    writer_stats.flush_time += elapsed;
+    if (elapsed > writer_stats.max_flush_time) {
+        writer_stats.max_flush_time = elapsed;
+    }
+    pending_size = 0;
+    return 1;
+}
+
+static void print_writer_stats(void) {
+    WriterStats *ws = &writer_stats;
+    if (config->verbose && ws->entries > 0) {
+        printf("db writer: %u writes, %u coalesced, %u statements, "
+               "%u flushes, %.2fms avg %.2fms max\n",
+               ws->entries, ws->entries - ws->written, ws->statements,
+               ws->flushes, ws->flush_time * 1000 / ws->flushes,
+               ws->max_flush_time * 1000);
+    }
+    memset(ws, 0, sizeof(WriterStats));
+}
+
+/*
+ * Copy the next pages of an online backup. This runs on the writer thread
+ * between flushes, so the backup never competes with writes for the main
+ * connection, and writes made through it are copied to the backup as well.
+ */
+static void _db_backup_step(void) {
+    mtx_lock(&mtx);
+    sqlite3_backup *b = backup;
+    backup_queued = 0;
+    mtx_unlock(&mtx);
+    if (!b) {
+        return;
+    }
+    int rc = sqlite3_backup_step(b, BACKUP_STEP_PAGES);
+    if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+        // The source can not be read while it has uncommitted writes
+        _db_commit();
+        rc = sqlite3_backup_step(b, BACKUP_STEP_PAGES);
+    }
+    mtx_lock(&mtx);
+    backup_remaining = sqlite3_backup_remaining(b);
+    backup_pagecount = sqlite3_backup_pagecount(b);
+    if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) {
+        if (rc == SQLITE_DONE) {
+            rc = sqlite3_backup_finish(b);
+        } else {
+            sqlite3_backup_finish(b);
+        }
+        if (rc != SQLITE_OK) {
+            printf("Backup failed: %s\n", sqlite3_errmsg(backup_db));
+        }
+        sqlite3_close(backup_db);
+        backup_status = rc == SQLITE_OK ? DB_BACKUP_DONE : DB_BACKUP_FAILED;
+        backup = NULL;
+        backup_db = NULL;
+    }
+    mtx_unlock(&mtx);
+}
+
+int db_worker_run(__attribute__((unused)) void *arg) {
+    int running = 1;
+    chunk_blob_alloc(&writer_blob);
+    while (running) {
+        RingEntry e;
+        mtx_lock(&mtx);
+        while (ring_empty(&ring)) {
+            cnd_wait(&cnd, &mtx);
+        }
+        // Take everything queued so far, so repeated writes to the same
+        // block can be combined.
+        int commit = 0;
+        int step_backup = 0;
+        while (!commit && running && ring_get(&ring, &e)) {
+            switch (e.type) {
+                case BLOCK:
+                case EXTRA:
+                case SHAPE:
+                case TRANSFORM:
+                case LIGHT:
+                case KEY:
+                    pending_add(&e);
+                    break;
+                case SIGN:
+                    // Signs are directly saved to game DB when setting them,
+                    // so this branch is currently never used.
+                    // If you change this to support SIGN in Ring here then
+                    // remember to call free(e.sign) here as well.
+                    break;
+                case COMMIT:
+                    commit = 1;
+                    break;
+                case BACKUP:
+                    step_backup = 1;
+                    break;
+                case EXIT:
+                    running = 0;
+                    break;
+            }
+        }
+        mtx_unlock(&mtx);
+        // In WAL mode commits are cheap, and the chunk loading connections
+        // only see the writes once they are committed.
+        if ((_db_flush() && wal_mode) || commit) {
+            _db_commit();
+        }
+        if (commit) {
+            print_writer_stats();
+        }
+        if (step_backup) {
+            _db_backup_step();
+        }
+    }
+    free(pending);
+    pending = NULL;
+    pending_size = pending_capacity = 0;
+    chunk_blob_free(&writer_blob);
+    return 0;
+}
+
+/*
+ * Load the stored changes to every layer of chunk (p, q) into blob, signs
+ * are not included.
+ */
+void db_load_chunk_changes(
+    DbReader *reader, ChunkBlob *blob, int p, int q)
+{
+    chunk_blob_clear(blob);
+    if (!sqlite_enabled()) {
+        return;
+    }
+    DbReader *r = reader ? reader : &shared_reader;
+    if (r->mtx) {
+        mtx_lock(r->mtx);
+    }
+    if (blob_storage) {
+        sqlite3_stmt *stmt = r->load_blob_stmt;
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, p);
+        sqlite3_bind_int(stmt, 2, q);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char *data = sqlite3_column_blob(stmt, 0);
+            int size = sqlite3_column_bytes(stmt, 0);
+            if (chunk_blob_decode(blob, p, q, data, size)) {
+                printf("Invalid chunk blob at: %d,%d\n", p, q);
+                chunk_blob_clear(blob);
+            }
+        }
+        sqlite3_reset(stmt);
+    } else {
+        sqlite3_stmt *stmt = r->load_chunk_stmt;
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, p);
+        sqlite3_bind_int(stmt, 2, q);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            int layer = sqlite3_column_int(stmt, 0);
+            if (layer < DB_LAYERS) {
+                chunk_blob_add(blob, layer,
+                               sqlite3_column_int(stmt, 1),
+                               sqlite3_column_int(stmt, 2),
+                               sqlite3_column_int(stmt, 3),
+                               sqlite3_column_int(stmt, 4));
+            }
+        }
+        sqlite3_reset(stmt);
+    }
+    blob->signs.size = 0;
+    if (r->mtx) {
+        mtx_unlock(r->mtx);
+    }
+}
+
+/*
+ * Replace the stored changes to the layers of chunk (p, q) with those in
+ * blob. This writes directly on the calling thread, it is meant for offline
+ * tools and must not be mixed with queued writes to the same chunk.
+ */
+void db_save_chunk_changes(int p, int q, ChunkBlob *blob) {
+    if (!sqlite_enabled()) {
+        return;
+    }
+    if (blob_storage && chunk_blob_empty(blob)) {
+        // Everything was pruned, the chunk keeps no row
+        sqlite3_reset(delete_blob_stmt);
+        sqlite3_bind_int(delete_blob_stmt, 1, p);
+        sqlite3_bind_int(delete_blob_stmt, 2, q);
+        sqlite3_step(delete_blob_stmt);
+        return;
+    }
+    if (blob_storage) {
+        _db_set_blob(p, q, blob);
+        return;
+    }
+    for (int layer = 0; layer < DB_LAYERS; layer++) {
+        sqlite3_reset(delete_chunk_stmts[layer]);
+        sqlite3_bind_int(delete_chunk_stmts[layer], 1, p);
+        sqlite3_bind_int(delete_chunk_stmts[layer], 2, q);
+        sqlite3_step(delete_chunk_stmts[layer]);
+        BlobLayer *l = blob->layers + layer;
+        RingEntry e;
+        e.p = p;
+        e.q = q;
+        for (unsigned int i = 0; i < l->size; i++) {
+            e.x = l->data[i].x;
+            e.y = l->data[i].y;
+            e.z = l->data[i].z;
+            e.w = l->data[i].w;
+            sqlite3_reset(insert_stmts[layer]);
+            bind_layer_row(insert_stmts[layer], 0, &e);
+            sqlite3_step(insert_stmts[layer]);
+        }
+    }
+}
+
+/*
+ * Find the chunks that have stored changes, *chunks is set to a malloc'd
+ * array of (p, q) pairs. Returns the number of chunks.
+ */
+int db_changed_chunks(int **chunks) {
+    *chunks = NULL;
+    if (!sqlite_enabled()) {
+        return 0;
+    }
+    char query[512];
+    if (blob_storage) {
+        snprintf(query, sizeof(query), "select p, q from chunk_blob;");
+    } else {
+        int n = 0;
+        for (int i = 0; i < DB_LAYERS; i++) {
+            n += snprintf(query + n, sizeof(query) - n, "%sselect p, q from %s",
+                          i ? " union " : "", layer_tables[i]);
+        }
+        snprintf(query + n, sizeof(query) - n, ";");
+    }
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL)) {
+        return 0;
+    }
+    int count = 0;
+    int capacity = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            *chunks = realloc(*chunks, sizeof(int) * 2 * capacity);
+        }
+        (*chunks)[count * 2] = sqlite3_column_int(stmt, 0);
+        (*chunks)[count * 2 + 1] = sqlite3_column_int(stmt, 1);
+        count++;
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+void db_vacuum(void) {
+    if (!sqlite_enabled()) {
+        return;
+    }
+    sqlite3_exec(db, "commit; vacuum; begin;", NULL, NULL, NULL);
+}
+
+/*
+ * Start an online backup of the game file to path. The pages are copied a
+ * few at a time by the writer thread, each call to db_backup_tick queues the
+ * next step. Returns 0 if the backup was started.
+ */
+int db_backup_start(const char *path) {
+    if (!sqlite_enabled() || strcmp(path, db_path) == 0) {
+        return -1;
+    }
+    int rc = -1;
+    mtx_lock(&mtx);
+    if (!backup) {
+        if (sqlite3_open(path, &backup_db) == SQLITE_OK) {
+            backup = sqlite3_backup_init(backup_db, "main", db, "main");
+        }
+        if (backup) {
+            backup_status = DB_BACKUP_RUNNING;
+            backup_queued = 0;
+            backup_remaining = backup_pagecount = 0;
+            rc = 0;
+        } else {
+            printf("Could not start backup to %s: %s\n", path,
+                   sqlite3_errmsg(backup_db));
+            sqlite3_close(backup_db);
+            backup_db = NULL;
+        }
+    }
+    mtx_unlock(&mtx);
+    return rc;
+}
+
+void db_backup_tick(void) {
+    if (!sqlite_enabled()) {
+        return;
+    }
+    mtx_lock(&mtx);
+    if (backup && !backup_queued) {
+        backup_queued = 1;
+        ring_put_backup(&ring);
+        cnd_signal(&cnd);
+    }
+    mtx_unlock(&mtx);
+}
+
+/*
+ * Get the state of the last backup and the pages still to copy out of the
+ * page count of the game file. A finished backup is reported once, after
+ * that the state is back to DB_BACKUP_NONE.
+ */
+int db_backup_progress(int *remaining, int *pagecount) {
+    if (!sqlite_enabled()) {
+        return DB_BACKUP_NONE;
+    }
+    mtx_lock(&mtx);
+    int status = backup_status;
+    *remaining = backup_remaining;
+    *pagecount = backup_pagecount;
+    if (status != DB_BACKUP_RUNNING) {
+        backup_status = DB_BACKUP_NONE;
+    }
+    mtx_unlock(&mtx);
+    return status;
+}
+
+static unsigned int _db_convert_to_blobs(void) {
+    char query[1024];
+    int n = 0;
+    for (int i = 0; i < DB_LAYERS; i++) {
+        n += snprintf(query + n, sizeof(query) - n,
+                      "%sselect %d, p, q, x, y, z, w from %s",
+                      i ? " union all " : "", i, layer_tables[i]);
+    }
+    snprintf(query + n, sizeof(query) - n, " order by 2, 3;");
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL)) {
+        return 0;
+    }
+    ChunkBlob blob;
+    chunk_blob_alloc(&blob);
+    unsigned int chunks = 0;
+    int has_chunk = 0;
+    int p = 0;
+    int q = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int layer = sqlite3_column_int(stmt, 0);
+        int row_p = sqlite3_column_int(stmt, 1);
+        int row_q = sqlite3_column_int(stmt, 2);
+        if (has_chunk && (row_p != p || row_q != q)) {
+            _db_set_blob(p, q, &blob);
+            chunk_blob_clear(&blob);
+            chunks++;
+        }
+        has_chunk = 1;
+        p = row_p;
+        q = row_q;
+        chunk_blob_add(&blob, layer, sqlite3_column_int(stmt, 3),
+                       sqlite3_column_int(stmt, 4),
+                       sqlite3_column_int(stmt, 5),
+                       sqlite3_column_int(stmt, 6));
+    }
+    if (has_chunk) {
+        _db_set_blob(p, q, &blob);
+        chunks++;
+    }
+    sqlite3_finalize(stmt);
+    chunk_blob_free(&blob);
+    for (int i = 0; i < DB_LAYERS; i++) {
+        snprintf(query, sizeof(query), "delete from %s;", layer_tables[i]);
+        sqlite3_exec(db, query, NULL, NULL, NULL);
+    }
+    return chunks;
+}
+
+static unsigned int _db_convert_to_rows(void) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "select p, q, data from chunk_blob;", -1,
+                           &stmt, NULL)) {
+        return 0;
+    }
+    ChunkBlob blob;
+    chunk_blob_alloc(&blob);
+    unsigned int chunks = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        RingEntry e;
+        e.p = sqlite3_column_int(stmt, 0);
+        e.q = sqlite3_column_int(stmt, 1);
+        const unsigned char *data = sqlite3_column_blob(stmt, 2);
+        int size = sqlite3_column_bytes(stmt, 2);
+        if (chunk_blob_decode(&blob, e.p, e.q, data, size)) {
+            printf("Invalid chunk blob at: %d,%d\n", e.p, e.q);
+            continue;
+        }
+        for (int layer = 0; layer < DB_LAYERS; layer++) {
+            BlobLayer *l = blob.layers + layer;
+            for (unsigned int i = 0; i < l->size; i++) {
+                e.x = l->data[i].x;
+                e.y = l->data[i].y;
+                e.z = l->data[i].z;
+                e.w = l->data[i].w;
+                sqlite3_reset(insert_stmts[layer]);
+                bind_layer_row(insert_stmts[layer], 0, &e);
+                sqlite3_step(insert_stmts[layer]);
+            }
+        }
+        chunks++;
+    }
+    sqlite3_finalize(stmt);
+    chunk_blob_free(&blob);
+    sqlite3_exec(db, "delete from chunk_blob;", NULL, NULL, NULL);
+    return chunks;
+}
+
+/*
+ * Convert the world data of the game file at path to the given storage
+ * format, either "rows" (one row per block per layer) or "blob" (one row
+ * per chunk).
+ */
+int db_convert_storage(char *path, const char *storage) {
+    int to_blob;
+    if (strcmp(storage, "blob") == 0) {
+        to_blob = 1;
+    } else if (strcmp(storage, "rows") == 0) {
+        to_blob = 0;
+    } else {
+        printf("Unknown storage format: %s (use blob or rows)\n", storage);
+        return 1;
+    }
+    db_enable();
+    if (db_init(path)) {
+        printf("Could not open: %s\n", path);
+        return 1;
+    }
+    if (backend != &sqlite_storage) {
+        printf("Storage formats are only used by the sqlite backend\n");
+        db_close();
+        return 1;
+    }
+    if (blob_storage == to_blob) {
+        printf("%s already uses %s storage\n", path, storage);
+        db_close();
+        return 0;
+    }
+    double start = db_time();
+    unsigned int chunks = to_blob ? _db_convert_to_blobs() :
+                                    _db_convert_to_rows();
+    db_set_option("storage", (char *)storage);
+    blob_storage = to_blob;
+    db_vacuum();
+    printf("Converted %u chunks of %s to %s storage in %.2fs\n",
+           chunks, path, storage, db_time() - start);
+    db_close();
+    return 0;
+}
+
+static const StorageBackend sqlite_storage = {
+    "sqlite",
+    sqlite_open,
+    sqlite_close,
+    sqlite_commit,
+    sqlite_set_layer,
+    sqlite_get_light,
+    sqlite_set_sign,
+    sqlite_get_sign,
+    sqlite_delete_sign,
+    sqlite_delete_signs,
+    sqlite_delete_all_signs,
+    sqlite_load_chunk,
+    sqlite_get_key,
+    sqlite_set_key,
+    sqlite_delete_all_keys,
+    sqlite_set_option,
+    sqlite_get_option,
+    sqlite_clear_state,
+    sqlite_save_state,
+    sqlite_load_state,
+    sqlite_clear_player_names,
+    sqlite_save_player_name,
+    sqlite_load_player_name,
+};
+
+int db_init(char *path) {
+    if (!db_enabled) {
+        return 0;
+    }
+    backend = NULL;
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, config->db_backend) == 0) {
+            backend = backends[i];
+        }
+    }
+    if (!backend) {
+        printf("Unknown db backend: %s (use sqlite, memory or log)\n",
+               config->db_backend);
+        backend = &sqlite_storage;
+        return 1;
+    }
+    if (config->verbose) {
+        printf("\nLoading db from: %s (%s)\n", path, backend->name);
+    }
+    return backend->open(path);
+}
+
+void db_close(void) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->close();
+}
+
+void db_commit(void) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->commit();
+}
+
+void db_clear_state(void) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->clear_state();
+}
+
+void db_save_state(float x, float y, float z, float rx, float ry) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->save_state(x, y, z, rx, ry);
+}
+
+int db_load_state(float *x, float *y, float *z, float *rx, float *ry,
+                  int player) {
+    if (!db_enabled) {
+        return 0;
+    }
+    return backend->load_state(x, y, z, rx, ry, player);
+}
+
+void db_clear_player_names(void) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->clear_player_names();
+}
+
+void db_save_player_name(const char *name) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->save_player_name(name);
+}
+
+int db_load_player_name(char *name, int max_name_length, int player) {
+    if (!db_enabled) {
+        return 0;
+    }
+    return backend->load_player_name(name, max_name_length, player);
+}
+
+void db_insert_block(int p, int q, int x, int y, int z, int w) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->set_layer(BLOCK, p, q, x, y, z, w);
+}
+
+void db_insert_extra(int p, int q, int x, int y, int z, int w) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->set_layer(EXTRA, p, q, x, y, z, w);
+}
+
+void db_insert_light(int p, int q, int x, int y, int z, int w) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->set_layer(LIGHT, p, q, x, y, z, w);
+}
+
+void db_insert_shape(int p, int q, int x, int y, int z, int w) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->set_layer(SHAPE, p, q, x, y, z, w);
+}
+
+void db_insert_transform(int p, int q, int x, int y, int z, int w) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->set_layer(TRANSFORM, p, q, x, y, z, w);
+}
+
+int db_get_light(int p, int q, int x, int y, int z) {
+    if (!db_enabled) {
+        return 0;
+    }
+    return backend->get_light(p, q, x, y, z);
+}
+
+void db_insert_sign(
+    int p, int q, int x, int y, int z, int face, const char *text)
+{
+    if (!db_enabled) {
+        return;
+    }
+    backend->set_sign(p, q, x, y, z, face, text);
+}
+
+void db_delete_sign(int x, int y, int z, int face) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->delete_sign(x, y, z, face);
+}
+
+void db_delete_signs(int x, int y, int z) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->delete_signs(x, y, z);
+}
+
+void db_delete_all_signs(void) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->delete_all_signs();
+}
+
+void db_load_chunk(
+    DbReader *reader, Map **maps, SignList *signs, int p, int q)
+{
+    if (!db_enabled) {
+        return;
+    }
+    backend->load_chunk(reader, maps, signs, p, q);
+}
+
+const unsigned char *db_get_sign(int p, int q, int x, int y, int z, int face) {
+    if (!db_enabled) {
+        return NULL;
+    }
+    return backend->get_sign(p, q, x, y, z, face);
+}
+
+int db_get_key(int p, int q) {
+    if (!db_enabled) {
+        return 0;
+    }
+    return backend->get_key(p, q);
+}
+
+void db_set_key(int p, int q, int key) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->set_key(p, q, key);
+}
+
+void db_delete_all_keys(void) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->delete_all_keys();
+}
+
+void db_set_option(char *name, char *value) {
+    if (!db_enabled) {
+        return;
+    }
+    backend->set_option(name, value);
+}
+
+const unsigned char *db_get_option(char *name) {
+    if (!db_enabled) {
+        return NULL;
+    }
+    return backend->get_option(name);
 }
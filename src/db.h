@@ -1,8 +1,16 @@
 #pragma once
 
+#include "chunk_blob.h"
 #include "map.h"
 #include "sign.h"
 
+typedef struct DbReader DbReader;
+
+#define DB_BACKUP_NONE 0
+#define DB_BACKUP_RUNNING 1
+#define DB_BACKUP_DONE 2
+#define DB_BACKUP_FAILED 3
+
 void db_enable(void);
 void db_disable(void);
 int get_db_enabled(void);
@@ -26,19 +34,27 @@ void db_insert_sign(
 void db_delete_sign(int x, int y, int z, int face);
 void db_delete_signs(int x, int y, int z);
 void db_delete_all_signs(void);
-void db_load_blocks(Map *map, int p, int q);
-void db_load_extras(Map *map, int p, int q);
-void db_load_lights(Map *map, int p, int q);
-void db_load_shapes(Map *map, int p, int q);
-void db_load_transforms(Map *map, int p, int q);
-void db_load_signs(SignList *list, int p, int q);
+void db_load_chunk(
+    DbReader *reader, Map **maps, SignList *signs, int p, int q);
+void db_load_chunk_changes(
+    DbReader *reader, ChunkBlob *blob, int p, int q);
+void db_save_chunk_changes(int p, int q, ChunkBlob *blob);
+int db_changed_chunks(int **chunks);
+void db_vacuum(void);
+int db_backup_start(const char *path);
+void db_backup_tick(void);
+int db_backup_progress(int *remaining, int *pagecount);
+DbReader *db_reader_open(void);
+void db_reader_close(DbReader *reader);
 const unsigned char *db_get_sign(int p, int q, int x, int y, int z, int face);
 int db_get_light(int p, int q, int x, int y, int z);
 int db_get_key(int p, int q);
 void db_set_key(int p, int q, int key);
+void db_delete_all_keys(void);
 void db_set_option(char *name, char *value);
 const unsigned char *db_get_option(char *name);
 void db_worker_start(void);
 void db_worker_stop(void);
 int db_worker_run(void *arg);
+int db_convert_storage(char *path, const char *storage);
 
@@ -0,0 +1,137 @@
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fields.h"
+
+/*
+ * Readers for the comma separated fields of server lines. Each expects a ','
+ * at *s followed by the value, and on success moves *s past them and returns
+ * 1. They read what the ",%d", ",%f" and ",%lf" conversions of sscanf read
+ * from the numbers servers send, without its cost of interpreting a format
+ * for every field. Floats end where strtod ends them, so unlike sscanf a
+ * dangling exponent such as the "e+" of "1e+" is left unread.
+ */
+int read_int_field(const char **s, int *value) {
+    const char *c = *s;
+    if (*c++ != ',') {
+        return 0;
+    }
+    while (isspace((unsigned char)*c)) {
+        c++;
+    }
+    int negative = *c == '-';
+    if (*c == '-' || *c == '+') {
+        c++;
+    }
+    if (!isdigit((unsigned char)*c)) {
+        return 0;
+    }
+    unsigned long long n = 0;
+    while (isdigit((unsigned char)*c)) {
+        // Saturate like strtol does, the result is then clamped to a long
+        if (n <= (ULLONG_MAX - 9) / 10) {
+            n = n * 10 + (*c - '0');
+        } else {
+            n = ULLONG_MAX;
+        }
+        c++;
+    }
+    long result;
+    if (negative) {
+        result = n > (unsigned long long)LONG_MAX + 1 ? LONG_MIN :
+                 (long)(0 - n);
+    } else {
+        result = n > LONG_MAX ? LONG_MAX : (long)n;
+    }
+    *value = (int)result;
+    *s = c;
+    return 1;
+}
+
+int read_int_fields(const char **s, int *values, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!read_int_field(s, values + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int read_float_field(const char **s, float *value) {
+    const char *c = *s;
+    if (*c++ != ',') {
+        return 0;
+    }
+    char *end;
+    float result = strtof(c, &end);
+    if (end == c) {
+        return 0;
+    }
+    *value = result;
+    *s = end;
+    return 1;
+}
+
+int read_float_fields(const char **s, float *values, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!read_float_field(s, values + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int read_double_field(const char **s, double *value) {
+    const char *c = *s;
+    if (*c++ != ',') {
+        return 0;
+    }
+    char *end;
+    double result = strtod(c, &end);
+    if (end == c) {
+        return 0;
+    }
+    *value = result;
+    *s = end;
+    return 1;
+}
+
+static int copy_field(const char **s, const char *c, char *out, int size,
+                      const char *delim)
+{
+    int length = strcspn(c, delim);
+    if (length > size - 1) {
+        length = size - 1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    memcpy(out, c, length);
+    out[length] = '\0';
+    *s = c + length;
+    return 1;
+}
+
+/*
+ * Copy a field of up to size - 1 characters not in delim to out, like the
+ * ",%[^...]" conversion of sscanf. At least one character must be read.
+ */
+int read_text_field(const char **s, char *out, int size, const char *delim) {
+    const char *c = *s;
+    if (*c++ != ',') {
+        return 0;
+    }
+    return copy_field(s, c, out, size, delim);
+}
+
+// Like read_text_field for a ",%s" conversion, skipping leading whitespace.
+int read_word_field(const char **s, char *out, int size) {
+    static const char *whitespace = " \t\n\v\f\r";
+    const char *c = *s;
+    if (*c++ != ',') {
+        return 0;
+    }
+    c += strspn(c, whitespace);
+    return copy_field(s, c, out, size, whitespace);
+}
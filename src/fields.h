@@ -0,0 +1,9 @@
+#pragma once
+
+int read_int_field(const char **s, int *value);
+int read_int_fields(const char **s, int *values, int count);
+int read_float_field(const char **s, float *value);
+int read_float_fields(const char **s, float *values, int count);
+int read_double_field(const char **s, double *value);
+int read_text_field(const char **s, char *out, int size, const char *delim);
+int read_word_field(const char **s, char *out, int size);
@@ -12,19 +12,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#include "chunk_cache.h"
 #include "client.h"
 #include "config.h"
 #include "cube.h"
 #include "db.h"
 #include "door.h"
 #include "fence.h"
+#include "fields.h"
 #include "item.h"
 #include "map.h"
 #include "matrix.h"
+#include "netstats.h"
 #include "noise.h"
 #include "pg.h"
 #include "pg_joystick.h"
+#include "protocol.h"
 #include "pw.h"
 #include "pwlua.h"
 #include "pwlua_standalone.h"
@@ -35,11 +40,18 @@
 #include "ui.h"
 #include "util.h"
 #include "world.h"
+#include "worldgen_cache.h"
 #include "x11_event_handler.h"
 
 #define MAX_CHUNKS 8192
 #define MAX_CLIENTS 128
 #define WORKERS 1
+// Chunk layer messages that may wait to be merged before reading more
+#define MAX_STAGED_LAYERS 64
+// Seconds between updates of the priorities of chunks asked of the server
+#define CHUNK_REQUEST_INTERVAL 0.25
+// Seconds between pings of the server
+#define PING_INTERVAL 5
 #define MAX_NAME_LENGTH 32
 
 #define MAX_HISTORY_SIZE 20
@@ -57,6 +69,11 @@
 #define WORKER_BUSY 1
 #define WORKER_DONE 2
 
+#define REQUEST_NONE 0
+#define REQUEST_QUEUED 1
+#define REQUEST_SENT 2
+#define REQUEST_DRAW 3  // answered, waiting for a mesh with the answer
+
 #define UNASSIGNED -1
 
 #define DEADZONE 0.0
@@ -67,6 +84,14 @@
 #define FLY_PICK 3
 #define ZOOM_ORTHO 4
 #define SHOULDER_BUTTON_MODE_COUNT 5
+
+#define TEXT_CACHE_SIZE 128
+#define TEXT_CACHE_MAX_LENGTH 64
+
+#define OBSERVE_TEXTURE_UNIT 4
+#define OBSERVE_VIEW_DIRECT 0
+#define OBSERVE_VIEW_RENDER 1
+#define OBSERVE_VIEW_CACHED 2
 const char *shoulder_button_modes[SHOULDER_BUTTON_MODE_COUNT] = {
     "Crouch/Jump",
     "Remove/Add",
@@ -84,12 +109,31 @@ float hud_text_color[4] = {0.85, 0.85, 0.85, 1.0};
 
 static int terminate;
 
+// Cached glyph geometry of a single sign
+typedef struct {
+    int x;
+    int y;
+    int z;
+    int face;
+    int shape;
+    char text[MAX_SIGN_LENGTH];
+    GLfloat *data;
+    int faces;
+    int offset;  // first glyph of this sign in the chunk's sign_buffer
+} SignMesh;
+
+typedef struct {
+    unsigned int size;
+    SignMesh *data;
+} SignMeshList;
+
 typedef struct {
     Map map;
     Map extra;
     Map lights;
     Map shape;
     SignList signs;
+    SignMeshList sign_meshes;
     Map transform;
     DoorMap doors;
     int p;
@@ -102,6 +146,10 @@ typedef struct {
     int maxy;
     GLuint buffer;
     GLuint sign_buffer;
+    int request;           // one of the REQUEST_ values
+    int request_key;
+    int request_priority;  // as last sent to the server
+    double request_time;   // netstats_time() when asked for
 } Chunk;
 
 typedef struct {
@@ -131,6 +179,33 @@ typedef struct {
     int exit_requested;
 } Worker;
 
+// A chunk layer message from the server. The stage thread decodes it and
+// writes it to the database, then the main thread merges it into the chunk.
+typedef struct StagedLayer {
+    unsigned char *message;
+    int size;
+    int layer;
+    int p;
+    int q;
+    int count;
+    int applied;
+    int *entries;
+    int ready;
+    double time;  // spent decoding and merging
+    struct StagedLayer *next;
+} StagedLayer;
+
+typedef struct {
+    thrd_t thrd;
+    mtx_t mtx;
+    cnd_t cnd;
+    StagedLayer *first;
+    StagedLayer *last;
+    StagedLayer *unstaged;
+    int count;
+    int running;
+} Stage;
+
 mtx_t edit_ring_mtx;
 
 typedef struct {
@@ -155,7 +230,6 @@ typedef struct Player {
     State state;
     State state1;
     State state2;
-    GLuint buffer;
     int texture_index;
     int is_active;
 } Player;
@@ -185,6 +259,30 @@ typedef struct {
     int has_sign;
 } UndoBlock;
 
+typedef struct {
+    char text[TEXT_CACHE_MAX_LENGTH];
+    unsigned int hash;
+    float x;
+    float y;
+    float n;
+    GLuint buffer;
+    unsigned int last_used;
+} TextCacheEntry;
+
+typedef struct {
+    GLuint framebuffer;
+    GLuint texture;
+    GLuint depth;
+    GLuint buffer;
+    int width;
+    int height;
+    int age;
+    int failed;
+    int face_count;
+    int observe;
+    int observe_client_id;
+} ObserveView;
+
 typedef struct {
     Player *player;
     int item_index;
@@ -291,6 +389,8 @@ typedef struct {
     int observe1_client_id;
     int observe2;
     int observe2_client_id;
+    ObserveView observe1_view;
+    ObserveView observe2_view;
 
     int mouse_id;
     int keyboard_id;
@@ -301,6 +401,11 @@ typedef struct {
     Worker workers[WORKERS];
     Chunk chunks[MAX_CHUNKS];
     int chunk_count;
+    // Bounds of chunks[], kept as arrays for batch frustum culling
+    float chunk_x[MAX_CHUNKS];
+    float chunk_z[MAX_CHUNKS];
+    float chunk_miny[MAX_CHUNKS];
+    float chunk_maxy[MAX_CHUNKS];
     int create_radius;
     int render_radius;
     int delete_radius;
@@ -323,9 +428,19 @@ typedef struct {
     int auto_add_players_on_new_devices;
     int gl_float_type;
     size_t float_size;
+    GLuint player_buffers[MAX_LOCAL_PLAYERS];
+    TextCacheEntry text_cache[TEXT_CACHE_SIZE];
+    unsigned int text_cache_clock;
     lua_State *lua_worldgen;
     int use_lua_worldgen;
     Ring edit_ring;
+    int backup_player;
+    int backup_percent;
+    Stage stage;
+    // Data from the server left over from the last frame
+    char *recv_lines;
+    const unsigned char *recv_data;
+    const unsigned char *recv_end;
 } Model;
 
 static Model model;
@@ -569,9 +684,9 @@ GLuint gen_plant_buffer(float x, float y, float z, float n, int w) {
     return buffer;
 }
 
-GLuint gen_player_buffer(float x, float y, float z, float rx, float ry, int p) {
+GLuint gen_player_buffer(int p) {
     GLfloat *data = malloc_faces(10, 6, sizeof(GLfloat));
-    make_player(data, x, y, z, rx, ry, p);
+    make_player(data, 0, 0, 0, 0, 0, p);
     return gen_faces(10, 6, data, sizeof(GLfloat));
 }
 
@@ -610,7 +725,12 @@ void draw_triangles_3d_ao(Attrib *attrib, GLuint buffer, int count,
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void draw_triangles_3d_text(Attrib *attrib, GLuint buffer, int count) {
+/*
+ * Draw range_count ranges of triangles from buffer, each given as a first
+ * vertex and a vertex count in ranges.
+ */
+void draw_triangles_3d_text_ranges(Attrib *attrib, GLuint buffer,
+                                   int *ranges, int range_count) {
     glBindBuffer(GL_ARRAY_BUFFER, buffer);
     glEnableVertexAttribArray(attrib->position);
     glEnableVertexAttribArray(attrib->uv);
@@ -621,7 +741,9 @@ void draw_triangles_3d_text(Attrib *attrib, GLuint buffer, int count) {
         sizeof(GLfloat) * 9, (GLvoid *)(sizeof(GLfloat) * 3));
     glVertexAttribPointer(attrib->color, 4, GL_FLOAT, GL_FALSE,
         sizeof(GLfloat) * 9, (GLvoid *)(sizeof(GLfloat) * 5));
-    glDrawArrays(GL_TRIANGLES, 0, count);
+    for (int i = 0; i < range_count; i++) {
+        glDrawArrays(GL_TRIANGLES, ranges[i * 2], ranges[i * 2 + 1]);
+    }
     glDisableVertexAttribArray(attrib->position);
     glDisableVertexAttribArray(attrib->uv);
     glDisableVertexAttribArray(attrib->color);
@@ -683,10 +805,60 @@ void draw_text(Attrib *attrib, GLuint buffer, int length) {
     glDisable(GL_BLEND);
 }
 
-void draw_signs(Attrib *attrib, Chunk *chunk) {
+void draw_triangles_3d_text(Attrib *attrib, GLuint buffer, int count) {
+    int range[2] = {0, count};
+    draw_triangles_3d_text_ranges(attrib, buffer, range, 1);
+}
+
+/*
+ * Draw the signs of a chunk that face towards the camera and are within
+ * max_distance of it. Consecutive visible signs are drawn together.
+ */
+void draw_signs(Attrib *attrib, Chunk *chunk, State *s, float max_distance) {
+    static const int normals[8][3] = {
+        {-1, 0, 0}, {+1, 0, 0}, {0, 0, -1}, {0, 0, +1},
+        {0, +1, 0}, {0, +1, 0}, {0, +1, 0}, {0, +1, 0},
+    };
+    static int *ranges = NULL;
+    static int ranges_capacity = 0;
+    SignMeshList *meshes = &chunk->sign_meshes;
+    if ((int)meshes->size > ranges_capacity) {
+        ranges_capacity = meshes->size;
+        ranges = realloc(ranges, sizeof(int) * 2 * ranges_capacity);
+    }
+    int range_count = 0;
+    int end = -1;
+    for (size_t i = 0; i < meshes->size; i++) {
+        SignMesh *e = meshes->data + i;
+        if (e->faces == 0) {
+            continue;
+        }
+        float dx = s->x - e->x;
+        float dy = s->y - e->y;
+        float dz = s->z - e->z;
+        const int *n = normals[e->face];
+        if (dx * n[0] + dy * n[1] + dz * n[2] < -0.5) {
+            continue;  // camera is behind the sign
+        }
+        if (dx * dx + dy * dy + dz * dz > max_distance * max_distance) {
+            continue;
+        }
+        if (e->offset == end) {
+            ranges[range_count * 2 - 1] += e->faces * 6;
+        } else {
+            ranges[range_count * 2] = e->offset * 6;
+            ranges[range_count * 2 + 1] = e->faces * 6;
+            range_count++;
+        }
+        end = e->offset + e->faces;
+    }
+    if (range_count == 0) {
+        return;
+    }
     glEnable(GL_POLYGON_OFFSET_FILL);
     glPolygonOffset(-1.0, -2.0);
-    draw_triangles_3d_text(attrib, chunk->sign_buffer, chunk->sign_faces * 6);
+    draw_triangles_3d_text_ranges(attrib, chunk->sign_buffer, ranges,
+                                  range_count);
     glDisable(GL_POLYGON_OFFSET_FILL);
 }
 
@@ -706,7 +878,21 @@ void draw_plant(Attrib *attrib, GLuint buffer) {
 }
 
 void draw_player(Attrib *attrib, Player *player) {
-    draw_cube(attrib, player->buffer, sizeof(GLfloat), GL_FLOAT);
+    // Same transform as make_player, applied by the shader to a mesh built
+    // at the origin.
+    State *s = &player->state;
+    float model[16];
+    float m[16];
+    mat_identity(model);
+    mat_rotate(m, 0, 1, 0, s->rx);
+    mat_multiply(model, m, model);
+    mat_rotate(m, cosf(s->rx), 0, sinf(s->rx), -s->ry);
+    mat_multiply(model, m, model);
+    mat_translate(m, s->x, s->y, s->z);
+    mat_multiply(model, m, model);
+    glUniformMatrix4fv(attrib->extra5, 1, GL_FALSE, model);
+    draw_cube(attrib, g->player_buffers[player->texture_index],
+              sizeof(GLfloat), GL_FLOAT);
 }
 
 void draw_mouse(Attrib *attrib, GLuint buffer) {
@@ -716,6 +902,117 @@ void draw_mouse(Attrib *attrib, GLuint buffer) {
     glDisable(GL_BLEND);
 }
 
+void del_observe_view(ObserveView *view)
+{
+    if (view->framebuffer) {
+        glDeleteFramebuffers(1, &view->framebuffer);
+        glDeleteRenderbuffers(1, &view->depth);
+        glDeleteTextures(1, &view->texture);
+        del_buffer(view->buffer);
+    }
+    memset(view, 0, sizeof(ObserveView));
+}
+
+int create_observe_view(ObserveView *view, int width, int height)
+{
+    // A unit square, set_matrix_2d(matrix, 1, 1) stretches it to fill the
+    // current viewport.
+    float data[] = {
+        0, 0, 0, 0,  1, 0, 1, 0,  0, 1, 0, 1,
+        1, 0, 1, 0,  1, 1, 1, 1,  0, 1, 0, 1
+    };
+    del_observe_view(view);
+    glGenTextures(1, &view->texture);
+    glActiveTexture(GL_TEXTURE0 + OBSERVE_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, view->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB,
+                 GL_UNSIGNED_BYTE, NULL);
+    glActiveTexture(GL_TEXTURE0);
+    glGenRenderbuffers(1, &view->depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, view->depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, width,
+                          height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &view->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, view->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, view->texture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, view->depth);
+    int status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Observe view framebuffer incomplete: 0x%x\n", status);
+        del_observe_view(view);
+        view->failed = 1;
+        return 0;
+    }
+    view->buffer = gen_buffer(sizeof(data), data);
+    view->width = width;
+    view->height = height;
+    return 1;
+}
+
+/*
+ * Decide how an observe view is drawn this frame. The view is only rendered
+ * into its framebuffer every config->observe_interval frames, in between the
+ * image from the last render is reused. When OBSERVE_VIEW_RENDER is returned
+ * the view's framebuffer is bound, the caller renders the scene into it and
+ * then calls draw_observe_view.
+ */
+int begin_observe_view(ObserveView *view, int width, int height,
+                       int observe, int observe_client_id)
+{
+    if (config->observe_interval <= 1 || view->failed) {
+        return OBSERVE_VIEW_DIRECT;
+    }
+    int stale = 0;
+    if (view->framebuffer == 0 || view->width != width ||
+        view->height != height) {
+        if (!create_observe_view(view, width, height)) {
+            return OBSERVE_VIEW_DIRECT;
+        }
+        stale = 1;
+    }
+    if (view->observe != observe ||
+        view->observe_client_id != observe_client_id) {
+        view->observe = observe;
+        view->observe_client_id = observe_client_id;
+        stale = 1;
+    }
+    if (!stale && ++view->age < config->observe_interval) {
+        return OBSERVE_VIEW_CACHED;
+    }
+    view->age = 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, view->framebuffer);
+    glViewport(0, 0, width, height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    return OBSERVE_VIEW_RENDER;
+}
+
+/*
+ * Copy the observe view's last rendered image into the given viewport.
+ */
+void draw_observe_view(Attrib *attrib, ObserveView *view, int x, int y)
+{
+    float matrix[16];
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(x, y, view->width, view->height);
+    set_matrix_2d(matrix, 1, 1);
+    glUseProgram(attrib->program);
+    glUniformMatrix4fv(attrib->matrix, 1, GL_FALSE, matrix);
+    glActiveTexture(GL_TEXTURE0 + OBSERVE_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, view->texture);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(attrib->sampler, OBSERVE_TEXTURE_UNIT);
+    draw_triangles_2d(attrib, view->buffer, 6);
+    glClear(GL_DEPTH_BUFFER_BIT);
+}
+
 Client *find_client(int id) {
     for (int i = 0; i < g->client_count; i++) {
         Client *client = g->clients + i;
@@ -745,9 +1042,6 @@ void update_player(Player *player,
     else {
         State *s = &player->state;
         s->x = x; s->y = y; s->z = z; s->rx = rx; s->ry = ry;
-        del_buffer(player->buffer);
-        player->buffer = gen_player_buffer(s->x, s->y, s->z, s->rx, s->ry,
-                                           player->texture_index);
     }
 }
 
@@ -775,27 +1069,12 @@ void delete_client(int id) {
         return;
     }
     int count = g->client_count;
-    for (int i = 0; i<MAX_LOCAL_PLAYERS; i++) {
-        Player *player = client->players + i;
-        if (player->is_active) {
-            del_buffer(player->buffer);
-        }
-    }
     Client *other = g->clients + (--count);
     memcpy(client, other, sizeof(Client));
     g->client_count = count;
 }
 
 void delete_all_players(void) {
-    for (int i = 0; i < g->client_count; i++) {
-        Client *client = g->clients + i;
-        for (int j = 0; j < MAX_LOCAL_PLAYERS; j++) {
-            Player *player = client->players + j;
-            if (player->is_active) {
-                del_buffer(player->buffer);
-            }
-        }
-    }
     g->client_count = 0;
 }
 
@@ -863,47 +1142,25 @@ int chunk_distance(Chunk *chunk, int p, int q) {
     return MAX(dp, dq);
 }
 
-int chunk_visible(float planes[6][4], int p, int q, int miny, int maxy) {
-    int x = p * CHUNK_SIZE - 1;
-    int z = q * CHUNK_SIZE - 1;
-    int d = CHUNK_SIZE + 1;
-    float points[8][3] = {
-        {x + 0, miny, z + 0},
-        {x + d, miny, z + 0},
-        {x + 0, miny, z + d},
-        {x + d, miny, z + d},
-        {x + 0, maxy, z + 0},
-        {x + d, maxy, z + 0},
-        {x + 0, maxy, z + d},
-        {x + d, maxy, z + d}
-    };
-    int n = g->ortho ? 4 : 6;
-    for (int i = 0; i < n; i++) {
-        int in = 0;
-        int out = 0;
-        for (int j = 0; j < 8; j++) {
-            float d =
-                planes[i][0] * points[j][0] +
-                planes[i][1] * points[j][1] +
-                planes[i][2] * points[j][2] +
-                planes[i][3];
-            if (d < 0) {
-                out++;
-            }
-            else {
-                in++;
-            }
-            if (in && out) {
-                break;
-            }
-        }
-        if (in == 0) {
-            return 0;
-        }
-    }
-    return 1;
+void set_chunk_bounds(Chunk *chunk) {
+    int i = chunk - g->chunks;
+    g->chunk_x[i] = chunk->p * CHUNK_SIZE - 1;
+    g->chunk_z[i] = chunk->q * CHUNK_SIZE - 1;
+    g->chunk_miny[i] = chunk->miny;
+    g->chunk_maxy[i] = chunk->maxy;
+}
+
+/*
+ * Set a bit in visible for each loaded chunk that is inside the frustum.
+ */
+void chunks_visible(float planes[6][4], unsigned int *visible) {
+    frustum_cull_boxes(planes, g->ortho ? 4 : 6, g->chunk_x, g->chunk_z,
+                       g->chunk_miny, g->chunk_maxy, CHUNK_SIZE + 1,
+                       g->chunk_count, visible);
 }
 
+#define IS_VISIBLE(visible, i) ((visible)[(i) / 32] & (1u << ((i) % 32)))
+
 int highest_block(float x, float z) {
     int result = -1;
     int nx = roundf(x);
@@ -1278,29 +1535,93 @@ int _gen_sign_buffer(
     return count;
 }
 
-void gen_sign_buffer(Chunk *chunk) {
-    SignList *signs = &chunk->signs;
+void sign_mesh_list_free(SignMeshList *list) {
+    for (size_t i = 0; i < list->size; i++) {
+        free(list->data[i].data);
+    }
+    free(list->data);
+    list->data = NULL;
+    list->size = 0;
+}
 
-    // first pass - count characters
-    int max_faces = 0;
-    for (size_t i = 0; i < signs->size; i++) {
-        Sign *e = signs->data + i;
-        max_faces += strlen(e->text);
+/*
+ * Find the cached mesh for a sign, trying the position the sign had in the
+ * last build first as the sign order rarely changes.
+ */
+SignMesh *find_sign_mesh(SignMeshList *list, size_t hint, Sign *sign) {
+    for (size_t j = 0; j < list->size; j++) {
+        SignMesh *e = list->data + (hint + j) % list->size;
+        if (e->data && e->x == sign->x && e->y == sign->y &&
+            e->z == sign->z && e->face == sign->face) {
+            return e;
+        }
     }
+    return NULL;
+}
 
-    // second pass - generate geometry
-    GLfloat *data = malloc_faces_with_rgba(5, max_faces);
+/*
+ * Rebuild the sign buffer of a chunk, only signs that have been added or
+ * changed since the last build have their glyphs generated again. The GL
+ * buffer is left untouched when no sign has changed.
+ */
+void gen_sign_buffer(Chunk *chunk) {
+    SignList *signs = &chunk->signs;
+    SignMeshList *old = &chunk->sign_meshes;
+    SignMeshList meshes;
+    meshes.size = signs->size;
+    meshes.data = calloc(signs->size, sizeof(SignMesh));
+    int changed = signs->size != old->size;
     int faces = 0;
     for (size_t i = 0; i < signs->size; i++) {
-        Sign *e = signs->data + i;
-        faces += _gen_sign_buffer(
-            data + faces * 54, e->x, e->y, e->z, e->face, e->text);
+        Sign *sign = signs->data + i;
+        SignMesh *e = meshes.data + i;
+        int shape = get_shape(sign->x, sign->y, sign->z);
+        SignMesh *cached = find_sign_mesh(old, i, sign);
+        if (cached && cached->shape == shape &&
+            strcmp(cached->text, sign->text) == 0) {
+            memcpy(e, cached, sizeof(SignMesh));
+            cached->data = NULL;
+            if (cached != old->data + i) {
+                changed = 1;
+            }
+        } else {
+            e->x = sign->x;
+            e->y = sign->y;
+            e->z = sign->z;
+            e->face = sign->face;
+            e->shape = shape;
+            strncpy(e->text, sign->text, MAX_SIGN_LENGTH);
+            e->data = malloc_faces_with_rgba(5, strlen(sign->text));
+            e->faces = _gen_sign_buffer(
+                e->data, sign->x, sign->y, sign->z, sign->face, sign->text);
+            e->data = realloc(e->data,
+                              sizeof(GLfloat) * 54 * MAX(1, e->faces));
+            changed = 1;
+        }
+        e->offset = faces;
+        faces += e->faces;
+    }
+    sign_mesh_list_free(old);
+    memcpy(old, &meshes, sizeof(SignMeshList));
+    chunk->dirty_signs = 0;
+    if (!changed) {
+        return;
     }
 
     del_buffer(chunk->sign_buffer);
-    chunk->sign_buffer = gen_faces_with_rgba(5, faces, data);
+    chunk->sign_buffer = 0;
     chunk->sign_faces = faces;
-    chunk->dirty_signs = 0;
+    if (faces == 0) {
+        return;
+    }
+    GLfloat *data = malloc(sizeof(GLfloat) * 54 * faces);
+    for (size_t i = 0; i < meshes.size; i++) {
+        SignMesh *e = meshes.data + i;
+        memcpy(data + e->offset * 54, e->data,
+               sizeof(GLfloat) * 54 * e->faces);
+    }
+    chunk->sign_buffer = gen_buffer(sizeof(GLfloat) * 54 * faces, data);
+    free(data);
 }
 
 int has_lights(Chunk *chunk) {
@@ -1334,6 +1655,8 @@ void dirty_chunk(Chunk *chunk) {
                 Chunk *other = find_chunk(chunk->p + dp, chunk->q + dq);
                 if (other) {
                     other->dirty = 1;
+                } else {
+                    chunk_cache_drop_mesh(chunk->p + dp, chunk->q + dq);
                 }
             }
         }
@@ -1733,10 +2056,15 @@ void compute_chunk(WorkerItem *item) {
 void generate_chunk(Chunk *chunk, WorkerItem *item) {
     chunk->miny = item->miny;
     chunk->maxy = item->maxy;
+    set_chunk_bounds(chunk);
     chunk->faces = item->faces;
     del_buffer(chunk->buffer);
     chunk->buffer = gen_faces(10, item->faces, item->data, g->float_size);
     gen_sign_buffer(chunk);
+    if (chunk->request == REQUEST_DRAW && !chunk->dirty) {
+        netstats_add_chunk_draw(netstats_time() - chunk->request_time);
+        chunk->request = REQUEST_NONE;
+    }
 }
 
 void gen_chunk_buffer(Chunk *chunk) {
@@ -1769,8 +2097,8 @@ void gen_chunk_buffer(Chunk *chunk) {
         }
     }
     compute_chunk(item);
-    generate_chunk(chunk, item);
     chunk->dirty = 0;
+    generate_chunk(chunk, item);
 }
 
 void map_set_func(int x, int y, int z, int w, void *arg) {
@@ -1778,7 +2106,7 @@ void map_set_func(int x, int y, int z, int w, void *arg) {
     map_set(map, x, y, z, w);
 }
 
-void load_chunk(WorkerItem *item, lua_State *L) {
+void load_chunk(WorkerItem *item, lua_State *L, DbReader *reader) {
     int p = item->p;
     int q = item->q;
     Map *block_map = item->block_maps[1][1];
@@ -1788,34 +2116,140 @@ void load_chunk(WorkerItem *item, lua_State *L) {
     Map *transform_map = item->transform_maps[1][1];
     SignList *signs = &item->signs;
     sign_list_alloc(signs, 16);
-    if (L != NULL) {
-        pwlua_worldgen(L, p, q, block_map, extra_map, light_map, shape_map, signs, transform_map);
+    Map *maps[] = {block_map, extra_map, shape_map, transform_map, light_map};
+    if (!worldgen_cache_get(p, q, maps, signs)) {
+        if (L != NULL) {
+            pwlua_worldgen(L, p, q, block_map, extra_map, light_map, shape_map, signs, transform_map);
+        } else {
+            create_world(p, q, map_set_func, block_map);
+        }
+        worldgen_cache_put(p, q, maps, signs);
+    }
+    db_load_chunk(reader, maps, signs, p, q);
+}
+
+void request_chunk(Chunk *chunk) {
+    int key = db_get_key(chunk->p, chunk->q);
+    chunk->request_time = netstats_time();
+    if (client_server_version() >= PROTOCOL_VERSION) {
+        // Sent with a priority by send_chunk_requests
+        chunk->request = REQUEST_QUEUED;
+        chunk->request_key = key;
+        return;
+    }
+    client_chunk(chunk->p, chunk->q, key);
+}
+
+/*
+ * The server has sent all it has for a chunk asked for, the chunk counts as
+ * drawn once a mesh is made with no changes left to merge.
+ */
+void chunk_answered(int p, int q) {
+    Chunk *chunk = find_chunk(p, q);
+    if (!chunk || chunk->request_time == 0) {
+        return;
+    }
+    double elapsed = netstats_time() - chunk->request_time;
+    netstats_add_chunk_answer(elapsed);
+    if (chunk->dirty) {
+        chunk->request = REQUEST_DRAW;
     } else {
-        create_world(p, q, map_set_func, block_map);
+        netstats_add_chunk_draw(elapsed);
+        chunk->request = REQUEST_NONE;
+    }
+}
+
+void cancel_chunk_request(Chunk *chunk) {
+    if (chunk->request == REQUEST_SENT) {
+        client_chunk_request(chunk->p, chunk->q, chunk->request_key, -1);
     }
-    db_load_blocks(block_map, p, q);
-    db_load_extras(extra_map, p, q);
-    db_load_lights(light_map, p, q);
-    db_load_shapes(shape_map, p, q);
-    db_load_signs(signs, p, q);
-    db_load_transforms(transform_map, p, q);
+    chunk->request = REQUEST_NONE;
 }
 
-void request_chunk(int p, int q) {
-    int key = db_get_key(p, q);
-    client_chunk(p, q, key);
+/*
+ * Send the chunk requests queued this frame, and every
+ * CHUNK_REQUEST_INTERVAL new priorities for those the server has not
+ * answered yet. As in ensure_chunks_worker chunks in view of a local player
+ * come first, then the nearest.
+ */
+void send_chunk_requests(double now) {
+    static double last_update = 0;
+    static int indexes[MAX_CHUNKS];
+    static int scores[MAX_CHUNKS];
+    static float xs[MAX_CHUNKS], zs[MAX_CHUNKS];
+    static float miny[MAX_CHUNKS], maxy[MAX_CHUNKS];
+    unsigned int visible[MAX_CHUNKS / 32];
+    int update = now - last_update > CHUNK_REQUEST_INTERVAL;
+    int count = 0;
+    for (int i = 0; i < g->chunk_count; i++) {
+        Chunk *chunk = g->chunks + i;
+        if (chunk->request == REQUEST_QUEUED ||
+            (update && chunk->request == REQUEST_SENT)) {
+            indexes[count] = i;
+            scores[count] = 0x0fffffff;
+            xs[count] = chunk->p * CHUNK_SIZE - 1;
+            zs[count] = chunk->q * CHUNK_SIZE - 1;
+            miny[count] = 0;
+            maxy[count] = 256;
+            count++;
+        }
+    }
+    if (update) {
+        last_update = now;
+    }
+    if (count == 0) {
+        return;
+    }
+    for (int i = 0; i < MAX_LOCAL_PLAYERS; i++) {
+        LocalPlayer *local = g->local_players + i;
+        if (!local->player->is_active) {
+            continue;
+        }
+        State *s = &local->player->state;
+        float matrix[16];
+        float planes[6][4];
+        set_matrix_3d(
+            matrix, g->width, g->height, s->x, s->y, s->z, s->rx, s->ry,
+            g->fov, g->ortho, g->render_radius);
+        frustum_planes(planes, g->render_radius, matrix);
+        frustum_cull_boxes(planes, g->ortho ? 4 : 6, xs, zs, miny, maxy,
+                           CHUNK_SIZE + 1, count, visible);
+        int p = chunked(s->x);
+        int q = chunked(s->z);
+        for (int j = 0; j < count; j++) {
+            int distance = chunk_distance(g->chunks + indexes[j], p, q);
+            int invisible = !IS_VISIBLE(visible, j);
+            scores[j] = MIN(scores[j], (invisible << 24) | distance);
+        }
+    }
+    for (int j = 0; j < count; j++) {
+        Chunk *chunk = g->chunks + indexes[j];
+        if (chunk->request == REQUEST_SENT &&
+            chunk->request_priority == scores[j]) {
+            continue;
+        }
+        client_chunk_request(chunk->p, chunk->q, chunk->request_key,
+                             scores[j]);
+        chunk->request = REQUEST_SENT;
+        chunk->request_priority = scores[j];
+    }
 }
 
 void init_chunk(Chunk *chunk, int p, int q) {
     chunk->p = p;
     chunk->q = q;
+    set_chunk_bounds(chunk);
     chunk->faces = 0;
     chunk->sign_faces = 0;
     chunk->buffer = 0;
     chunk->sign_buffer = 0;
+    chunk->request = REQUEST_NONE;
+    chunk->request_time = 0;
     dirty_chunk(chunk);
     SignList *signs = &chunk->signs;
     sign_list_alloc(signs, 16);
+    chunk->sign_meshes.size = 0;
+    chunk->sign_meshes.data = NULL;
     Map *block_map = &chunk->map;
     Map *extra_map = &chunk->extra;
     Map *light_map = &chunk->lights;
@@ -1833,8 +2267,78 @@ void init_chunk(Chunk *chunk, int p, int q) {
     door_map_alloc(doors_map, dx, dy, dz, 0xf);
 }
 
+/*
+ * Fill a newly initialized chunk from the chunk cache, returns 1 on a hit.
+ * The chunk stays dirty unless its mesh was kept in the cache.
+ */
+int restore_chunk(Chunk *chunk) {
+    Map *maps[] = {&chunk->map, &chunk->extra, &chunk->shape,
+                   &chunk->transform, &chunk->lights};
+    ChunkMesh mesh;
+    if (!chunk_cache_take(chunk->p, chunk->q, maps, &chunk->signs, &mesh)) {
+        return 0;
+    }
+    if (mesh.buffer) {
+        chunk->buffer = mesh.buffer;
+        chunk->faces = mesh.faces;
+        chunk->miny = mesh.miny;
+        chunk->maxy = mesh.maxy;
+        set_chunk_bounds(chunk);
+        door_map_free(&chunk->doors);
+        chunk->doors = mesh.doors;
+        chunk->dirty = 0;
+        gen_sign_buffer(chunk);
+    }
+    request_chunk(chunk);
+    return 1;
+}
+
+int chunk_busy(int p, int q) {
+    int busy = 0;
+    for (int i = 0; i < WORKERS; i++) {
+        Worker *worker = g->workers + i;
+        mtx_lock(&worker->mtx);
+        if (worker->state != WORKER_IDLE && worker->item.p == p &&
+            worker->item.q == q) {
+            busy = 1;
+        }
+        mtx_unlock(&worker->mtx);
+    }
+    return busy;
+}
+
+/*
+ * Pass a chunk that is being unloaded to the chunk cache. Chunks with
+ * worker results still to come are not cached, as their data may be
+ * incomplete.
+ */
+void cache_chunk(Chunk *chunk) {
+    if (chunk_busy(chunk->p, chunk->q)) {
+        return;
+    }
+    Map *maps[] = {&chunk->map, &chunk->extra, &chunk->shape,
+                   &chunk->transform, &chunk->lights};
+    if (chunk_cache_keeps_meshes() && chunk->buffer && !chunk->dirty) {
+        ChunkMesh mesh;
+        mesh.buffer = chunk->buffer;
+        mesh.faces = chunk->faces;
+        mesh.miny = chunk->miny;
+        mesh.maxy = chunk->maxy;
+        mesh.size = chunk->faces * 6 * 10 * g->float_size;
+        mesh.doors = chunk->doors;
+        chunk->buffer = 0;
+        memset(&chunk->doors, 0, sizeof(DoorMap));
+        chunk_cache_put(chunk->p, chunk->q, maps, &chunk->signs, &mesh);
+    } else {
+        chunk_cache_put(chunk->p, chunk->q, maps, &chunk->signs, NULL);
+    }
+}
+
 void create_chunk(Chunk *chunk, int p, int q) {
     init_chunk(chunk, p, q);
+    if (restore_chunk(chunk)) {
+        return;
+    }
 
     WorkerItem _item;
     WorkerItem *item = &_item;
@@ -1846,12 +2350,12 @@ void create_chunk(Chunk *chunk, int p, int q) {
     item->shape_maps[1][1] = &chunk->shape;
     item->transform_maps[1][1] = &chunk->transform;
     item->door_maps[1][1] = &chunk->doors;
-    load_chunk(item, g->lua_worldgen);
+    load_chunk(item, g->lua_worldgen, NULL);
     sign_list_free(&chunk->signs);
     sign_list_copy(&chunk->signs, &item->signs);
     sign_list_free(&item->signs);
 
-    request_chunk(p, q);
+    request_chunk(chunk);
 }
 
 void delete_chunks(void) {
@@ -1897,17 +2401,21 @@ void delete_chunks(void) {
             }
         }
         if (delete) {
+            cancel_chunk_request(chunk);
+            cache_chunk(chunk);
             map_free(&chunk->map);
             map_free(&chunk->extra);
             map_free(&chunk->lights);
             map_free(&chunk->shape);
             map_free(&chunk->transform);
             sign_list_free(&chunk->signs);
+            sign_mesh_list_free(&chunk->sign_meshes);
             door_map_free(&chunk->doors);
             del_buffer(chunk->buffer);
             del_buffer(chunk->sign_buffer);
             Chunk *other = g->chunks + (--count);
             memcpy(chunk, other, sizeof(Chunk));
+            set_chunk_bounds(chunk);
         }
     }
     g->chunk_count = count;
@@ -1916,6 +2424,7 @@ void delete_chunks(void) {
 void delete_all_chunks(void) {
     for (int i = 0; i < g->chunk_count; i++) {
         Chunk *chunk = g->chunks + i;
+        cancel_chunk_request(chunk);
         map_free(&chunk->map);
         map_free(&chunk->extra);
         map_free(&chunk->lights);
@@ -1923,10 +2432,12 @@ void delete_all_chunks(void) {
         map_free(&chunk->transform);
         door_map_free(&chunk->doors);
         sign_list_free(&chunk->signs);
+        sign_mesh_list_free(&chunk->sign_meshes);
         del_buffer(chunk->buffer);
         del_buffer(chunk->sign_buffer);
     }
     g->chunk_count = 0;
+    chunk_cache_clear();
 }
 
 void check_workers(void) {
@@ -1956,7 +2467,7 @@ void check_workers(void) {
                     map_copy(&chunk->transform, transform_map);
                     sign_list_copy(&chunk->signs, &item->signs);
                     sign_list_free(&item->signs);
-                    request_chunk(item->p, item->q);
+                    request_chunk(chunk);
                 }
 
                 // DoorMap data copy is required whether the doors were added
@@ -2028,7 +2539,9 @@ void force_chunks(Player *player) {
             else if (g->chunk_count < MAX_CHUNKS) {
                 chunk = g->chunks + g->chunk_count++;
                 create_chunk(chunk, a, b);
-                gen_chunk_buffer(chunk);
+                if (chunk->dirty) {
+                    gen_chunk_buffer(chunk);
+                }
             }
         }
     }
@@ -2049,29 +2562,45 @@ void ensure_chunks_worker(Player *player, Worker *worker) {
     int best_score = start;
     int best_a = 0;
     int best_b = 0;
+    int plane_count = g->ortho ? 4 : 6;
+    float xs[32], zs[32], miny[32], maxy[32];
+    unsigned int visible;
     for (int dp = -r; dp <= r; dp++) {
-        for (int dq = -r; dq <= r; dq++) {
-            int a = p + dp;
-            int b = q + dq;
-            int index = (ABS(a) ^ ABS(b)) % WORKERS;
-            if (index != worker->index) {
-                continue;
-            }
-            Chunk *chunk = find_chunk(a, b);
-            if (chunk && !chunk->dirty) {
-                continue;
-            }
-            int distance = MAX(ABS(dp), ABS(dq));
-            int invisible = !chunk_visible(planes, a, b, 0, 256);
-            int priority = 0;
-            if (chunk) {
-                priority = chunk->buffer && chunk->dirty;
-            }
-            int score = (invisible << 24) | (priority << 16) | distance;
-            if (score < best_score) {
-                best_score = score;
-                best_a = a;
-                best_b = b;
+        for (int dq0 = -r; dq0 <= r; dq0 += 32) {
+            // Cull this row of candidates in batches of up to 32
+            int n = MIN(32, r - dq0 + 1);
+            for (int j = 0; j < n; j++) {
+                xs[j] = (p + dp) * CHUNK_SIZE - 1;
+                zs[j] = (q + dq0 + j) * CHUNK_SIZE - 1;
+                miny[j] = 0;
+                maxy[j] = 256;
+            }
+            frustum_cull_boxes(planes, plane_count, xs, zs, miny, maxy,
+                               CHUNK_SIZE + 1, n, &visible);
+            for (int j = 0; j < n; j++) {
+                int dq = dq0 + j;
+                int a = p + dp;
+                int b = q + dq;
+                int index = (ABS(a) ^ ABS(b)) % WORKERS;
+                if (index != worker->index) {
+                    continue;
+                }
+                Chunk *chunk = find_chunk(a, b);
+                if (chunk && !chunk->dirty) {
+                    continue;
+                }
+                int distance = MAX(ABS(dp), ABS(dq));
+                int invisible = !IS_VISIBLE(&visible, j);
+                int priority = 0;
+                if (chunk) {
+                    priority = chunk->buffer && chunk->dirty;
+                }
+                int score = (invisible << 24) | (priority << 16) | distance;
+                if (score < best_score) {
+                    best_score = score;
+                    best_a = a;
+                    best_b = b;
+                }
             }
         }
     }
@@ -2087,6 +2616,12 @@ void ensure_chunks_worker(Player *player, Worker *worker) {
         if (g->chunk_count < MAX_CHUNKS) {
             chunk = g->chunks + g->chunk_count++;
             init_chunk(chunk, a, b);
+            if (restore_chunk(chunk)) {
+                load = 0;
+                if (!chunk->dirty) {
+                    return;
+                }
+            }
         }
         else {
             return;
@@ -2153,6 +2688,8 @@ void ensure_chunks(Player *player) {
 int worker_run(void *arg) {
     Worker *worker = (Worker *)arg;
     lua_State *L = NULL;
+    DbReader *reader = NULL;
+    int reader_opened = 0;
     if (g->use_lua_worldgen == 1) {
         L = pwlua_worldgen_init(config->worldgen_path);
     }
@@ -2164,13 +2701,20 @@ int worker_run(void *arg) {
                 if (L != NULL) {
                     lua_close(L);
                 }
+                db_reader_close(reader);
                 thrd_exit(1);
             }
         }
         mtx_unlock(&worker->mtx);
         WorkerItem *item = &worker->item;
         if (item->load) {
-            load_chunk(item, L);
+            // Workers start before the db is opened, so open the worker's
+            // own connection on its first load.
+            if (!reader_opened) {
+                reader = db_reader_open();
+                reader_opened = 1;
+            }
+            load_chunk(item, L, reader);
         }
         compute_chunk(item);
         mtx_lock(&worker->mtx);
@@ -2180,6 +2724,7 @@ int worker_run(void *arg) {
     if (L != NULL) {
         lua_close(L);
     }
+    db_reader_close(reader);
     return 0;
 }
 
@@ -2196,6 +2741,7 @@ void unset_sign(int x, int y, int z) {
     }
     else {
         db_delete_signs(x, y, z);
+        chunk_cache_remove(p, q);
     }
 }
 
@@ -2212,6 +2758,7 @@ void unset_sign_face(int x, int y, int z, int face) {
     }
     else {
         db_delete_sign(x, y, z, face);
+        chunk_cache_remove(p, q);
     }
 }
 
@@ -2229,6 +2776,8 @@ void _set_sign(
         if (dirty) {
             chunk->dirty_signs = 1;
         }
+    } else {
+        chunk_cache_remove(p, q);
     }
     db_insert_sign(p, q, x, y, z, face, text);
 }
@@ -2294,6 +2843,7 @@ int _set_light(int p, int q, int x, int y, int z, int w) {
     }
     else {
         db_insert_light(p, q, x, y, z, w);
+        chunk_cache_remove(p, q);
     }
     return w;
 }
@@ -2374,6 +2924,7 @@ void _set_extra(int p, int q, int x, int y, int z, int w, int dirty) {
     }
     else {
         db_insert_extra(p, q, x, y, z, w);
+        chunk_cache_remove(p, q);
     }
 }
 
@@ -2429,6 +2980,7 @@ void _set_shape(int p, int q, int x, int y, int z, int w, int dirty) {
     }
     else {
         db_insert_shape(p, q, x, y, z, w);
+        chunk_cache_remove(p, q);
     }
 }
 
@@ -2484,6 +3036,7 @@ void _set_transform(int p, int q, int x, int y, int z, int w, int dirty) {
     }
     else {
         db_insert_transform(p, q, x, y, z, w);
+        chunk_cache_remove(p, q);
     }
 }
 
@@ -2518,6 +3071,7 @@ void _set_block(int p, int q, int x, int y, int z, int w, int dirty) {
     }
     else {
         db_insert_block(p, q, x, y, z, w);
+        chunk_cache_remove(p, q);
     }
     if (w == 0 && chunked(x) == p && chunked(z) == q) {
         unset_sign(x, y, z);
@@ -2586,6 +3140,27 @@ void set_worldgen(char *worldgen)
     g->render_option_changed = 1;
 }
 
+/*
+ * Describe the current worldgen and the options that change its output, so
+ * cached worldgen output is only used with the worldgen that made it.
+ */
+void update_worldgen_cache_signature(void)
+{
+    char signature[MAX_WORLDGEN_SIGNATURE_LENGTH];
+    if (g->use_lua_worldgen) {
+        snprintf(signature, MAX_WORLDGEN_SIGNATURE_LENGTH,
+                 "%s %016llx trees=%d plants=%d clouds=%d",
+                 config->worldgen_path,
+                 worldgen_cache_file_hash(config->worldgen_path),
+                 config->show_trees, config->show_plants, config->show_clouds);
+    } else {
+        snprintf(signature, MAX_WORLDGEN_SIGNATURE_LENGTH,
+                 "default v%d trees=%d plants=%d clouds=%d", WORLD_VERSION,
+                 config->show_trees, config->show_plants, config->show_clouds);
+    }
+    worldgen_cache_set_signature(signature);
+}
+
 void queue_set_block(int x, int y, int z, int w) {
     int p = chunked(x);
     int q = chunked(z);
@@ -2694,14 +3269,14 @@ int render_chunks(Attrib *attrib, Player *player) {
     glUniform1f(attrib->extra3, g->render_radius * CHUNK_SIZE);
     glUniform1i(attrib->extra4, g->ortho);
     glUniform1f(attrib->timer, time_of_day());
+    unsigned int visible[MAX_CHUNKS / 32];
+    chunks_visible(planes, visible);
     for (int i = 0; i < g->chunk_count; i++) {
         Chunk *chunk = g->chunks + i;
         if (chunk_distance(chunk, p, q) > g->render_radius) {
             continue;
         }
-        if (!chunk_visible(
-            planes, chunk->p, chunk->q, chunk->miny, chunk->maxy))
-        {
+        if (!IS_VISIBLE(visible, i)) {
             continue;
         }
         glUniform4f(attrib->map, chunk->map.dx, chunk->map.dy, chunk->map.dz, 0);
@@ -2730,17 +3305,17 @@ void render_signs(Attrib *attrib, Player *player) {
     glUniform1f(attrib->extra3, g->render_radius * CHUNK_SIZE); // fog_distance
     glUniform1i(attrib->extra4, g->ortho);  // ortho
     glUniform1f(attrib->timer, time_of_day());
+    unsigned int visible[MAX_CHUNKS / 32];
+    chunks_visible(planes, visible);
     for (int i = 0; i < g->chunk_count; i++) {
         Chunk *chunk = g->chunks + i;
         if (chunk_distance(chunk, p, q) > g->sign_radius) {
             continue;
         }
-        if (!chunk_visible(
-            planes, chunk->p, chunk->q, chunk->miny, chunk->maxy))
-        {
+        if (!IS_VISIBLE(visible, i)) {
             continue;
         }
-        draw_signs(attrib, chunk);
+        draw_signs(attrib, chunk, s, g->render_radius * CHUNK_SIZE);
     }
 }
 
@@ -2781,13 +3356,16 @@ void render_players(Attrib *attrib, Player *player) {
     glUniformMatrix4fv(attrib->matrix, 1, GL_FALSE, matrix);
     glUniform3f(attrib->camera, s->x, s->y, s->z);
     glUniform1i(attrib->sampler, 0);
+    glUniform1i(attrib->extra1, 2);
+    glUniform1f(attrib->extra2, get_daylight());
+    glUniform1f(attrib->extra3, g->render_radius * CHUNK_SIZE);
+    glUniform1i(attrib->extra4, g->ortho);
     glUniform1f(attrib->timer, time_of_day());
     for (int i = 0; i < g->client_count; i++) {
         Client *client = g->clients + i;
         for (int j = 0; j < MAX_LOCAL_PLAYERS; j++) {
             Player *other = client->players + j;
             if (other != player && other->is_active) {
-                glUniform4f(attrib->map, 0, 0, 0, 0);
                 draw_player(attrib, other);
             }
         }
@@ -2872,23 +3450,74 @@ void render_item(Attrib *attrib, LocalPlayer *p) {
     }
 }
 
-void render_text_rgba(
-    Attrib *attrib, int justify, float x, float y, float n, char *text,
-    const float *background, const float *text_color)
-{
-    float matrix[16];
-    set_matrix_2d(matrix, g->width, g->height);
-    glUseProgram(attrib->program);
-    glUniformMatrix4fv(attrib->matrix, 1, GL_FALSE, matrix);
-    glUniform1i(attrib->sampler, 3);
-    glUniform1i(attrib->extra1, 0);
+/*
+ * Return a text buffer from the text cache, generating it if this text has
+ * not been drawn at this position and size recently. Text colours are set by
+ * shader uniforms so are not part of the cached geometry. When the cache is
+ * full the least recently used entry is replaced.
+ */
+GLuint get_cached_text_buffer(float x, float y, float n, char *text) {
+    unsigned int hash = 5381;
+    for (char *c = text; *c; c++) {
+        hash = hash * 33 + *c;
+    }
+    TextCacheEntry *oldest = g->text_cache;
+    for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+        TextCacheEntry *e = g->text_cache + i;
+        if (e->buffer && e->hash == hash && e->x == x && e->y == y &&
+            e->n == n && strcmp(e->text, text) == 0) {
+            e->last_used = ++g->text_cache_clock;
+            return e->buffer;
+        }
+        if (e->last_used < oldest->last_used) {
+            oldest = e;
+        }
+    }
+    TextCacheEntry *e = oldest;
+    if (e->buffer) {
+        del_buffer(e->buffer);
+    }
+    snprintf(e->text, sizeof(e->text), "%s", text);
+    e->hash = hash;
+    e->x = x;
+    e->y = y;
+    e->n = n;
+    e->buffer = gen_text_buffer(x, y, n, text);
+    e->last_used = ++g->text_cache_clock;
+    return e->buffer;
+}
+
+void clear_text_cache(void) {
+    for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+        TextCacheEntry *e = g->text_cache + i;
+        if (e->buffer) {
+            del_buffer(e->buffer);
+        }
+    }
+    memset(g->text_cache, 0, sizeof(g->text_cache));
+}
+
+void render_text_rgba(
+    Attrib *attrib, int justify, float x, float y, float n, char *text,
+    const float *background, const float *text_color)
+{
+    float matrix[16];
+    set_matrix_2d(matrix, g->width, g->height);
+    glUseProgram(attrib->program);
+    glUniformMatrix4fv(attrib->matrix, 1, GL_FALSE, matrix);
+    glUniform1i(attrib->sampler, 3);
+    glUniform1i(attrib->extra1, 0);
     glUniform4fv(attrib->extra5, 1, background);
     glUniform4fv(attrib->extra6, 1, text_color);
     int length = strlen(text);
     x -= n * justify * (length - 1) / 2;
-    GLuint buffer = gen_text_buffer(x, y, n, text);
-    draw_text(attrib, buffer, length);
-    del_buffer(buffer);
+    if (length >= TEXT_CACHE_MAX_LENGTH) {
+        GLuint buffer = gen_text_buffer(x, y, n, text);
+        draw_text(attrib, buffer, length);
+        del_buffer(buffer);
+        return;
+    }
+    draw_text(attrib, get_cached_text_buffer(x, y, n, text), length);
 }
 
 void render_text(
@@ -3183,6 +3812,83 @@ void tree(Block *block) {
     }
 }
 
+void pw_backup(int player_id, const char *path) {
+    char text[MAX_TEXT_LENGTH];
+    if (db_backup_start(path)) {
+        snprintf(text, MAX_TEXT_LENGTH, "Could not start backup to %s", path);
+        add_message(player_id, text);
+        return;
+    }
+    g->backup_player = player_id;
+    g->backup_percent = 0;
+    snprintf(text, MAX_TEXT_LENGTH, "Backing up to %s", path);
+    add_message(player_id, text);
+}
+
+void update_backup(void) {
+    int remaining, pagecount;
+    char text[MAX_TEXT_LENGTH];
+    switch (db_backup_progress(&remaining, &pagecount)) {
+    case DB_BACKUP_RUNNING:
+        db_backup_tick();
+        if (pagecount > 0) {
+            int percent = (pagecount - remaining) * 100 / pagecount;
+            if (percent / 25 > g->backup_percent / 25 && percent < 100) {
+                snprintf(text, MAX_TEXT_LENGTH, "Backup %d%% done", percent);
+                add_message(g->backup_player, text);
+            }
+            g->backup_percent = percent;
+        }
+        break;
+    case DB_BACKUP_DONE:
+        snprintf(text, MAX_TEXT_LENGTH, "Backup complete (%d pages)",
+                 pagecount);
+        add_message(g->backup_player, text);
+        break;
+    case DB_BACKUP_FAILED:
+        add_message(g->backup_player, "Backup failed");
+        break;
+    }
+}
+
+static double average_ms(const NetTimeStats *stats) {
+    return stats->count ? stats->total * 1000 / stats->count : 0;
+}
+
+static void print_message_stats(
+    const char *name, const NetMessageStats *stats, void *arg)
+{
+    double *total_time = arg;
+    printf("  %-16s %8lld %10lld bytes %9.2f ms, %.2f ms max\n", name,
+           stats->count, stats->bytes, stats->time * 1000,
+           stats->max_time * 1000);
+    *total_time += stats->time;
+}
+
+/*
+ * Show a summary of the traffic with the server in chat, the counts for each
+ * message type are printed to stdout.
+ */
+void show_netstats(int player_id) {
+    char text[MAX_TEXT_LENGTH];
+    NetSummary s;
+    netstats_summary(&s);
+    snprintf(text, MAX_TEXT_LENGTH,
+             "rtt %.1f ms (%.1f min), chunks %.1f ms to answer, %.1f ms to "
+             "draw (%lld)", average_ms(&s.rtt), s.rtt.min * 1000,
+             average_ms(&s.chunk_answer), average_ms(&s.chunk_draw),
+             s.chunk_draw.count);
+    add_message(player_id, text);
+    printf("netstats:\n");
+    double parse_time = 0;
+    netstats_for_each(print_message_stats, &parse_time);
+    snprintf(text, MAX_TEXT_LENGTH,
+             "recv %lld KB (%d KB and %d layers queued), sent %lld KB, "
+             "parsed in %.1f ms", s.recv.bytes / 1024, s.recv.queued / 1024,
+             s.staged_layers, s.send.bytes / 1024, parse_time * 1000);
+    add_message(player_id, text);
+}
+
 void parse_command(LocalPlayer *local, const char *buffer, int forward) {
     char server_addr[MAX_ADDR_LENGTH];
     int server_port = DEFAULT_PORT;
@@ -3191,6 +3897,7 @@ void parse_command(LocalPlayer *local, const char *buffer, int forward) {
     int int_option, radius, count, p, q, xc, yc, zc;
     char window_title[MAX_TITLE_LENGTH];
     char worldgen_path[MAX_PATH_LENGTH];
+    char backup_path[MAX_PATH_LENGTH];
     Player *player = local->player;
     if (strcmp(buffer, "/fullscreen") == 0) {
         pg_toggle_fullscreen();
@@ -3230,6 +3937,12 @@ void parse_command(LocalPlayer *local, const char *buffer, int forward) {
     else if (sscanf(buffer, "/goto %32c", name) == 1) {
         client_goto(player->id, name);
     }
+    else if (sscanf(buffer, "/backup %511c", backup_path) == 1) {
+        int prefix_length = strlen("/backup ");
+        backup_path[MIN(strlen(buffer) - prefix_length,
+                        MAX_PATH_LENGTH - 1)] = '\0';
+        pw_backup(player->id, backup_path);
+    }
     else if (sscanf(buffer, "/pq %d %d", &p, &q) == 2) {
         client_pq(player->id, p, q);
     }
@@ -3431,6 +4144,13 @@ void parse_command(LocalPlayer *local, const char *buffer, int forward) {
             set_view_radius(g->render_radius, radius);
         }
     }
+    else if (strcmp(buffer, "/netstats") == 0) {
+        show_netstats(player->id);
+        if (forward) {
+            // The server adds its own counts
+            client_talk(buffer);
+        }
+    }
     else if (sscanf(buffer, "/time %d", &int_option) == 1) {
         if (g->mode == MODE_OFFLINE && int_option >= 0 && int_option <= 24) {
             pg_set_time(g->day_length /
@@ -3766,211 +4486,629 @@ void handle_movement(double dt, LocalPlayer *local) {
     }
 }
 
-void parse_buffer(char *buffer) {
+/*
+ * Apply one line of the text protocol, picked by its first character. Lines
+ * that do not match the format of their type are ignored.
+ */
+void parse_line(const char *line) {
     #define INVALID_PLAYER_INDEX (p < 1 || p > MAX_LOCAL_PLAYERS)
     Client *local_client = g->clients;
-    char *key;
-    char *line = tokenize(buffer, "\n", &key);
-    while (line) {
-        int pid;
-        int p;
-        float px, py, pz, prx, pry;
-        if (sscanf(line, "P,%d,%d,%f,%f,%f,%f,%f",
-            &pid, &p, &px, &py, &pz, &prx, &pry) == 7)
-        {
-            if (INVALID_PLAYER_INDEX) goto next_line;
-            Client *client = find_client(pid);
-            if (!client && g->client_count < MAX_CLIENTS) {
-                // Add a new client
-                client = g->clients + g->client_count;
-                g->client_count++;
-                client->id = pid;
-                // Initialize the players.
-                for (int i=0; i<MAX_LOCAL_PLAYERS; i++) {
-                    Player *player = client->players + i;
-                    player->is_active = 0;
-                    player->id = i + 1;
-                    player->buffer = 0;
-                    player->texture_index = i;
-                }
-            }
-            if (client) {
-                Player *player = &client->players[p - 1];
-                if (!player->is_active) {
-                    // Add remote player
-                    player->is_active = 1;
-                    snprintf(player->name, MAX_NAME_LENGTH, "player%d-%d",
-                             pid, p);
-                    update_player(player, px, py, pz, prx, pry, 1);
-                    client_add_player(player->id);
-                } else {
-                    update_player(player, px, py, pz, prx, pry, 1);
-                }
-            }
-            goto next_line;
+    const char *c = line + 1;
+    int pid, p;
+    int v[6];
+    float f[5];
+    char name[MAX_NAME_LENGTH];
+    switch (line[0]) {
+    case 'P': {
+        if (!read_int_field(&c, &pid) || !read_int_field(&c, &p) ||
+            !read_float_fields(&c, f, 5) || INVALID_PLAYER_INDEX) {
+            break;
         }
-        float ux, uy, uz, urx, ury;
-        if (sscanf(line, "U,%d,%d,%f,%f,%f,%f,%f",
-            &pid, &p, &ux, &uy, &uz, &urx, &ury) == 7)
-        {
-            if (INVALID_PLAYER_INDEX) goto next_line;
-            Player *me = local_client->players + (p-1);
-            State *s = &me->state;
-            local_client->id = pid;
-            s->x = ux; s->y = uy; s->z = uz; s->rx = urx; s->ry = ury;
-            force_chunks(me);
-            if (uy == 0) {
-                s->y = highest_block(s->x, s->z) + 2;
+        Client *client = find_client(pid);
+        if (!client && g->client_count < MAX_CLIENTS) {
+            // Add a new client
+            client = g->clients + g->client_count;
+            g->client_count++;
+            client->id = pid;
+            // Initialize the players.
+            for (int i=0; i<MAX_LOCAL_PLAYERS; i++) {
+                Player *player = client->players + i;
+                player->is_active = 0;
+                player->id = i + 1;
+                player->texture_index = i;
+            }
+        }
+        if (client) {
+            Player *player = &client->players[p - 1];
+            if (!player->is_active) {
+                // Add remote player
+                player->is_active = 1;
+                snprintf(player->name, MAX_NAME_LENGTH, "player%d-%d",
+                         pid, p);
+                update_player(player, f[0], f[1], f[2], f[3], f[4], 1);
+                client_add_player(player->id);
+            } else {
+                update_player(player, f[0], f[1], f[2], f[3], f[4], 1);
             }
-            goto next_line;
         }
-
-        int bp, bq, bx, by, bz, bw;
-        if (sscanf(line, "B,%d,%d,%d,%d,%d,%d",
-            &bp, &bq, &bx, &by, &bz, &bw) == 6)
-        {
-            Player *me = local_client->players;
-            State *s = &me->state;
-            _set_block(bp, bq, bx, by, bz, bw, 0);
-            if (player_intersects_block(2, s->x, s->y, s->z, bx, by, bz)) {
+        break;
+    }
+    case 'U': {
+        if (!read_int_field(&c, &pid) || !read_int_field(&c, &p) ||
+            !read_float_fields(&c, f, 5) || INVALID_PLAYER_INDEX) {
+            break;
+        }
+        Player *me = local_client->players + (p-1);
+        State *s = &me->state;
+        local_client->id = pid;
+        s->x = f[0]; s->y = f[1]; s->z = f[2]; s->rx = f[3]; s->ry = f[4];
+        force_chunks(me);
+        if (f[1] == 0) {
+            s->y = highest_block(s->x, s->z) + 2;
+        }
+        break;
+    }
+    case 'B':
+        if (read_int_fields(&c, v, 6)) {
+            State *s = &local_client->players->state;
+            _set_block(v[0], v[1], v[2], v[3], v[4], v[5], 0);
+            if (player_intersects_block(2, s->x, s->y, s->z,
+                                        v[2], v[3], v[4])) {
                 s->y = highest_block(s->x, s->z) + 2;
             }
-            goto next_line;
         }
-        if (sscanf(line, "e,%d,%d,%d,%d,%d,%d",
-            &bp, &bq, &bx, &by, &bz, &bw) == 6)
-        {
-            _set_extra(bp, bq, bx, by, bz, bw, 0);
-            goto next_line;
+        break;
+    case 'e':
+        if (read_int_fields(&c, v, 6)) {
+            _set_extra(v[0], v[1], v[2], v[3], v[4], v[5], 0);
         }
-        if (sscanf(line, "s,%d,%d,%d,%d,%d,%d",
-            &bp, &bq, &bx, &by, &bz, &bw) == 6)
-        {
-            _set_shape(bp, bq, bx, by, bz, bw, 0);
-            goto next_line;
+        break;
+    case 's':
+        if (read_int_fields(&c, v, 6)) {
+            _set_shape(v[0], v[1], v[2], v[3], v[4], v[5], 0);
         }
-        if (sscanf(line, "t,%d,%d,%d,%d,%d,%d",
-            &bp, &bq, &bx, &by, &bz, &bw) == 6)
-        {
-            _set_transform(bp, bq, bx, by, bz, bw, 0);
-            goto next_line;
+        break;
+    case 't':
+        if (read_int_fields(&c, v, 6)) {
+            _set_transform(v[0], v[1], v[2], v[3], v[4], v[5], 0);
         }
-        if (sscanf(line, "L,%d,%d,%d,%d,%d,%d",
-            &bp, &bq, &bx, &by, &bz, &bw) == 6)
-        {
-            _set_light(bp, bq, bx, by, bz, bw);
-            goto next_line;
-        }
-        if (sscanf(line, "X,%d,%d", &pid, &p) == 2) {
-            if (INVALID_PLAYER_INDEX) goto next_line;
-            Client *client = find_client(pid);
-            if (client) {
-                Player *player = &client->players[p - 1];
-                player->is_active = 0;
-            }
-            goto next_line;
+        break;
+    case 'L':
+        if (read_int_fields(&c, v, 6)) {
+            _set_light(v[0], v[1], v[2], v[3], v[4], v[5]);
         }
-        if (sscanf(line, "D,%d", &pid) == 1) {
+        break;
+    case 'X': {
+        if (!read_int_field(&c, &pid) || !read_int_field(&c, &p) ||
+            INVALID_PLAYER_INDEX) {
+            break;
+        }
+        Client *client = find_client(pid);
+        if (client) {
+            Player *player = &client->players[p - 1];
+            player->is_active = 0;
+        }
+        break;
+    }
+    case 'D':
+        if (read_int_field(&c, &pid)) {
             delete_client(pid);
-            goto next_line;
         }
-        int kp, kq, kk;
-        if (sscanf(line, "K,%d,%d,%d", &kp, &kq, &kk) == 3) {
-            db_set_key(kp, kq, kk);
-            goto next_line;
+        break;
+    case 'C':
+        if (read_int_fields(&c, v, 2)) {
+            chunk_answered(v[0], v[1]);
+        }
+        break;
+    case 'p': {
+        double sent;
+        if (read_double_field(&c, &sent)) {
+            netstats_add_rtt(netstats_time() - sent);
+        }
+        break;
+    }
+    case 'K':
+        if (read_int_fields(&c, v, 3)) {
+            db_set_key(v[0], v[1], v[2]);
         }
-        if (sscanf(line, "R,%d,%d", &kp, &kq) == 2) {
-            Chunk *chunk = find_chunk(kp, kq);
+        break;
+    case 'R':
+        if (read_int_fields(&c, v, 2)) {
+            Chunk *chunk = find_chunk(v[0], v[1]);
             if (chunk) {
                 dirty_chunk(chunk);
             }
-            goto next_line;
         }
+        break;
+    case 'E': {
         double elapsed;
         int day_length;
-        if (sscanf(line, "E,%lf,%d", &elapsed, &day_length) == 2) {
+        if (read_double_field(&c, &elapsed) &&
+            read_int_field(&c, &day_length)) {
             pg_set_time(fmod(elapsed, day_length));
             g->day_length = day_length;
             g->time_changed = 1;
-            goto next_line;
         }
-        if (line[0] == 'T' && line[1] == ',') {
-            char *text = line + 2;
+        break;
+    }
+    case 'T':
+        if (line[1] == ',') {
+            const char *text = line + 2;
             for (int i=0; i<MAX_LOCAL_PLAYERS; i++) {
                 add_message(i+1, text);
             }
-            goto next_line;
         }
-        char format[64];
-        snprintf(
-            format, sizeof(format), "N,%%d,%%d,%%%ds", MAX_NAME_LENGTH - 1);
-        char name[MAX_NAME_LENGTH];
-        if (sscanf(line, format, &pid, &p, name) == 3) {
-            if (INVALID_PLAYER_INDEX) goto next_line;
-            Client *client = find_client(pid);
-            if (client) {
-                strncpy(client->players[p - 1].name, name, MAX_NAME_LENGTH);
-            }
-            goto next_line;
+        break;
+    case 'N': {
+        if (!read_int_field(&c, &pid) || !read_int_field(&c, &p) ||
+            !read_word_field(&c, name, MAX_NAME_LENGTH) ||
+            INVALID_PLAYER_INDEX) {
+            break;
+        }
+        Client *client = find_client(pid);
+        if (client) {
+            strncpy(client->players[p - 1].name, name, MAX_NAME_LENGTH);
         }
+        break;
+    }
+    case 'O': {
         char value[MAX_NAME_LENGTH];
-        snprintf(
-            format, sizeof(format), "O,%%%d[^,],%%%d[^,]", MAX_NAME_LENGTH - 1,
-            MAX_NAME_LENGTH - 1);
-        if (sscanf(line, format, name, value) == 2) {
-            printf("Got option from server %s = %s\n", name, value);
-            int int_value = atoi(value);
-            if (strncmp(name, "show-plants", 11) == 0 &&
-                (int_value == 0 || int_value == 1)) {
-                if (int_value != config->show_plants) {
-                    config->show_plants = int_value;
-                    g->render_option_changed = 1;  // regenerate world
+        if (!read_text_field(&c, name, MAX_NAME_LENGTH, ",") ||
+            !read_text_field(&c, value, MAX_NAME_LENGTH, ",")) {
+            break;
+        }
+        printf("Got option from server %s = %s\n", name, value);
+        int int_value = atoi(value);
+        if (strncmp(name, "show-plants", 11) == 0 &&
+            (int_value == 0 || int_value == 1)) {
+            if (int_value != config->show_plants) {
+                config->show_plants = int_value;
+                g->render_option_changed = 1;  // regenerate world
+            }
+        } else if (strncmp(name, "show-trees", 9) == 0 &&
+                   (int_value == 0 || int_value == 1)) {
+            if (int_value != config->show_trees) {
+                config->show_trees = int_value;
+                g->render_option_changed = 1;  // regenerate world
+            }
+        } else if (strncmp(name, "show-clouds", 11) == 0 &&
+                   (int_value == 0 || int_value == 1)) {
+            if (int_value != config->show_clouds) {
+                config->show_clouds = int_value;
+                g->render_option_changed = 1;  // regenerate world
+            }
+        } else if (strncmp(name, "worldgen", 8) == 0) {
+            // Only except a named worldgen or empty for default.
+            // Only a worldgen script under the client's ./worldgen dir
+            // will be excepted.
+            if (strlen(value) > 0) {
+                if (strchr(value, '/')) {
+                    printf(
+            "Path component not allowed in worldgen from server: %s\n"
+            "Please ask the server admin to use named worldgens only.\n",
+                           value);
+                    break;
                 }
-            } else if (strncmp(name, "show-trees", 9) == 0 &&
-                       (int_value == 0 || int_value == 1)) {
-                if (int_value != config->show_trees) {
-                    config->show_trees = int_value;
-                    g->render_option_changed = 1;  // regenerate world
+                set_worldgen(value);
+            } else {
+                set_worldgen(NULL);
+            }
+        } else if (strcmp(name, "sync") == 0 &&
+                   strcmp(value, "revision") == 0) {
+            db_set_option("sync", "revision");
+        }
+        break;
+    }
+    case 'S':
+        if (read_int_fields(&c, v, 6)) {
+            // The sign text is optional, an empty one clears the sign
+            char text[MAX_SIGN_LENGTH] = {0};
+            read_text_field(&c, text, MAX_SIGN_LENGTH, "\n");
+            _set_sign(v[0], v[1], v[2], v[3], v[4], v[5], text, 0);
+        }
+        break;
+    }
+}
+
+void parse_buffer(char *buffer) {
+    char *key;
+    char *line = tokenize(buffer, "\n", &key);
+    while (line) {
+        double start = netstats_time();
+        parse_line(line);
+        netstats_add_line(line, netstats_time() - start);
+        line = tokenize(NULL, "\n", &key);
+    }
+}
+
+void apply_server_edit(int layer, int p, int q, int x, int y, int z, int w) {
+    switch (layer) {
+    case BLOCK: {
+        State *s = &g->clients->players->state;
+        _set_block(p, q, x, y, z, w, 0);
+        if (player_intersects_block(2, s->x, s->y, s->z, x, y, z)) {
+            s->y = highest_block(s->x, s->z) + 2;
+        }
+        break;
+    }
+    case EXTRA:
+        _set_extra(p, q, x, y, z, w, 0);
+        break;
+    case SHAPE:
+        _set_shape(p, q, x, y, z, w, 0);
+        break;
+    case TRANSFORM:
+        _set_transform(p, q, x, y, z, w, 0);
+        break;
+    case LIGHT:
+        _set_light(p, q, x, y, z, w);
+        break;
+    }
+}
+
+void parse_message(const unsigned char *data, const unsigned char *end) {
+    int type = *data++;
+    int v[4];
+    switch (type) {
+    case MSG_TEXT: {
+        char line[1024];
+        int length = MIN(end - data, (int)sizeof(line) - 1);
+        memcpy(line, data, length);
+        line[length] = '\0';
+        parse_buffer(line);
+        break;
+    }
+    case MSG_EDIT:
+    case MSG_CHUNK_LAYER: {
+        int layer, p, q;
+        int count = 1;
+        if (protocol_read_int(&data, end, &layer) ||
+            protocol_read_int(&data, end, &p) ||
+            protocol_read_int(&data, end, &q) ||
+            (type == MSG_CHUNK_LAYER &&
+             protocol_read_int(&data, end, &count))) {
+            break;
+        }
+        int bx = p * CHUNK_SIZE;
+        int bz = q * CHUNK_SIZE;
+        for (int i = 0; i < count; i++) {
+            if (protocol_read_ints(&data, end, v, 4)) {
+                break;
+            }
+            apply_server_edit(layer, p, q, bx + v[0], v[1], bz + v[2], v[3]);
+        }
+        break;
+    }
+    case MSG_KEY:
+        if (protocol_read_ints(&data, end, v, 3) == 0) {
+            db_set_key(v[0], v[1], v[2]);
+        }
+        break;
+    case MSG_REDRAW:
+        if (protocol_read_ints(&data, end, v, 2) == 0) {
+            Chunk *chunk = find_chunk(v[0], v[1]);
+            if (chunk) {
+                dirty_chunk(chunk);
+            }
+        }
+        break;
+    case MSG_CHUNK:
+        if (protocol_read_ints(&data, end, v, 2) == 0) {
+            chunk_answered(v[0], v[1]);
+        }
+        break;
+    }
+}
+
+/*
+ * Decode a chunk layer message and write its entries to the database, on the
+ * stage thread.
+ */
+void decode_staged_layer(StagedLayer *item) {
+    const unsigned char *data = item->message + 1;
+    const unsigned char *end = item->message + item->size;
+    int layer, p, q, count;
+    item->count = 0;
+    if (protocol_read_int(&data, end, &layer) ||
+        protocol_read_int(&data, end, &p) ||
+        protocol_read_int(&data, end, &q) ||
+        protocol_read_int(&data, end, &count) ||
+        count < 0 || count > (end - data) / 4) {
+        return;
+    }
+    item->layer = layer;
+    item->p = p;
+    item->q = q;
+    item->entries = malloc(sizeof(int) * 4 * count);
+    int bx = p * CHUNK_SIZE;
+    int bz = q * CHUNK_SIZE;
+    for (int i = 0; i < count; i++) {
+        int *e = item->entries + i * 4;
+        if (protocol_read_ints(&data, end, e, 4)) {
+            break;
+        }
+        e[0] += bx;
+        e[2] += bz;
+        int x = e[0], y = e[1], z = e[2];
+        switch (layer) {
+        case BLOCK:
+            db_insert_block(p, q, x, y, z, e[3]);
+            if (e[3] == 0 && chunked(x) == p && chunked(z) == q) {
+                // Signs are deleted by merge_staged_layer, the sign
+                // statements of the db are only used from the main thread
+                db_insert_light(p, q, x, y, z, 0);
+                db_insert_extra(p, q, x, y, z, 0);
+                db_insert_shape(p, q, x, y, z, 0);
+                db_insert_transform(p, q, x, y, z, 0);
+            }
+            break;
+        case EXTRA:
+            db_insert_extra(p, q, x, y, z, e[3]);
+            break;
+        case SHAPE:
+            db_insert_shape(p, q, x, y, z, e[3]);
+            break;
+        case TRANSFORM:
+            db_insert_transform(p, q, x, y, z, e[3]);
+            break;
+        case LIGHT:
+            e[3] = MAX(0, MIN(15, e[3]));
+            db_insert_light(p, q, x, y, z, e[3]);
+            break;
+        }
+        item->count++;
+    }
+}
+
+int stage_run(void *arg) {
+    Stage *stage = (Stage *)arg;
+    mtx_lock(&stage->mtx);
+    while (stage->running) {
+        StagedLayer *item = stage->unstaged;
+        if (!item) {
+            cnd_wait(&stage->cnd, &stage->mtx);
+            continue;
+        }
+        mtx_unlock(&stage->mtx);
+        double start = netstats_time();
+        decode_staged_layer(item);
+        item->time = netstats_time() - start;
+        mtx_lock(&stage->mtx);
+        item->ready = 1;
+        stage->unstaged = item->next;
+    }
+    mtx_unlock(&stage->mtx);
+    return 0;
+}
+
+void start_stage(void) {
+    Stage *stage = &g->stage;
+    stage->first = stage->last = stage->unstaged = NULL;
+    stage->count = 0;
+    stage->running = 1;
+    mtx_init(&stage->mtx, mtx_plain);
+    cnd_init(&stage->cnd);
+    thrd_create(&stage->thrd, stage_run, stage);
+}
+
+/*
+ * Stop the stage thread, dropping layers not merged yet. Their chunks are
+ * sent again after reconnecting as the keys were not updated.
+ */
+void stop_stage(void) {
+    Stage *stage = &g->stage;
+    if (!stage->running) {
+        return;
+    }
+    mtx_lock(&stage->mtx);
+    stage->running = 0;
+    cnd_signal(&stage->cnd);
+    mtx_unlock(&stage->mtx);
+    thrd_join(stage->thrd, NULL);
+    cnd_destroy(&stage->cnd);
+    mtx_destroy(&stage->mtx);
+    while (stage->first) {
+        StagedLayer *item = stage->first;
+        stage->first = item->next;
+        free(item->message);
+        free(item->entries);
+        free(item);
+    }
+    stage->last = stage->unstaged = NULL;
+    stage->count = 0;
+    g->recv_lines = NULL;
+    g->recv_data = g->recv_end = NULL;
+}
+
+void stage_layer(const unsigned char *message, int size) {
+    Stage *stage = &g->stage;
+    StagedLayer *item = calloc(1, sizeof(StagedLayer));
+    item->message = malloc(size);
+    memcpy(item->message, message, size);
+    item->size = size;
+    mtx_lock(&stage->mtx);
+    if (stage->last) {
+        stage->last->next = item;
+    } else {
+        stage->first = item;
+    }
+    stage->last = item;
+    if (!stage->unstaged) {
+        stage->unstaged = item;
+    }
+    stage->count++;
+    netstats_set_staged_layers(stage->count);
+    cnd_signal(&stage->cnd);
+    mtx_unlock(&stage->mtx);
+}
+
+/*
+ * Merge the entries of a decoded layer into its chunk, if it is loaded,
+ * until max_time has passed since start by netstats_time. Returns 1 once
+ * all are merged.
+ */
+int merge_staged_layer(StagedLayer *item, double start, double max_time) {
+    double merge_start = netstats_time();
+    Chunk *chunk = find_chunk(item->p, item->q);
+    if (!chunk) {
+        chunk_cache_remove(item->p, item->q);
+        for (int i = item->applied; item->layer == BLOCK && i < item->count;
+             i++) {
+            int *e = item->entries + i * 4;
+            if (e[3] == 0 && chunked(e[0]) == item->p &&
+                chunked(e[2]) == item->q) {
+                db_delete_signs(e[0], e[1], e[2]);
+            }
+        }
+        return 1;
+    }
+    State *s = &g->clients->players->state;
+    int p = item->p;
+    int q = item->q;
+    int dirty = 0;
+    while (item->applied < item->count) {
+        int *e = item->entries + item->applied++ * 4;
+        int x = e[0], y = e[1], z = e[2], w = e[3];
+        switch (item->layer) {
+        case BLOCK:
+            map_set(&chunk->map, x, y, z, w);
+            if (w == 0 && chunked(x) == p && chunked(z) == q) {
+                db_delete_signs(x, y, z);
+                if (sign_list_remove_all(&chunk->signs, x, y, z)) {
+                    chunk->dirty_signs = 1;
+                }
+                dirty |= map_set(&chunk->lights, x, y, z, 0);
+                dirty |= map_set(&chunk->extra, x, y, z, 0);
+                dirty |= map_set(&chunk->shape, x, y, z, 0);
+                dirty |= map_set(&chunk->transform, x, y, z, 0);
+                door_map_clear(&chunk->doors, x, y, z);
+            }
+            if (player_intersects_block(2, s->x, s->y, s->z, x, y, z)) {
+                s->y = highest_block(s->x, s->z) + 2;
+            }
+            break;
+        case EXTRA:
+            map_set(&chunk->extra, x, y, z, w);
+            break;
+        case SHAPE:
+            map_set(&chunk->shape, x, y, z, w);
+            break;
+        case TRANSFORM:
+            map_set(&chunk->transform, x, y, z, w);
+            break;
+        case LIGHT:
+            dirty |= map_set(&chunk->lights, x, y, z, w);
+            break;
+        }
+        if (item->applied % 256 == 0 && netstats_time() - start > max_time) {
+            break;
+        }
+    }
+    if (dirty) {
+        dirty_chunk(chunk);
+    }
+    item->time += netstats_time() - merge_start;
+    return item->applied == item->count;
+}
+
+/*
+ * Merge decoded layers in the order they arrived. Returns the number of
+ * layers still waiting to be merged.
+ */
+int merge_staged_layers(double start, double max_time) {
+    Stage *stage = &g->stage;
+    while (1) {
+        mtx_lock(&stage->mtx);
+        StagedLayer *item = stage->first;
+        int ready = item && item->ready;
+        int count = stage->count;
+        mtx_unlock(&stage->mtx);
+        if (!ready || !merge_staged_layer(item, start, max_time)) {
+            return count;
+        }
+        mtx_lock(&stage->mtx);
+        stage->first = item->next;
+        if (!stage->first) {
+            stage->last = NULL;
+        }
+        stage->count--;
+        netstats_set_staged_layers(stage->count);
+        mtx_unlock(&stage->mtx);
+        netstats_add_message(MSG_CHUNK_LAYER, item->size, item->time);
+        free(item->message);
+        free(item->entries);
+        free(item);
+        if (netstats_time() - start > max_time) {
+            return stage->count;
+        }
+    }
+}
+
+/*
+ * Apply data from the server until max_time has passed, what is left over
+ * is carried to the next frame. Chunk layer messages are decoded on the
+ * stage thread, messages after them wait until they have been merged so
+ * edits are applied in the order the server sent them. The time is taken
+ * from the monotonic clock, as E lines from the server set pg_get_time.
+ */
+void handle_server_data(double max_time) {
+    double start = netstats_time();
+    int staged = merge_staged_layers(start, max_time);
+    while (netstats_time() - start <= max_time) {
+        if (g->recv_lines) {
+            char *line = tokenize(NULL, "\n", &g->recv_lines);
+            if (line) {
+                double line_start = netstats_time();
+                parse_line(line);
+                netstats_add_line(line, netstats_time() - line_start);
+                continue;
+            }
+            g->recv_lines = NULL;
+        }
+        if (g->recv_data < g->recv_end) {
+            const unsigned char *data = g->recv_data;
+            unsigned int size;
+            if (protocol_read_uint(&data, g->recv_end, &size) || size == 0 ||
+                size > (unsigned int)(g->recv_end - data)) {
+                g->recv_data = g->recv_end;
+                continue;
+            }
+            if (data[0] == MSG_CHUNK_LAYER) {
+                if (staged >= MAX_STAGED_LAYERS) {
+                    break;
                 }
-            } else if (strncmp(name, "show-clouds", 11) == 0 &&
-                       (int_value == 0 || int_value == 1)) {
-                if (int_value != config->show_clouds) {
-                    config->show_clouds = int_value;
-                    g->render_option_changed = 1;  // regenerate world
+                stage_layer(data, size);
+                staged++;
+            } else if (staged > 0) {
+                staged = merge_staged_layers(start, max_time);
+                if (staged > 0) {
+                    break;
                 }
-            } else if (strncmp(name, "worldgen", 8) == 0) {
-                // Only except a named worldgen or empty for default.
-                // Only a worldgen script under the client's ./worldgen dir
-                // will be excepted.
-                if (strlen(value) > 0) {
-                    if (strchr(value, '/')) {
-                        printf(
-                "Path component not allowed in worldgen from server: %s\n"
-                "Please ask the server admin to use named worldgens only.\n",
-                               value);
-                        goto next_line;
-                    }
-                    set_worldgen(value);
-                } else {
-                    set_worldgen(NULL);
+                continue;
+            } else {
+                double message_start = netstats_time();
+                parse_message(data, data + size);
+                // Lines in text messages are counted by parse_buffer
+                if (data[0] != MSG_TEXT) {
+                    netstats_add_message(data[0], size,
+                                         netstats_time() - message_start);
                 }
             }
-            goto next_line;
+            g->recv_data = data + size;
+            continue;
         }
-        snprintf(
-            format, sizeof(format),
-            "S,%%d,%%d,%%d,%%d,%%d,%%d,%%%d[^\n]", MAX_SIGN_LENGTH - 1);
-        int face;
-        char text[MAX_SIGN_LENGTH] = {0};
-        if (sscanf(line, format,
-            &bp, &bq, &bx, &by, &bz, &face, text) >= 6)
-        {
-            _set_sign(bp, bq, bx, by, bz, face, text, 0);
-            goto next_line;
+        char *buffer = client_recv();
+        if (buffer) {
+            g->recv_lines = buffer;
+            continue;
         }
-
-next_line:
-        line = tokenize(NULL, "\n", &key);
+        int length;
+        unsigned char *messages = client_recv_messages(&length);
+        if (!messages) {
+            break;
+        }
+        g->recv_data = messages;
+        g->recv_end = messages + length;
     }
 }
 
@@ -4624,6 +5762,7 @@ void handle_key_press(int keyboard_id, int mods, int keysym)
             // cancel observing of another player
             p->observe1 = 0;
             p->observe1_client_id = 0;
+            del_observe_view(&p->observe1_view);
         }
         break;
         }
@@ -4640,6 +5779,7 @@ void handle_key_press(int keyboard_id, int mods, int keysym)
             // cancel observing of another player
             p->observe2 = 0;
             p->observe2_client_id = 0;
+            del_observe_view(&p->observe2_view);
         }
         break;
         }
@@ -5324,7 +6464,8 @@ void handle_joystick_button(PG_Joystick *j, int j_num, int button, int state)
 void render_player_world(
         LocalPlayer *local, GLuint sky_buffer, Attrib *sky_attrib,
         Attrib *block_attrib, Attrib *text_attrib, Attrib *line_attrib,
-        Attrib *mouse_attrib, FPS fps)
+        Attrib *mouse_attrib, Attrib *player_attrib, Attrib *texture_attrib,
+        FPS fps)
 {
     Player *player = local->player;
     State *s = &player->state;
@@ -5336,21 +6477,36 @@ void render_player_world(
     g->ortho = local->ortho_is_pressed ? 64 : 0;
     g->fov = local->zoom_is_pressed ? 15 : 65;
 
+    int observe_status = OBSERVE_VIEW_DIRECT;
     if (local->observe1 > 0 && find_client(local->observe1_client_id)) {
         player = find_client(local->observe1_client_id)->players +
                  (local->observe1 - 1);
+        observe_status = begin_observe_view(&local->observe1_view,
+            local->view_width, local->view_height, local->observe1,
+            local->observe1_client_id);
     }
 
     // RENDER 3-D SCENE //
-    render_sky(sky_attrib, player, sky_buffer);
-    glClear(GL_DEPTH_BUFFER_BIT);
-    int face_count = render_chunks(block_attrib, player);
-    render_signs(text_attrib, player);
-    render_sign(text_attrib, local);
-    render_players(block_attrib, player);
-    if (config->show_wireframe) {
-        render_wireframe(line_attrib, player);
+    int face_count = 0;
+    if (observe_status != OBSERVE_VIEW_CACHED) {
+        render_sky(sky_attrib, player, sky_buffer);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        face_count = render_chunks(block_attrib, player);
+        render_signs(text_attrib, player);
+        render_players(player_attrib, player);
+        if (config->show_wireframe) {
+            render_wireframe(line_attrib, player);
+        }
     }
+    if (observe_status != OBSERVE_VIEW_DIRECT) {
+        ObserveView *view = &local->observe1_view;
+        if (observe_status == OBSERVE_VIEW_RENDER) {
+            view->face_count = face_count;
+        }
+        face_count = view->face_count;
+        draw_observe_view(texture_attrib, view, local->view_x, local->view_y);
+    }
+    render_sign(text_attrib, local);
 
     // RENDER HUD //
     glClear(GL_DEPTH_BUFFER_BIT);
@@ -5462,19 +6618,28 @@ void render_player_world(
         glClear(GL_COLOR_BUFFER_BIT);
         glDisable(GL_SCISSOR_TEST);
         glClear(GL_DEPTH_BUFFER_BIT);
-        glViewport(g->width - pw - offset + local->view_x,
-                   offset + local->view_y, pw, ph);
+        int px = g->width - pw - offset + local->view_x;
+        int py = offset + local->view_y;
+        glViewport(px, py, pw, ph);
 
         g->width = pw;
         g->height = ph;
         g->ortho = 0;
         g->fov = 65;
 
-        render_sky(sky_attrib, player, sky_buffer);
-        glClear(GL_DEPTH_BUFFER_BIT);
-        render_chunks(block_attrib, player);
-        render_signs(text_attrib, player);
-        render_players(block_attrib, player);
+        ObserveView *view = &local->observe2_view;
+        observe_status = begin_observe_view(view, pw, ph, local->observe2,
+                                            local->observe2_client_id);
+        if (observe_status != OBSERVE_VIEW_CACHED) {
+            render_sky(sky_attrib, player, sky_buffer);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            render_chunks(block_attrib, player);
+            render_signs(text_attrib, player);
+            render_players(player_attrib, player);
+        }
+        if (observe_status != OBSERVE_VIEW_DIRECT) {
+            draw_observe_view(texture_attrib, view, px, py);
+        }
         glClear(GL_DEPTH_BUFFER_BIT);
         if (config->show_player_names) {
             render_text(text_attrib, ALIGN_CENTER,
@@ -5704,6 +6869,7 @@ void drain_edit_queue(size_t max_items, double max_time, double now)
                     break;
                 case KEY:
                 case COMMIT:
+                case BACKUP:
                 case EXIT:
                 default:
                     printf("Edit ring does not support: %d\n", e.type);
@@ -5767,6 +6933,353 @@ void deinitialize_worker_threads(void)
     }
 }
 
+#define MAX_PRUNE_THREADS 16
+
+typedef struct {
+    int *chunks;
+    int count;
+    int next;
+    mtx_t mtx;
+    unsigned char **results;  // pruned changes per chunk, NULL if unchanged
+    int *result_sizes;
+    unsigned int rows;
+    unsigned int removed;
+} PruneJob;
+
+static void alloc_layer_maps(Map *maps, int p, int q) {
+    int dx = p * CHUNK_SIZE - 1;
+    int dz = q * CHUNK_SIZE - 1;
+    map_alloc(&maps[BLOCK], dx, 0, dz, 0x3fff);
+    map_alloc(&maps[EXTRA], dx, 0, dz, 0xf);
+    map_alloc(&maps[SHAPE], dx, 0, dz, 0xf);
+    map_alloc(&maps[TRANSFORM], dx, 0, dz, 0xf);
+    map_alloc(&maps[LIGHT], dx, 0, dz, 0xf);
+}
+
+static void free_layer_maps(Map *maps) {
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        map_free(&maps[i]);
+    }
+}
+
+int prune_worker_run(void *arg) {
+    PruneJob *job = (PruneJob *)arg;
+    lua_State *L = NULL;
+    if (g->use_lua_worldgen == 1) {
+        L = pwlua_worldgen_init(config->worldgen_path);
+    }
+    DbReader *reader = db_reader_open();
+    ChunkBlob changes;
+    ChunkBlob kept;
+    chunk_blob_alloc(&changes);
+    chunk_blob_alloc(&kept);
+    while (1) {
+        mtx_lock(&job->mtx);
+        int index = job->next++;
+        mtx_unlock(&job->mtx);
+        if (index >= job->count) {
+            break;
+        }
+        int p = job->chunks[index * 2];
+        int q = job->chunks[index * 2 + 1];
+        Map maps[CHUNK_BLOB_LAYERS];
+        SignList signs;
+        alloc_layer_maps(maps, p, q);
+        sign_list_alloc(&signs, 16);
+        if (L != NULL) {
+            pwlua_worldgen(L, p, q, &maps[BLOCK], &maps[EXTRA], &maps[LIGHT],
+                           &maps[SHAPE], &signs, &maps[TRANSFORM]);
+        } else {
+            create_world(p, q, map_set_func, &maps[BLOCK]);
+        }
+        db_load_chunk_changes(reader, &changes, p, q);
+        chunk_blob_clear(&kept);
+        unsigned int rows = 0;
+        unsigned int removed = 0;
+        for (int layer = 0; layer < CHUNK_BLOB_LAYERS; layer++) {
+            BlobLayer *l = changes.layers + layer;
+            for (unsigned int i = 0; i < l->size; i++) {
+                BlobEntry *e = l->data + i;
+                rows++;
+                if (map_get(&maps[layer], e->x, e->y, e->z) == e->w) {
+                    removed++;
+                } else {
+                    chunk_blob_add(&kept, layer, e->x, e->y, e->z, e->w);
+                }
+            }
+        }
+        if (removed > 0) {
+            job->results[index] = chunk_blob_encode(
+                &kept, p, q, &job->result_sizes[index]);
+        }
+        free_layer_maps(maps);
+        sign_list_free(&signs);
+        mtx_lock(&job->mtx);
+        job->rows += rows;
+        job->removed += removed;
+        mtx_unlock(&job->mtx);
+    }
+    chunk_blob_free(&changes);
+    chunk_blob_free(&kept);
+    db_reader_close(reader);
+    if (L != NULL) {
+        lua_close(L);
+    }
+    return 0;
+}
+
+static double monotonic_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_chunk_loads(int *chunks, int count) {
+    double start = monotonic_time();
+    for (int i = 0; i < count; i++) {
+        int p = chunks[i * 2];
+        int q = chunks[i * 2 + 1];
+        Map maps[CHUNK_BLOB_LAYERS];
+        Map *map_ptrs[CHUNK_BLOB_LAYERS];
+        SignList signs;
+        alloc_layer_maps(maps, p, q);
+        for (int j = 0; j < CHUNK_BLOB_LAYERS; j++) {
+            map_ptrs[j] = &maps[j];
+        }
+        sign_list_alloc(&signs, 16);
+        db_load_chunk(NULL, map_ptrs, &signs, p, q);
+        free_layer_maps(maps);
+        sign_list_free(&signs);
+    }
+    return monotonic_time() - start;
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+/*
+ * Set up the worldgen the same way as when playing the open game file.
+ */
+static void load_offline_worldgen(int override_worldgen) {
+    const unsigned char *value;
+    if (!override_worldgen) {
+        value = db_get_option("worldgen");
+        set_worldgen(value != NULL ? (char *)value : NULL);
+    }
+    value = db_get_option("show-clouds");
+    if (value != NULL) {
+        config->show_clouds = atoi((char *)value);
+    }
+    value = db_get_option("show-plants");
+    if (value != NULL) {
+        config->show_plants = atoi((char *)value);
+    }
+    value = db_get_option("show-trees");
+    if (value != NULL) {
+        config->show_trees = atoi((char *)value);
+    }
+}
+
+/*
+ * Remove the stored changes that are the same as what the worldgen creates
+ * at that position, as they make no difference when a chunk is loaded.
+ */
+int prune_db(char *path, int override_worldgen) {
+    db_enable();
+    if (db_init(path)) {
+        printf("Could not open: %s\n", path);
+        return 1;
+    }
+    load_offline_worldgen(override_worldgen);
+    db_vacuum();
+    long size_before = file_size(path);
+
+    PruneJob job;
+    memset(&job, 0, sizeof(job));
+    job.count = db_changed_chunks(&job.chunks);
+    job.results = calloc(job.count, sizeof(unsigned char *));
+    job.result_sizes = calloc(job.count, sizeof(int));
+    mtx_init(&job.mtx, mtx_plain);
+    double load_before = time_chunk_loads(job.chunks, job.count);
+
+    double start = monotonic_time();
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = MAX(1, MIN(thread_count, MAX_PRUNE_THREADS));
+    thrd_t threads[MAX_PRUNE_THREADS];
+    for (int i = 0; i < thread_count; i++) {
+        thrd_create(&threads[i], prune_worker_run, &job);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        thrd_join(threads[i], NULL);
+    }
+    ChunkBlob kept;
+    chunk_blob_alloc(&kept);
+    for (int i = 0; i < job.count; i++) {
+        if (job.results[i] == NULL) {
+            continue;
+        }
+        int p = job.chunks[i * 2];
+        int q = job.chunks[i * 2 + 1];
+        chunk_blob_decode(&kept, p, q, job.results[i], job.result_sizes[i]);
+        db_save_chunk_changes(p, q, &kept);
+        free(job.results[i]);
+    }
+    chunk_blob_free(&kept);
+    db_vacuum();
+    double prune_time = monotonic_time() - start;
+    long size_after = file_size(path);
+    double load_after = time_chunk_loads(job.chunks, job.count);
+
+    printf("Pruned %u of %u rows in %d chunks in %.2fs\n",
+           job.removed, job.rows, job.count, prune_time);
+    printf("File size: %ld -> %ld bytes\n", size_before, size_after);
+    printf("Loading all chunks: %.2fms -> %.2fms\n",
+           load_before * 1000, load_after * 1000);
+
+    mtx_destroy(&job.mtx);
+    free(job.chunks);
+    free(job.results);
+    free(job.result_sizes);
+    db_close();
+    set_worldgen(NULL);
+    return 0;
+}
+
+#define MAX_PREGENERATE_THREADS 16
+
+typedef struct {
+    int *chunks;  // p, q pairs, nearest the origin first
+    int count;
+    int next;
+    int done;
+    long long size;   // bytes stored so far
+    long long limit;  // stop storing before the cache would evict them
+    mtx_t mtx;
+} PregenerateJob;
+
+int pregenerate_worker_run(void *arg) {
+    PregenerateJob *job = (PregenerateJob *)arg;
+    lua_State *L = NULL;
+    if (g->use_lua_worldgen == 1) {
+        L = pwlua_worldgen_init(config->worldgen_path);
+    }
+    while (1) {
+        mtx_lock(&job->mtx);
+        int index = job->next++;
+        mtx_unlock(&job->mtx);
+        if (index >= job->count) {
+            break;
+        }
+        int p = job->chunks[index * 2];
+        int q = job->chunks[index * 2 + 1];
+        Map maps[CHUNK_BLOB_LAYERS];
+        Map *map_ptrs[CHUNK_BLOB_LAYERS];
+        SignList signs;
+        alloc_layer_maps(maps, p, q);
+        for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+            map_ptrs[i] = &maps[i];
+        }
+        sign_list_alloc(&signs, 16);
+        if (L != NULL) {
+            pwlua_worldgen(L, p, q, &maps[BLOCK], &maps[EXTRA], &maps[LIGHT],
+                           &maps[SHAPE], &signs, &maps[TRANSFORM]);
+        } else {
+            create_world(p, q, map_set_func, &maps[BLOCK]);
+        }
+        int size = worldgen_cache_put(p, q, map_ptrs, &signs);
+        mtx_lock(&job->mtx);
+        job->size += size;
+        job->done++;
+        if (job->size > job->limit) {
+            job->next = job->count;
+        }
+        mtx_unlock(&job->mtx);
+        free_layer_maps(maps);
+        sign_list_free(&signs);
+    }
+    if (L != NULL) {
+        lua_close(L);
+    }
+    return 0;
+}
+
+/*
+ * Run the worldgen for all chunks within radius of the origin and store
+ * the output in the worldgen cache, so load_chunk does not need to
+ * generate them.
+ */
+int pregenerate(char *path, int radius, int override_worldgen) {
+    db_enable();
+    if (db_init(path)) {
+        printf("Could not open: %s\n", path);
+        return 1;
+    }
+    load_offline_worldgen(override_worldgen);
+    db_close();
+    db_disable();
+    update_worldgen_cache_signature();
+    if (config->worldgen_cache_size <= 0) {
+        printf("The worldgen cache is disabled by --worldgen-cache-size\n");
+        return 1;
+    }
+    long long max_size = config->worldgen_cache_size * 1024LL * 1024LL;
+    char cache_path[MAX_PATH_LENGTH];
+    snprintf(cache_path, MAX_PATH_LENGTH, "%s/%s", config->path,
+             WORLDGEN_CACHE_FILENAME);
+    if (worldgen_cache_open(cache_path, max_size)) {
+        return 1;
+    }
+
+    PregenerateJob job;
+    memset(&job, 0, sizeof(job));
+    job.count = (radius * 2 + 1) * (radius * 2 + 1);
+    job.chunks = malloc(sizeof(int) * 2 * job.count);
+    // Eviction cuts the cache to 90% of its limit, dropping rows of other
+    // worldgens first. Stopping at 80% leaves room for the chunks still
+    // being made, so none of this run's rows are dropped.
+    job.limit = max_size / 10 * 8;
+    int n = 0;
+    for (int d = 0; d <= radius; d++) {
+        for (int p = -d; p <= d; p++) {
+            for (int q = -d; q <= d; q++) {
+                if (ABS(p) == d || ABS(q) == d) {
+                    job.chunks[n++] = p;
+                    job.chunks[n++] = q;
+                }
+            }
+        }
+    }
+    mtx_init(&job.mtx, mtx_plain);
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = MAX(1, MIN(thread_count, MAX_PREGENERATE_THREADS));
+    thrd_t threads[MAX_PREGENERATE_THREADS];
+    double start = monotonic_time();
+    for (int i = 0; i < thread_count; i++) {
+        thrd_create(&threads[i], pregenerate_worker_run, &job);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        thrd_join(threads[i], NULL);
+    }
+    worldgen_cache_close();
+    double elapsed = monotonic_time() - start;
+    printf("Generated %d chunks in %.2fs using %d threads, %.1f chunks/s\n",
+           job.done, elapsed, thread_count, job.done / elapsed);
+    if (job.done < job.count) {
+        printf("Stopped at %d of %d chunks as the worldgen cache is full, "
+               "raise --worldgen-cache-size to keep more\n",
+               job.done, job.count);
+    }
+    free(job.chunks);
+    mtx_destroy(&job.mtx);
+    set_worldgen(NULL);
+    return 0;
+}
+
 int main(int argc, char **argv) {
     int override_worldgen_from_command_line = 0;
     // INITIALIZATION //
@@ -5798,6 +7311,28 @@ int main(int argc, char **argv) {
         return EXIT_SUCCESS;
     }
 
+    if (config->pregenerate_radius >= 0) {
+        if (pregenerate(config->db_path, config->pregenerate_radius,
+                        override_worldgen_from_command_line)) {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (config->prune_db) {
+        if (prune_db(config->db_path, override_worldgen_from_command_line)) {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (strlen(config->convert_storage) > 0) {
+        if (db_convert_storage(config->db_path, config->convert_storage)) {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
     if (config->lua_standalone) {
         pwlua_standalone_REPL();
         return EXIT_SUCCESS;  //TODO: exit status of lua instance
@@ -5889,6 +7424,8 @@ int main(int argc, char **argv) {
     Attrib text_attrib = {0};
     Attrib sky_attrib = {0};
     Attrib mouse_attrib = {0};
+    Attrib player_attrib = {0};
+    Attrib texture_attrib = {0};
     GLuint program;
 
     program = load_program("block");
@@ -5906,6 +7443,21 @@ int main(int argc, char **argv) {
     block_attrib.timer = glGetUniformLocation(program, "timer");
     block_attrib.map = glGetUniformLocation(program, "map");
 
+    program = load_program_shaders("player", "block");
+    player_attrib.program = program;
+    player_attrib.position = glGetAttribLocation(program, "position");
+    player_attrib.normal = glGetAttribLocation(program, "normal");
+    player_attrib.uv = glGetAttribLocation(program, "uv");
+    player_attrib.matrix = glGetUniformLocation(program, "matrix");
+    player_attrib.sampler = glGetUniformLocation(program, "sampler");
+    player_attrib.extra1 = glGetUniformLocation(program, "sky_sampler");
+    player_attrib.extra2 = glGetUniformLocation(program, "daylight");
+    player_attrib.extra3 = glGetUniformLocation(program, "fog_distance");
+    player_attrib.extra4 = glGetUniformLocation(program, "ortho");
+    player_attrib.extra5 = glGetUniformLocation(program, "model");
+    player_attrib.camera = glGetUniformLocation(program, "camera");
+    player_attrib.timer = glGetUniformLocation(program, "timer");
+
     program = load_program("line");
     line_attrib.program = program;
     line_attrib.position = glGetAttribLocation(program, "position");
@@ -5943,6 +7495,19 @@ int main(int argc, char **argv) {
     mouse_attrib.matrix = glGetUniformLocation(program, "matrix");
     mouse_attrib.sampler = glGetUniformLocation(program, "sampler");
 
+    // Observe views are copied as they are, magenta pixels included
+    program = load_program_shaders("mouse", "texture");
+    texture_attrib.program = program;
+    texture_attrib.position = glGetAttribLocation(program, "position");
+    texture_attrib.uv = glGetAttribLocation(program, "uv");
+    texture_attrib.matrix = glGetUniformLocation(program, "matrix");
+    texture_attrib.sampler = glGetUniformLocation(program, "sampler");
+
+    // PLAYER MODELS //
+    for (int i=0; i<MAX_LOCAL_PLAYERS; i++) {
+        g->player_buffers[i] = gen_player_buffer(i);
+    }
+
     // ONLINE STATUS //
     if (strlen(config->server) > 0) {
         g->mode = MODE_ONLINE;
@@ -5952,6 +7517,16 @@ int main(int argc, char **argv) {
         snprintf(g->db_path, MAX_PATH_LENGTH, "%s", config->db_path);
     }
 
+    if (config->worldgen_cache_size > 0) {
+        char worldgen_cache_path[MAX_PATH_LENGTH];
+        snprintf(worldgen_cache_path, MAX_PATH_LENGTH, "%s/%s", config->path,
+                 WORLDGEN_CACHE_FILENAME);
+        worldgen_cache_open(worldgen_cache_path,
+                            config->worldgen_cache_size * 1024LL * 1024LL);
+    }
+    chunk_cache_init(config->chunk_cache_size * 1024LL * 1024LL,
+                     config->chunk_cache_meshes);
+
     mtx_init(&edit_ring_mtx, mtx_plain);
 
     // OUTER LOOP //
@@ -5968,8 +7543,16 @@ int main(int argc, char **argv) {
                 return EXIT_FAILURE;
             }
             if (g->mode == MODE_ONLINE) {
-                // TODO: support proper caching of signs (handle deletions)
-                db_delete_all_signs();
+                // Cached signs are only kept if the server confirmed last
+                // time that it sends sign deletions by revision, it has to
+                // confirm again with O,sync,revision for the next start.
+                // Keys go with the signs so the server sends them again.
+                const unsigned char *sync = db_get_option("sync");
+                if (!sync || strcmp((const char *)sync, "revision") != 0) {
+                    db_delete_all_signs();
+                    db_delete_all_keys();
+                }
+                db_set_option("sync", "");
             } else {
                 // Setup worldgen from local config
                 const unsigned char *value;
@@ -5999,13 +7582,20 @@ int main(int argc, char **argv) {
                 }
             }
         }
+        update_worldgen_cache_signature();
 
         // CLIENT INITIALIZATION //
         if (g->mode == MODE_ONLINE) {
             client_enable();
             client_connect(config->server, config->port);
             client_start();
+            start_stage();
+            netstats_reset();
             client_version(2);
+            client_version(PROTOCOL_VERSION);
+            if (config->compress_chunks) {
+                client_compress("deflate");
+            }
             login();
         }
 
@@ -6014,6 +7604,11 @@ int main(int argc, char **argv) {
         FPS fps = {0, 0, 0};
         double last_commit = pg_get_time();
         double last_update = pg_get_time();
+        double last_ping = 0;
+        double last_netstats = netstats_time();
+        if (config->netstats_file[0]) {
+            netstats_open_csv(config->netstats_file);
+        }
         GLuint sky_buffer = gen_sky_buffer();
 
         g->client_count = 1;
@@ -6027,7 +7622,6 @@ int main(int argc, char **argv) {
 
             local->player->id = i+1;
             local->player->name[0] = '\0';
-            local->player->buffer = 0;
             local->player->texture_index = i;
 
             local->mouse_id = UNASSIGNED;
@@ -6101,18 +7695,18 @@ int main(int argc, char **argv) {
             pg_poll_joystick_events();
 
             // HANDLE DATA FROM SERVER //
-            char *buffer = client_recv();
-            if (buffer) {
-                parse_buffer(buffer);
-                free(buffer);
-            }
+            handle_server_data(0.005);
 
             // FLUSH DATABASE //
             if (now - last_commit > COMMIT_INTERVAL) {
                 last_commit = now;
                 db_commit();
+                worldgen_cache_commit();
             }
 
+            // BACKUP DATABASE //
+            update_backup();
+
             // SEND POSITION TO SERVER //
             if (now - last_update > 0.1) {
                 last_update = now;
@@ -6128,15 +7722,6 @@ int main(int argc, char **argv) {
 
             // PREPARE TO RENDER //
             delete_chunks();
-            for (int i=0; i<MAX_LOCAL_PLAYERS; i++) {
-                Player *player = g->local_players[i].player;
-                if (player->is_active) {
-                    State *s = &player->state;
-                    del_buffer(player->buffer);
-                    player->buffer = gen_player_buffer(s->x, s->y, s->z, s->rx,
-                        s->ry, player->texture_index);
-                }
-            }
             for (int i = 1; i < g->client_count; i++) {
                 Client *client = g->clients + i;
                 for (int j = 0; j < MAX_LOCAL_PLAYERS; j++) {
@@ -6155,7 +7740,8 @@ int main(int argc, char **argv) {
                 if (local->player->is_active) {
                     render_player_world(local, sky_buffer,
                                         &sky_attrib, &block_attrib, &text_attrib,
-                                        &line_attrib, &mouse_attrib, fps);
+                                        &line_attrib, &mouse_attrib,
+                                        &player_attrib, &texture_attrib, fps);
                 }
             }
 
@@ -6163,6 +7749,22 @@ int main(int argc, char **argv) {
             check_gl_error();
 #endif
 
+            // NETWORK STATS //
+            if (g->mode == MODE_ONLINE &&
+                netstats_time() - last_ping > PING_INTERVAL) {
+                last_ping = netstats_time();
+                client_ping(last_ping);
+            }
+            if (config->netstats_interval > 0 &&
+                netstats_time() - last_netstats > config->netstats_interval) {
+                last_netstats = netstats_time();
+                netstats_write_csv();
+            }
+
+            // SEND QUEUED MESSAGES //
+            send_chunk_requests(now);
+            client_flush();
+
             // SWAP AND POLL //
             pg_swap_buffers();
             pg_next_event();
@@ -6178,6 +7780,7 @@ int main(int argc, char **argv) {
                 check_players_position = 1;
                 g->render_option_changed = 0;
                 deinitialize_worker_threads();
+                update_worldgen_cache_signature();
                 initialize_worker_threads();
                 delete_all_chunks();
             }
@@ -6201,6 +7804,9 @@ int main(int argc, char **argv) {
         char time_str[16];
         snprintf(time_str, 16, "%f", time_of_day());
         db_set_option("time", time_str);
+        netstats_write_csv();
+        netstats_close_csv();
+        stop_stage();
         db_close();
         db_disable();
         client_stop();
@@ -6228,11 +7834,18 @@ int main(int argc, char **argv) {
         menu_clear_items(&local->menu_worldgen);
         menu_clear_items(&local->menu_worldgen_select);
         pwlua_remove(local->lua_shell);
+        del_observe_view(&local->observe1_view);
+        del_observe_view(&local->observe2_view);
     }
 
     if (g->use_lua_worldgen == 1) {
         lua_close(g->lua_worldgen);
     }
+    for (int i=0; i<MAX_LOCAL_PLAYERS; i++) {
+        del_buffer(g->player_buffers[i]);
+    }
+    clear_text_cache();
+    worldgen_cache_close();
     pg_terminate_joysticks();
     pg_end();
     return EXIT_SUCCESS;
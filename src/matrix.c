@@ -1,8 +1,17 @@
 #include <math.h>
+#include <string.h>
 #include "config.h"
 #include "matrix.h"
 #include "util.h"
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CULL_NEON 1
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define CULL_SSE 1
+#endif
+
 void normalize(float *x, float *y, float *z) {
     float d = sqrtf((*x) * (*x) + (*y) * (*y) + (*z) * (*z));
     *x /= d; *y /= d; *z /= d;
@@ -145,6 +154,86 @@ void frustum_planes(float planes[6][4], int radius, float *matrix) {
     planes[5][3] = zfar * m[15] - m[14];
 }
 
+/*
+ * Test count boxes against the first plane_count frustum planes. Each box is
+ * given in structure-of-arrays form by its lowest x and z corner, spanning
+ * size blocks along both axes, and its miny to maxy height range. Bit i of the
+ * visible bitset ((count + 31) / 32 words) is set when box i is at least
+ * partly inside the frustum. Four boxes are tested at once with NEON or SSE
+ * when available.
+ */
+void frustum_cull_boxes(
+    float planes[6][4], int plane_count, const float *x, const float *z,
+    const float *miny, const float *maxy, float size, int count,
+    unsigned int *visible)
+{
+    // Only the box corner furthest along each plane normal needs testing, if
+    // that corner is outside the plane the whole box is.
+    float k[6];
+    const float *ys[6];
+    for (int j = 0; j < plane_count; j++) {
+        k[j] = planes[j][3] +
+               (MAX(planes[j][0], 0) + MAX(planes[j][2], 0)) * size;
+        ys[j] = planes[j][1] >= 0 ? maxy : miny;
+    }
+    memset(visible, 0, sizeof(unsigned int) * ((count + 31) / 32));
+    int i = 0;
+#if defined(CULL_NEON)
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t vx = vld1q_f32(x + i);
+        float32x4_t vz = vld1q_f32(z + i);
+        float32x4_t zero = vdupq_n_f32(0);
+        uint32x4_t out = vdupq_n_u32(0);
+        for (int j = 0; j < plane_count; j++) {
+            float32x4_t d = vdupq_n_f32(k[j]);
+            d = vmlaq_n_f32(d, vx, planes[j][0]);
+            d = vmlaq_n_f32(d, vld1q_f32(ys[j] + i), planes[j][1]);
+            d = vmlaq_n_f32(d, vz, planes[j][2]);
+            out = vorrq_u32(out, vcltq_f32(d, zero));
+        }
+        unsigned int bits =
+            (vgetq_lane_u32(out, 0) & 1) |
+            (vgetq_lane_u32(out, 1) & 2) |
+            (vgetq_lane_u32(out, 2) & 4) |
+            (vgetq_lane_u32(out, 3) & 8);
+        visible[i / 32] |= (~bits & 0xf) << (i % 32);
+    }
+#elif defined(CULL_SSE)
+    for (; i + 4 <= count; i += 4) {
+        __m128 vx = _mm_loadu_ps(x + i);
+        __m128 vz = _mm_loadu_ps(z + i);
+        __m128 zero = _mm_setzero_ps();
+        __m128 out = zero;
+        for (int j = 0; j < plane_count; j++) {
+            __m128 d = _mm_set1_ps(k[j]);
+            d = _mm_add_ps(d, _mm_mul_ps(vx, _mm_set1_ps(planes[j][0])));
+            d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(ys[j] + i),
+                                         _mm_set1_ps(planes[j][1])));
+            d = _mm_add_ps(d, _mm_mul_ps(vz, _mm_set1_ps(planes[j][2])));
+            out = _mm_or_ps(out, _mm_cmplt_ps(d, zero));
+        }
+        unsigned int bits = _mm_movemask_ps(out);
+        visible[i / 32] |= (~bits & 0xf) << (i % 32);
+    }
+#endif
+    for (; i < count; i++) {
+        int in = 1;
+        for (int j = 0; j < plane_count; j++) {
+            float d = k[j] +
+                planes[j][0] * x[i] +
+                planes[j][1] * ys[j][i] +
+                planes[j][2] * z[i];
+            if (d < 0) {
+                in = 0;
+                break;
+            }
+        }
+        if (in) {
+            visible[i / 32] |= 1u << (i % 32);
+        }
+    }
+}
+
 void mat_frustum(
     float *matrix, float left, float right, float bottom,
     float top, float znear, float zfar)
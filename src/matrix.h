@@ -8,6 +8,10 @@ void mat_vec_multiply(float *vector, float *a, float *b);
 void mat_multiply(float *matrix, float *a, float *b);
 void mat_apply(float *data, float *matrix, int count, int offset, int stride);
 void frustum_planes(float planes[6][4], int radius, float *matrix);
+void frustum_cull_boxes(
+    float planes[6][4], int plane_count, const float *x, const float *z,
+    const float *miny, const float *maxy, float size, int count,
+    unsigned int *visible);
 void mat_frustum(
     float *matrix, float left, float right, float bottom,
     float top, float znear, float zfar);
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "client.h"
+#include "netstats.h"
+#include "protocol.h"
+
+/*
+ * Counters of the traffic with the server, to size servers from real games.
+ * Text lines are counted by their first character and binary messages by
+ * type, with the time taken to handle them. Round trip times come from ping
+ * messages, and chunk latencies are from asking for a chunk to the server's
+ * answer, and to the chunk being drawn with it.
+ *
+ * Only used from the main thread, Lua reads them without locking as it does
+ * other game state.
+ */
+
+#define LINE_TYPES 128
+#define MESSAGE_TYPES (MSG_DEFLATE + 1)
+
+static const char *message_names[MESSAGE_TYPES] = {
+    "text", "edit", "chunk_layer", "key", "redraw", "chunk", "deflate"
+};
+
+static NetMessageStats lines[LINE_TYPES];
+static NetMessageStats messages[MESSAGE_TYPES];
+static NetTimeStats rtt;
+static NetTimeStats chunk_answer;
+static NetTimeStats chunk_draw;
+static int staged_layers;
+static FILE *csv_file;
+
+static void add_message_stats(NetMessageStats *stats, int size, double time) {
+    stats->count++;
+    stats->bytes += size;
+    stats->time += time;
+    if (time > stats->max_time) {
+        stats->max_time = time;
+    }
+}
+
+static void add_time(NetTimeStats *stats, double time) {
+    if (stats->count == 0 || time < stats->min) {
+        stats->min = time;
+    }
+    if (time > stats->max) {
+        stats->max = time;
+    }
+    stats->count++;
+    stats->total += time;
+}
+
+// Seconds on a clock not moved by the server setting the game time.
+double netstats_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void netstats_reset(void) {
+    memset(lines, 0, sizeof(lines));
+    memset(messages, 0, sizeof(messages));
+    memset(&rtt, 0, sizeof(rtt));
+    memset(&chunk_answer, 0, sizeof(chunk_answer));
+    memset(&chunk_draw, 0, sizeof(chunk_draw));
+    staged_layers = 0;
+}
+
+// Count a text line from the server, without its newline.
+void netstats_add_line(const char *line, double time) {
+    unsigned char type = line[0];
+    if (type < LINE_TYPES) {
+        add_message_stats(lines + type, strlen(line) + 1, time);
+    }
+}
+
+// Count a binary message from the server, size is without its length.
+void netstats_add_message(int type, int size, double time) {
+    if (type >= 0 && type < MESSAGE_TYPES) {
+        add_message_stats(messages + type, size, time);
+    }
+}
+
+void netstats_add_rtt(double time) {
+    add_time(&rtt, time);
+}
+
+void netstats_add_chunk_answer(double time) {
+    add_time(&chunk_answer, time);
+}
+
+void netstats_add_chunk_draw(double time) {
+    add_time(&chunk_draw, time);
+}
+
+void netstats_set_staged_layers(int count) {
+    staged_layers = count;
+}
+
+void netstats_summary(NetSummary *summary) {
+    summary->rtt = rtt;
+    summary->chunk_answer = chunk_answer;
+    summary->chunk_draw = chunk_draw;
+    client_send_stats(&summary->send);
+    client_recv_stats(&summary->recv);
+    summary->staged_layers = staged_layers;
+}
+
+/*
+ * Call func with the name and counts of each type of message received so
+ * far. Text lines are named by their first character, binary messages by
+ * type with a "msg_" prefix.
+ */
+void netstats_for_each(
+    void (*func)(const char *name, const NetMessageStats *stats, void *arg),
+    void *arg)
+{
+    char name[16];
+    for (int i = 0; i < LINE_TYPES; i++) {
+        if (lines[i].count > 0) {
+            snprintf(name, sizeof(name), "%c", i);
+            func(name, lines + i, arg);
+        }
+    }
+    for (int i = 0; i < MESSAGE_TYPES; i++) {
+        if (messages[i].count > 0) {
+            snprintf(name, sizeof(name), "msg_%s", message_names[i]);
+            func(name, messages + i, arg);
+        }
+    }
+}
+
+int netstats_open_csv(const char *path) {
+    netstats_close_csv();
+    csv_file = fopen(path, "a");
+    if (!csv_file) {
+        printf("Could not open netstats file %s\n", path);
+        return -1;
+    }
+    fseek(csv_file, 0, SEEK_END);
+    if (ftell(csv_file) == 0) {
+        fprintf(csv_file, "time,stat,count,bytes,total_ms,max\n");
+    }
+    return 0;
+}
+
+static void write_message_row(
+    const char *name, const NetMessageStats *stats, void *arg)
+{
+    long long now = *(long long *)arg;
+    fprintf(csv_file, "%lld,%s,%lld,%lld,%.3f,%.3f\n", now, name,
+            stats->count, stats->bytes, stats->time * 1000,
+            stats->max_time * 1000);
+}
+
+static void write_time_row(
+    long long now, const char *name, NetTimeStats *stats)
+{
+    fprintf(csv_file, "%lld,%s,%lld,0,%.3f,%.3f\n", now, name, stats->count,
+            stats->total * 1000, stats->max * 1000);
+}
+
+/*
+ * Add the counts so far to the CSV file, each row starting with the Unix
+ * time. Rows have the total count, bytes and milliseconds of one stat, and
+ * the longest single time in milliseconds as max. The recv and send rows
+ * count bytes taken from or added to the network queues, with the most bytes
+ * queued as max. recv_queue is what waits now, staged chunk layers and
+ * bytes.
+ */
+void netstats_write_csv(void) {
+    if (!csv_file) {
+        return;
+    }
+    long long now = time(NULL);
+    NetSummary s;
+    netstats_summary(&s);
+    netstats_for_each(write_message_row, &now);
+    write_time_row(now, "rtt", &s.rtt);
+    write_time_row(now, "chunk_answer", &s.chunk_answer);
+    write_time_row(now, "chunk_draw", &s.chunk_draw);
+    fprintf(csv_file, "%lld,recv,0,%lld,%.3f,%d\n", now, s.recv.bytes,
+            s.recv.inflate_time * 1000, s.recv.max_queued);
+    fprintf(csv_file, "%lld,recv_queue,%d,%d,0,0\n", now, s.staged_layers,
+            s.recv.queued);
+    fprintf(csv_file, "%lld,send,%lld,%lld,0,%d\n", now, s.send.messages,
+            s.send.bytes, s.send.max_queued);
+    fflush(csv_file);
+}
+
+void netstats_close_csv(void) {
+    if (csv_file) {
+        fclose(csv_file);
+        csv_file = NULL;
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "client.h"
+
+typedef struct {
+    long long count;
+    long long bytes;
+    double time;
+    double max_time;
+} NetMessageStats;
+
+typedef struct {
+    long long count;
+    double total;
+    double min;
+    double max;
+} NetTimeStats;
+
+typedef struct {
+    NetTimeStats rtt;
+    NetTimeStats chunk_answer;
+    NetTimeStats chunk_draw;
+    ClientSendStats send;
+    ClientRecvStats recv;
+    int staged_layers;
+} NetSummary;
+
+double netstats_time(void);
+void netstats_reset(void);
+void netstats_add_line(const char *line, double time);
+void netstats_add_message(int type, int size, double time);
+void netstats_add_rtt(double time);
+void netstats_add_chunk_answer(double time);
+void netstats_add_chunk_draw(double time);
+void netstats_set_staged_layers(int count);
+void netstats_summary(NetSummary *summary);
+void netstats_for_each(
+    void (*func)(const char *name, const NetMessageStats *stats, void *arg),
+    void *arg);
+int netstats_open_csv(const char *path);
+void netstats_write_csv(void);
+void netstats_close_csv(void);
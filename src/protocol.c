@@ -0,0 +1,70 @@
+#include "protocol.h"
+
+/*
+ * Read an unsigned varint from *data, advancing it. Returns 0 on success or
+ * -1 if the varint runs past end or is too long.
+ */
+int protocol_read_uint(
+    const unsigned char **data, const unsigned char *end, unsigned int *value)
+{
+    const unsigned char *p = *data;
+    unsigned int result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p >= end) {
+            return -1;
+        }
+        unsigned char byte = *p++;
+        result |= (unsigned int)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *data = p;
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int protocol_read_int(
+    const unsigned char **data, const unsigned char *end, int *value)
+{
+    unsigned int u;
+    if (protocol_read_uint(data, end, &u)) {
+        return -1;
+    }
+    *value = (int)(u >> 1) ^ -(int)(u & 1);
+    return 0;
+}
+
+int protocol_read_ints(
+    const unsigned char **data, const unsigned char *end, int *values,
+    int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (protocol_read_int(data, end, values + i)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Get the number of bytes taken by the message at data, including its
+ * length. Returns 0 if the message is not complete yet, or -1 if the stream
+ * is broken.
+ */
+int protocol_message_size(const unsigned char *data, const unsigned char *end)
+{
+    const unsigned char *p = data;
+    unsigned int size;
+    if (protocol_read_uint(&p, end, &size)) {
+        // Either the length is still incomplete or it is malformed
+        return (end - data) < 5 ? 0 : -1;
+    }
+    if (size == 0 || size > MAX_MESSAGE_SIZE) {
+        return -1;
+    }
+    if (size > (unsigned int)(end - p)) {
+        return 0;
+    }
+    return (p - data) + size;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+/*
+ * Version 3 of the protocol. A client asks for it by sending "V,3" after
+ * "V,2", and a server that supports it answers with a "V,3" line. Everything
+ * the server sends after that line is a series of messages, each a varint
+ * length followed by that many bytes, the first of which is the message
+ * type. The fields after it are zigzag encoded LEB128 varints, x and z are
+ * relative to the chunk (p, q), and layers are numbered in
+ * RingEntryType order (BLOCK to LIGHT). What the client sends stays in the
+ * version 2 text format, with one addition: chunks can be asked for in
+ * batches with "c,p,q,key,priority,..." lines. The server answers the lowest
+ * priorities first, asking again changes the priority of a chunk not sent
+ * yet and a negative priority cancels it.
+ */
+
+#define PROTOCOL_VERSION 3
+
+// Messages larger than this are treated as a broken stream
+#define MAX_MESSAGE_SIZE 524288
+
+#define MSG_TEXT 0         // a version 2 line, without its newline
+#define MSG_EDIT 1         // layer, p, q, x, y, z, w
+#define MSG_CHUNK_LAYER 2  // layer, p, q, count, count * (x, y, z, w)
+#define MSG_KEY 3          // p, q, key
+#define MSG_REDRAW 4       // p, q
+#define MSG_CHUNK 5        // p, q, sent when a chunk request is answered
+#define MSG_DEFLATE 6      // zlib stream of more messages, asked for by "Z"
+
+int protocol_read_uint(
+    const unsigned char **data, const unsigned char *end, unsigned int *value);
+int protocol_read_int(
+    const unsigned char **data, const unsigned char *end, int *value);
+int protocol_read_ints(
+    const unsigned char **data, const unsigned char *end, int *values,
+    int count);
+int protocol_message_size(const unsigned char *data, const unsigned char *end);
@@ -63,3 +63,4 @@ void render_text_rgba(
     const float *background, const float *text_color);
 void render_text_cursor(Attrib *attrib, float x, float y);
 void drain_edit_queue(size_t max_items, double max_time, double now);
+void pw_backup(int player_id, const char *path);
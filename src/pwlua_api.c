@@ -5,6 +5,7 @@
 #include "config.h"
 #include "db.h"
 #include "item.h"
+#include "netstats.h"
 #include "noise.h"
 #include "pw.h"
 #include "pwlua.h"
@@ -35,6 +36,8 @@ static int pwlua_get_open(lua_State *L);
 static int pwlua_set_open(lua_State *L);
 static int pwlua_set_shell(lua_State *L);
 static int pwlua_sync_world(lua_State *L);
+static int pwlua_backup(lua_State *L);
+static int pwlua_get_netstats(lua_State *L);
 
 static int pwlua_map_set(lua_State *L);
 static int pwlua_map_set_extra(lua_State *L);
@@ -72,6 +75,8 @@ void pwlua_api_add_functions(lua_State *L)
     lua_register(L, "set_open", pwlua_set_open);
     lua_register(L, "set_shell", pwlua_set_shell);
     lua_register(L, "sync_world", pwlua_sync_world);
+    lua_register(L, "backup", pwlua_backup);
+    lua_register(L, "get_netstats", pwlua_get_netstats);
 }
 
 void pwlua_api_add_worldgen_functions(lua_State *L)
@@ -731,6 +736,74 @@ static int pwlua_sync_world(lua_State *L)
     return 0;
 }
 
+static int pwlua_backup(lua_State *L)
+{
+    int argcount = lua_gettop(L);
+    if (argcount != 1) {
+        return ERROR_ARG_COUNT;
+    }
+    if (!lua_isstring(L, 1)) {
+        return luaL_error(L, "incorrect argument type");
+    }
+    const char *path = lua_tolstring(L, 1, NULL);
+    lua_getglobal(L, "player_id");
+    int player_id = luaL_checkint(L, 2);
+    pw_backup(player_id, path);
+    return 0;
+}
+
+static void set_number_field(lua_State *L, const char *name, double value)
+{
+    lua_pushnumber(L, value);
+    lua_setfield(L, -2, name);
+}
+
+static void set_message_stats_field(
+    const char *name, const NetMessageStats *stats, void *arg)
+{
+    lua_State *L = arg;
+    lua_newtable(L);
+    set_number_field(L, "count", stats->count);
+    set_number_field(L, "bytes", stats->bytes);
+    set_number_field(L, "time", stats->time * 1000);
+    set_number_field(L, "max_time", stats->max_time * 1000);
+    lua_setfield(L, -2, name);
+}
+
+/*
+ * Returns a table of the counts of traffic with the server, times are in
+ * milliseconds. The messages field has a table for each message type.
+ */
+static int pwlua_get_netstats(lua_State *L)
+{
+    int argcount = lua_gettop(L);
+    if (argcount != 0) {
+        return ERROR_ARG_COUNT;
+    }
+    NetSummary s;
+    netstats_summary(&s);
+    lua_newtable(L);
+    set_number_field(L, "pings", s.rtt.count);
+    set_number_field(L, "rtt",
+                     s.rtt.count ? s.rtt.total * 1000 / s.rtt.count : 0);
+    set_number_field(L, "rtt_min", s.rtt.min * 1000);
+    set_number_field(L, "rtt_max", s.rtt.max * 1000);
+    set_number_field(L, "chunks", s.chunk_draw.count);
+    set_number_field(L, "chunk_answer", s.chunk_answer.count ?
+                     s.chunk_answer.total * 1000 / s.chunk_answer.count : 0);
+    set_number_field(L, "chunk_draw", s.chunk_draw.count ?
+                     s.chunk_draw.total * 1000 / s.chunk_draw.count : 0);
+    set_number_field(L, "bytes_received", s.recv.bytes);
+    set_number_field(L, "bytes_sent", s.send.bytes);
+    set_number_field(L, "recv_queue", s.recv.queued);
+    set_number_field(L, "recv_queue_max", s.recv.max_queued);
+    set_number_field(L, "staged_layers", s.staged_layers);
+    lua_newtable(L);
+    netstats_for_each(set_message_stats_field, L);
+    lua_setfield(L, -2, "messages");
+    return 1;
+}
+
 static int pwlua_simplex2(lua_State *L)
 {
     float x, y;
@@ -145,6 +145,12 @@ void ring_put_commit(Ring *ring) {
     ring_put(ring, &entry);
 }
 
+void ring_put_backup(Ring *ring) {
+    RingEntry entry;
+    entry.type = BACKUP;
+    ring_put(ring, &entry);
+}
+
 void ring_put_exit(Ring *ring) {
     RingEntry entry;
     entry.type = EXIT;
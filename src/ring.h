@@ -9,6 +9,7 @@ typedef enum {
     KEY,
     COMMIT,
     SIGN,
+    BACKUP,
     EXIT
 } RingEntryType;
 
@@ -47,6 +48,7 @@ void ring_put_sign(Ring *ring, int p, int q, int x, int y, int z, int face,
                    const char *text);
 void ring_put_key(Ring *ring, int p, int q, int key);
 void ring_put_commit(Ring *ring);
+void ring_put_backup(Ring *ring);
 void ring_put_exit(Ring *ring);
 int ring_get(Ring *ring, RingEntry *entry);
 
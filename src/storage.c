@@ -0,0 +1,897 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chunk_blob.h"
+#include "config.h"
+#include "ring.h"
+#include "storage.h"
+#include "tinycthread.h"
+
+/*
+ * Storage backends other than SQLite.
+ *
+ * memory: keeps everything in RAM and forgets it on close, for benchmarks
+ * and tests of the rest of the game without any disk cost.
+ *
+ * log: the memory backend plus an append-only file of every change, kept
+ * next to the game file with a .log suffix. The file is replayed on open
+ * and rewritten with only the live data on commit or close once most of
+ * its records have been superseded.
+ */
+
+#define CHUNK_BUCKETS 4096
+#define MAX_SAVED_PLAYERS MAX_LOCAL_PLAYERS
+#define MAX_SAVED_NAME_LENGTH 64
+
+typedef struct StoredChunk {
+    int p;
+    int q;
+    int key;
+    ChunkBlob blob;
+    struct StoredChunk *next;
+} StoredChunk;
+
+typedef struct {
+    char *name;
+    char *value;
+} StoredOption;
+
+typedef struct {
+    float x;
+    float y;
+    float z;
+    float rx;
+    float ry;
+} StoredState;
+
+static StoredChunk *chunks[CHUNK_BUCKETS];
+static StoredOption *options;
+static int option_count;
+static StoredState states[MAX_SAVED_PLAYERS];
+static int state_count;
+static char names[MAX_SAVED_PLAYERS][MAX_SAVED_NAME_LENGTH];
+static int name_count;
+static mtx_t store_mtx;
+
+static int chunk_of(int x) {
+    return (x < 0 ? x - CHUNK_SIZE + 1 : x) / CHUNK_SIZE;
+}
+
+static unsigned int chunk_bucket(int p, int q) {
+    unsigned int h = (unsigned int)p * 73856093u ^ (unsigned int)q * 19349663u;
+    return h % CHUNK_BUCKETS;
+}
+
+static StoredChunk *find_chunk(int p, int q, int create) {
+    StoredChunk **link = chunks + chunk_bucket(p, q);
+    for (StoredChunk *c = *link; c; c = c->next) {
+        if (c->p == p && c->q == q) {
+            return c;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    StoredChunk *c = calloc(1, sizeof(StoredChunk));
+    c->p = p;
+    c->q = q;
+    chunk_blob_alloc(&c->blob);
+    c->next = *link;
+    *link = c;
+    return c;
+}
+
+static int mem_open(__attribute__((unused)) const char *path) {
+    mtx_init(&store_mtx, mtx_plain);
+    return 0;
+}
+
+static void mem_close(void) {
+    for (int i = 0; i < CHUNK_BUCKETS; i++) {
+        StoredChunk *c = chunks[i];
+        while (c) {
+            StoredChunk *next = c->next;
+            chunk_blob_free(&c->blob);
+            free(c);
+            c = next;
+        }
+        chunks[i] = NULL;
+    }
+    for (int i = 0; i < option_count; i++) {
+        free(options[i].name);
+        free(options[i].value);
+    }
+    free(options);
+    options = NULL;
+    option_count = state_count = name_count = 0;
+    mtx_destroy(&store_mtx);
+}
+
+static void mem_commit(void) {
+}
+
+static void mem_set_layer(int layer, int p, int q, int x, int y, int z, int w) {
+    mtx_lock(&store_mtx);
+    chunk_blob_set(&find_chunk(p, q, 1)->blob, layer, x, y, z, w);
+    mtx_unlock(&store_mtx);
+}
+
+static int mem_get_light(int p, int q, int x, int y, int z) {
+    int w = 0;
+    mtx_lock(&store_mtx);
+    StoredChunk *c = find_chunk(p, q, 0);
+    if (c) {
+        BlobLayer *l = c->blob.layers + LIGHT;
+        for (unsigned int i = 0; i < l->size; i++) {
+            BlobEntry *e = l->data + i;
+            if (e->x == x && e->y == y && e->z == z) {
+                w = e->w;
+                break;
+            }
+        }
+    }
+    mtx_unlock(&store_mtx);
+    return w;
+}
+
+static void mem_set_sign(
+    int p, int q, int x, int y, int z, int face, const char *text)
+{
+    mtx_lock(&store_mtx);
+    sign_list_add(&find_chunk(p, q, 1)->blob.signs, x, y, z, face, text);
+    mtx_unlock(&store_mtx);
+}
+
+static const unsigned char *mem_get_sign(
+    int p, int q, int x, int y, int z, int face)
+{
+    const unsigned char *text = NULL;
+    mtx_lock(&store_mtx);
+    StoredChunk *c = find_chunk(p, q, 0);
+    if (c) {
+        SignList *signs = &c->blob.signs;
+        for (unsigned int i = 0; i < signs->size; i++) {
+            Sign *e = signs->data + i;
+            if (e->x == x && e->y == y && e->z == z && e->face == face) {
+                text = (const unsigned char *)e->text;
+                break;
+            }
+        }
+    }
+    mtx_unlock(&store_mtx);
+    return text;
+}
+
+static void mem_delete_sign(int x, int y, int z, int face) {
+    mtx_lock(&store_mtx);
+    StoredChunk *c = find_chunk(chunk_of(x), chunk_of(z), 0);
+    if (c) {
+        sign_list_remove(&c->blob.signs, x, y, z, face);
+    }
+    mtx_unlock(&store_mtx);
+}
+
+static void mem_delete_signs(int x, int y, int z) {
+    mtx_lock(&store_mtx);
+    StoredChunk *c = find_chunk(chunk_of(x), chunk_of(z), 0);
+    if (c) {
+        sign_list_remove_all(&c->blob.signs, x, y, z);
+    }
+    mtx_unlock(&store_mtx);
+}
+
+static void mem_delete_all_signs(void) {
+    mtx_lock(&store_mtx);
+    for (int i = 0; i < CHUNK_BUCKETS; i++) {
+        for (StoredChunk *c = chunks[i]; c; c = c->next) {
+            c->blob.signs.size = 0;
+        }
+    }
+    mtx_unlock(&store_mtx);
+}
+
+static void mem_load_chunk(
+    __attribute__((unused)) DbReader *reader, Map **maps, SignList *signs,
+    int p, int q)
+{
+    mtx_lock(&store_mtx);
+    StoredChunk *c = find_chunk(p, q, 0);
+    if (c) {
+        for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+            BlobLayer *l = c->blob.layers + i;
+            for (unsigned int j = 0; j < l->size; j++) {
+                BlobEntry *e = l->data + j;
+                map_set(maps[i], e->x, e->y, e->z, e->w);
+            }
+        }
+        for (unsigned int i = 0; i < c->blob.signs.size; i++) {
+            Sign *e = c->blob.signs.data + i;
+            sign_list_add(signs, e->x, e->y, e->z, e->face, e->text);
+        }
+    }
+    mtx_unlock(&store_mtx);
+}
+
+static int mem_get_key(int p, int q) {
+    mtx_lock(&store_mtx);
+    StoredChunk *c = find_chunk(p, q, 0);
+    int key = c ? c->key : 0;
+    mtx_unlock(&store_mtx);
+    return key;
+}
+
+static void mem_set_key(int p, int q, int key) {
+    mtx_lock(&store_mtx);
+    find_chunk(p, q, 1)->key = key;
+    mtx_unlock(&store_mtx);
+}
+
+static void mem_delete_all_keys(void) {
+    mtx_lock(&store_mtx);
+    for (int i = 0; i < CHUNK_BUCKETS; i++) {
+        for (StoredChunk *c = chunks[i]; c; c = c->next) {
+            c->key = 0;
+        }
+    }
+    mtx_unlock(&store_mtx);
+}
+
+static void mem_set_option(const char *name, const char *value) {
+    mtx_lock(&store_mtx);
+    int i;
+    for (i = 0; i < option_count; i++) {
+        if (strcmp(options[i].name, name) == 0) {
+            break;
+        }
+    }
+    if (i == option_count) {
+        options = realloc(options, sizeof(StoredOption) * ++option_count);
+        options[i].name = strdup(name);
+    } else {
+        free(options[i].value);
+    }
+    options[i].value = strdup(value);
+    mtx_unlock(&store_mtx);
+}
+
+static const unsigned char *mem_get_option(const char *name) {
+    const unsigned char *value = NULL;
+    mtx_lock(&store_mtx);
+    for (int i = 0; i < option_count; i++) {
+        if (strcmp(options[i].name, name) == 0) {
+            value = (const unsigned char *)options[i].value;
+            break;
+        }
+    }
+    mtx_unlock(&store_mtx);
+    return value;
+}
+
+static void mem_clear_state(void) {
+    state_count = 0;
+}
+
+static void mem_save_state(float x, float y, float z, float rx, float ry) {
+    if (state_count < MAX_SAVED_PLAYERS) {
+        StoredState s = {x, y, z, rx, ry};
+        states[state_count++] = s;
+    }
+}
+
+static int mem_load_state(
+    float *x, float *y, float *z, float *rx, float *ry, int player)
+{
+    if (player < 0 || player >= state_count) {
+        return 0;
+    }
+    StoredState *s = states + player;
+    *x = s->x;
+    *y = s->y;
+    *z = s->z;
+    *rx = s->rx;
+    *ry = s->ry;
+    return 1;
+}
+
+static void mem_clear_player_names(void) {
+    name_count = 0;
+}
+
+static void mem_save_player_name(const char *name) {
+    if (name_count < MAX_SAVED_PLAYERS) {
+        size_t length = strnlen(name, MAX_SAVED_NAME_LENGTH - 1);
+        memcpy(names[name_count], name, length);
+        names[name_count++][length] = '\0';
+    }
+}
+
+static int mem_load_player_name(char *name, int max_name_length, int player) {
+    if (player < 0 || player >= name_count) {
+        return 0;
+    }
+    snprintf(name, max_name_length, "%s", names[player]);
+    return 1;
+}
+
+const StorageBackend memory_storage = {
+    "memory",
+    mem_open,
+    mem_close,
+    mem_commit,
+    mem_set_layer,
+    mem_get_light,
+    mem_set_sign,
+    mem_get_sign,
+    mem_delete_sign,
+    mem_delete_signs,
+    mem_delete_all_signs,
+    mem_load_chunk,
+    mem_get_key,
+    mem_set_key,
+    mem_delete_all_keys,
+    mem_set_option,
+    mem_get_option,
+    mem_clear_state,
+    mem_save_state,
+    mem_load_state,
+    mem_clear_player_names,
+    mem_save_player_name,
+    mem_load_player_name,
+};
+
+/*
+ * Log file format, all integers are little endian 32 bit values and strings
+ * are a 16 bit length followed by the bytes:
+ *
+ *   "PWL" version(u8)
+ *   then records of type(u8) followed by the fields listed in LogRecordType
+ *
+ * A record cut short by a crash or with fields out of range ends the log,
+ * and it is dropped on open along with everything after it.
+ */
+
+#define LOG_VERSION 1
+#define LOG_MIN_COMPACT_RECORDS 100000
+#define LOG_RECORD_SIZE (1 + 7 * 4 + 2 * (2 + MAX_SIGN_LENGTH))
+
+typedef enum {
+    LOG_LAYER = 1,         // layer p q x y z w
+    LOG_SIGN,              // p q x y z face text
+    LOG_DELETE_SIGN,       // x y z face
+    LOG_DELETE_SIGNS,      // x y z
+    LOG_DELETE_ALL_SIGNS,
+    LOG_KEY,               // p q key
+    LOG_OPTION,            // name value
+    LOG_CLEAR_STATE,
+    LOG_STATE,             // x y z rx ry as float bits
+    LOG_CLEAR_NAMES,
+    LOG_NAME,              // name
+    LOG_DELETE_ALL_KEYS,
+} LogRecordType;
+
+static FILE *log_file;
+static char log_path[MAX_PATH_LENGTH];
+static long long log_records;
+static long long log_compact_at;
+static mtx_t log_mtx;
+
+typedef struct {
+    unsigned char data[LOG_RECORD_SIZE];
+    int size;
+} LogRecord;
+
+static void record_start(LogRecord *r, int type) {
+    r->data[0] = type;
+    r->size = 1;
+}
+
+static void record_int(LogRecord *r, int v) {
+    unsigned int u = v;
+    for (int i = 0; i < 4; i++) {
+        r->data[r->size++] = (u >> (i * 8)) & 0xff;
+    }
+}
+
+static void record_float(LogRecord *r, float f) {
+    int v;
+    memcpy(&v, &f, sizeof(v));
+    record_int(r, v);
+}
+
+static void record_string(LogRecord *r, const char *s) {
+    int length = strlen(s);
+    if (length > MAX_SIGN_LENGTH) {
+        length = MAX_SIGN_LENGTH;
+    }
+    r->data[r->size++] = length & 0xff;
+    r->data[r->size++] = length >> 8;
+    memcpy(r->data + r->size, s, length);
+    r->size += length;
+}
+
+static void write_record(FILE *file, LogRecord *r) {
+    fwrite(r->data, 1, r->size, file);
+}
+
+static void append_record(LogRecord *r) {
+    mtx_lock(&log_mtx);
+    write_record(log_file, r);
+    log_records++;
+    mtx_unlock(&log_mtx);
+}
+
+static int read_int(FILE *file, int *v) {
+    unsigned char b[4];
+    if (fread(b, 1, 4, file) != 4) {
+        return 0;
+    }
+    *v = (int)(b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24));
+    return 1;
+}
+
+static int read_ints(FILE *file, int *v, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!read_int(file, v + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int read_string(FILE *file, char *s, int max_length) {
+    unsigned char b[2];
+    if (fread(b, 1, 2, file) != 2) {
+        return 0;
+    }
+    int length = b[0] | (b[1] << 8);
+    char buffer[MAX_SIGN_LENGTH + 1];
+    if (length > MAX_SIGN_LENGTH ||
+        (int)fread(buffer, 1, length, file) != length) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    snprintf(s, max_length, "%s", buffer);
+    return 1;
+}
+
+static int valid_face(int face) {
+    return face >= 0 && face < 8;
+}
+
+/*
+ * Apply the record at the current file position to the memory store.
+ * Returns 0 at the end of the log or if the record is incomplete or bad.
+ */
+static int replay_record(FILE *file) {
+    int type = fgetc(file);
+    int v[7];
+    char a[MAX_SIGN_LENGTH + 1];
+    char b[MAX_SIGN_LENGTH + 1];
+    switch (type) {
+        case LOG_LAYER:
+            if (!read_ints(file, v, 7) || v[0] < 0 ||
+                v[0] >= CHUNK_BLOB_LAYERS) {
+                return 0;
+            }
+            mem_set_layer(v[0], v[1], v[2], v[3], v[4], v[5], v[6]);
+            return 1;
+        case LOG_SIGN:
+            if (!read_ints(file, v, 6) || !valid_face(v[5]) ||
+                !read_string(file, a, sizeof(a))) {
+                return 0;
+            }
+            mem_set_sign(v[0], v[1], v[2], v[3], v[4], v[5], a);
+            return 1;
+        case LOG_DELETE_SIGN:
+            if (!read_ints(file, v, 4) || !valid_face(v[3])) return 0;
+            mem_delete_sign(v[0], v[1], v[2], v[3]);
+            return 1;
+        case LOG_DELETE_SIGNS:
+            if (!read_ints(file, v, 3)) return 0;
+            mem_delete_signs(v[0], v[1], v[2]);
+            return 1;
+        case LOG_DELETE_ALL_SIGNS:
+            mem_delete_all_signs();
+            return 1;
+        case LOG_KEY:
+            if (!read_ints(file, v, 3)) return 0;
+            mem_set_key(v[0], v[1], v[2]);
+            return 1;
+        case LOG_OPTION:
+            if (!read_string(file, a, sizeof(a)) ||
+                !read_string(file, b, sizeof(b))) {
+                return 0;
+            }
+            mem_set_option(a, b);
+            return 1;
+        case LOG_CLEAR_STATE:
+            mem_clear_state();
+            return 1;
+        case LOG_STATE: {
+            if (!read_ints(file, v, 5)) return 0;
+            float f[5];
+            memcpy(f, v, sizeof(f));
+            mem_save_state(f[0], f[1], f[2], f[3], f[4]);
+            return 1;
+        }
+        case LOG_CLEAR_NAMES:
+            mem_clear_player_names();
+            return 1;
+        case LOG_NAME:
+            if (!read_string(file, a, sizeof(a))) return 0;
+            mem_save_player_name(a);
+            return 1;
+        case LOG_DELETE_ALL_KEYS:
+            mem_delete_all_keys();
+            return 1;
+    }
+    return 0;
+}
+
+static void write_header(FILE *file) {
+    fputc('P', file);
+    fputc('W', file);
+    fputc('L', file);
+    fputc(LOG_VERSION, file);
+}
+
+static int log_open_failed(void) {
+    mtx_destroy(&log_mtx);
+    mem_close();
+    return 1;
+}
+
+static int log_open(const char *game_path) {
+    mem_open(game_path);
+    mtx_init(&log_mtx, mtx_plain);
+    snprintf(log_path, MAX_PATH_LENGTH, "%s.log", game_path);
+    const char *path = log_path;
+    log_records = 0;
+    log_compact_at = 0;
+    long good_size = 0;
+    FILE *file = fopen(path, "rb");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        if (ftell(file) == 0) {
+            // Left by a crash before the header was written
+            fclose(file);
+            file = NULL;
+        } else {
+            rewind(file);
+        }
+    }
+    if (file) {
+        if (fgetc(file) != 'P' || fgetc(file) != 'W' || fgetc(file) != 'L' ||
+            fgetc(file) != LOG_VERSION) {
+            printf("Not a log storage file: %s\n", path);
+            fclose(file);
+            return log_open_failed();
+        }
+        good_size = ftell(file);
+        while (replay_record(file)) {
+            good_size = ftell(file);
+            log_records++;
+        }
+        fseek(file, 0, SEEK_END);
+        if (ftell(file) != good_size) {
+            printf("Dropping incomplete or bad records at end of: %s\n",
+                   path);
+        }
+        fclose(file);
+        if (truncate(path, good_size)) {
+            return log_open_failed();
+        }
+    }
+    log_file = fopen(path, "ab");
+    if (!log_file) {
+        return log_open_failed();
+    }
+    if (good_size == 0) {
+        write_header(log_file);
+        fflush(log_file);
+    }
+    if (config->verbose) {
+        printf("Replayed %lld log records from: %s\n", log_records, path);
+    }
+    return 0;
+}
+
+/*
+ * Write the live contents of the memory store to file, returning the
+ * number of records written.
+ */
+static long long write_snapshot(FILE *file) {
+    long long count = 0;
+    LogRecord r;
+    write_header(file);
+    for (int i = 0; i < option_count; i++) {
+        record_start(&r, LOG_OPTION);
+        record_string(&r, options[i].name);
+        record_string(&r, options[i].value);
+        write_record(file, &r);
+        count++;
+    }
+    for (int i = 0; i < state_count; i++) {
+        StoredState *s = states + i;
+        record_start(&r, LOG_STATE);
+        record_float(&r, s->x);
+        record_float(&r, s->y);
+        record_float(&r, s->z);
+        record_float(&r, s->rx);
+        record_float(&r, s->ry);
+        write_record(file, &r);
+        count++;
+    }
+    for (int i = 0; i < name_count; i++) {
+        record_start(&r, LOG_NAME);
+        record_string(&r, names[i]);
+        write_record(file, &r);
+        count++;
+    }
+    for (int i = 0; i < CHUNK_BUCKETS; i++) {
+        for (StoredChunk *c = chunks[i]; c; c = c->next) {
+            if (c->key) {
+                record_start(&r, LOG_KEY);
+                record_int(&r, c->p);
+                record_int(&r, c->q);
+                record_int(&r, c->key);
+                write_record(file, &r);
+                count++;
+            }
+            for (int layer = 0; layer < CHUNK_BLOB_LAYERS; layer++) {
+                BlobLayer *l = c->blob.layers + layer;
+                for (unsigned int j = 0; j < l->size; j++) {
+                    BlobEntry *e = l->data + j;
+                    record_start(&r, LOG_LAYER);
+                    record_int(&r, layer);
+                    record_int(&r, c->p);
+                    record_int(&r, c->q);
+                    record_int(&r, e->x);
+                    record_int(&r, e->y);
+                    record_int(&r, e->z);
+                    record_int(&r, e->w);
+                    write_record(file, &r);
+                    count++;
+                }
+            }
+            for (unsigned int j = 0; j < c->blob.signs.size; j++) {
+                Sign *e = c->blob.signs.data + j;
+                record_start(&r, LOG_SIGN);
+                record_int(&r, c->p);
+                record_int(&r, c->q);
+                record_int(&r, e->x);
+                record_int(&r, e->y);
+                record_int(&r, e->z);
+                record_int(&r, e->face);
+                record_string(&r, e->text);
+                write_record(file, &r);
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * Replace the log with a snapshot of the live data, written to a temporary
+ * file first so a crash leaves either the old or the new log. Returns the
+ * new log open at its end, or NULL if the old log was kept.
+ */
+static FILE *compact_log(void) {
+    char tmp_path[MAX_PATH_LENGTH + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", log_path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        return NULL;
+    }
+    long long count = write_snapshot(file);
+    if (fflush(file) || fsync(fileno(file)) || rename(tmp_path, log_path)) {
+        fclose(file);
+        remove(tmp_path);
+        return NULL;
+    }
+    if (config->verbose) {
+        printf("Compacted %s from %lld to %lld records\n", log_path,
+               log_records, count);
+    }
+    log_records = count;
+    return file;
+}
+
+static long long live_records(void) {
+    long long count = option_count + state_count + name_count;
+    for (int i = 0; i < CHUNK_BUCKETS; i++) {
+        for (StoredChunk *c = chunks[i]; c; c = c->next) {
+            count += (c->key != 0) + c->blob.signs.size;
+            for (int layer = 0; layer < CHUNK_BLOB_LAYERS; layer++) {
+                count += c->blob.layers[layer].size;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * Compact the log once most of its records have been superseded, called
+ * with log_mtx held. Counting the live records walks the whole store, so
+ * the next check waits until the log has doubled the live count again.
+ */
+static void compact_superseded_log(void) {
+    mtx_lock(&store_mtx);
+    long long live = live_records();
+    if (log_records > 2 * live) {
+        FILE *file = compact_log();
+        if (file) {
+            fclose(log_file);
+            log_file = file;
+        }
+    }
+    log_compact_at = 2 * live;
+    if (log_compact_at < LOG_MIN_COMPACT_RECORDS) {
+        log_compact_at = LOG_MIN_COMPACT_RECORDS;
+    }
+    mtx_unlock(&store_mtx);
+}
+
+static void log_close(void) {
+    compact_superseded_log();
+    fclose(log_file);
+    log_file = NULL;
+    mtx_destroy(&log_mtx);
+    mem_close();
+}
+
+static void log_commit(void) {
+    mtx_lock(&log_mtx);
+    fflush(log_file);
+    if (log_records > log_compact_at) {
+        compact_superseded_log();
+    }
+    mtx_unlock(&log_mtx);
+}
+
+static void log_set_layer(int layer, int p, int q, int x, int y, int z, int w)
+{
+    mem_set_layer(layer, p, q, x, y, z, w);
+    LogRecord r;
+    record_start(&r, LOG_LAYER);
+    record_int(&r, layer);
+    record_int(&r, p);
+    record_int(&r, q);
+    record_int(&r, x);
+    record_int(&r, y);
+    record_int(&r, z);
+    record_int(&r, w);
+    append_record(&r);
+}
+
+static void log_set_sign(
+    int p, int q, int x, int y, int z, int face, const char *text)
+{
+    mem_set_sign(p, q, x, y, z, face, text);
+    LogRecord r;
+    record_start(&r, LOG_SIGN);
+    record_int(&r, p);
+    record_int(&r, q);
+    record_int(&r, x);
+    record_int(&r, y);
+    record_int(&r, z);
+    record_int(&r, face);
+    record_string(&r, text);
+    append_record(&r);
+}
+
+static void log_delete_sign(int x, int y, int z, int face) {
+    mem_delete_sign(x, y, z, face);
+    LogRecord r;
+    record_start(&r, LOG_DELETE_SIGN);
+    record_int(&r, x);
+    record_int(&r, y);
+    record_int(&r, z);
+    record_int(&r, face);
+    append_record(&r);
+}
+
+static void log_delete_signs(int x, int y, int z) {
+    mem_delete_signs(x, y, z);
+    LogRecord r;
+    record_start(&r, LOG_DELETE_SIGNS);
+    record_int(&r, x);
+    record_int(&r, y);
+    record_int(&r, z);
+    append_record(&r);
+}
+
+static void log_delete_all_signs(void) {
+    mem_delete_all_signs();
+    LogRecord r;
+    record_start(&r, LOG_DELETE_ALL_SIGNS);
+    append_record(&r);
+}
+
+static void log_set_key(int p, int q, int key) {
+    mem_set_key(p, q, key);
+    LogRecord r;
+    record_start(&r, LOG_KEY);
+    record_int(&r, p);
+    record_int(&r, q);
+    record_int(&r, key);
+    append_record(&r);
+}
+
+static void log_delete_all_keys(void) {
+    mem_delete_all_keys();
+    LogRecord r;
+    record_start(&r, LOG_DELETE_ALL_KEYS);
+    append_record(&r);
+}
+
+static void log_set_option(const char *name, const char *value) {
+    mem_set_option(name, value);
+    LogRecord r;
+    record_start(&r, LOG_OPTION);
+    record_string(&r, name);
+    record_string(&r, value);
+    append_record(&r);
+}
+
+static void log_clear_state(void) {
+    mem_clear_state();
+    LogRecord r;
+    record_start(&r, LOG_CLEAR_STATE);
+    append_record(&r);
+}
+
+static void log_save_state(float x, float y, float z, float rx, float ry) {
+    mem_save_state(x, y, z, rx, ry);
+    LogRecord r;
+    record_start(&r, LOG_STATE);
+    record_float(&r, x);
+    record_float(&r, y);
+    record_float(&r, z);
+    record_float(&r, rx);
+    record_float(&r, ry);
+    append_record(&r);
+}
+
+static void log_clear_player_names(void) {
+    mem_clear_player_names();
+    LogRecord r;
+    record_start(&r, LOG_CLEAR_NAMES);
+    append_record(&r);
+}
+
+static void log_save_player_name(const char *name) {
+    mem_save_player_name(name);
+    LogRecord r;
+    record_start(&r, LOG_NAME);
+    record_string(&r, name);
+    append_record(&r);
+}
+
+const StorageBackend log_storage = {
+    "log",
+    log_open,
+    log_close,
+    log_commit,
+    log_set_layer,
+    mem_get_light,
+    log_set_sign,
+    mem_get_sign,
+    log_delete_sign,
+    log_delete_signs,
+    log_delete_all_signs,
+    mem_load_chunk,
+    mem_get_key,
+    log_set_key,
+    log_delete_all_keys,
+    log_set_option,
+    mem_get_option,
+    log_clear_state,
+    log_save_state,
+    mem_load_state,
+    log_clear_player_names,
+    log_save_player_name,
+    mem_load_player_name,
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "db.h"
+#include "map.h"
+#include "sign.h"
+
+/*
+ * The functions a place to keep game data must provide. db.c passes its
+ * calls on to the backend named by --db-backend, layers are given in
+ * RingEntryType order (BLOCK to LIGHT).
+ */
+typedef struct {
+    const char *name;
+    int (*open)(const char *path);
+    void (*close)(void);
+    void (*commit)(void);
+    void (*set_layer)(int layer, int p, int q, int x, int y, int z, int w);
+    int (*get_light)(int p, int q, int x, int y, int z);
+    void (*set_sign)(
+        int p, int q, int x, int y, int z, int face, const char *text);
+    const unsigned char *(*get_sign)(
+        int p, int q, int x, int y, int z, int face);
+    void (*delete_sign)(int x, int y, int z, int face);
+    void (*delete_signs)(int x, int y, int z);
+    void (*delete_all_signs)(void);
+    void (*load_chunk)(
+        DbReader *reader, Map **maps, SignList *signs, int p, int q);
+    int (*get_key)(int p, int q);
+    void (*set_key)(int p, int q, int key);
+    void (*delete_all_keys)(void);
+    void (*set_option)(const char *name, const char *value);
+    const unsigned char *(*get_option)(const char *name);
+    void (*clear_state)(void);
+    void (*save_state)(float x, float y, float z, float rx, float ry);
+    int (*load_state)(
+        float *x, float *y, float *z, float *rx, float *ry, int player);
+    void (*clear_player_names)(void);
+    void (*save_player_name)(const char *name);
+    int (*load_player_name)(char *name, int max_name_length, int player);
+} StorageBackend;
+
+extern const StorageBackend memory_storage;
+extern const StorageBackend log_storage;
@@ -2,6 +2,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
@@ -170,12 +171,17 @@ GLuint make_program(GLuint shader1, GLuint shader2) {
 }
 
 GLuint load_program(const char *name) {
+    return load_program_shaders(name, name);
+}
+
+GLuint load_program_shaders(const char *vertex_name, const char *fragment_name)
+{
     char path1[MAX_PATH_LENGTH];
     char path2[MAX_PATH_LENGTH];
     snprintf(path1, MAX_PATH_LENGTH, "%s/shaders/%s_vertex.glsl",
-             data_dir, name);
+             data_dir, vertex_name);
     snprintf(path2, MAX_PATH_LENGTH, "%s/shaders/%s_fragment.glsl",
-             data_dir, name);
+             data_dir, fragment_name);
     GLuint shader1 = load_shader(GL_VERTEX_SHADER, path1);
     GLuint shader2 = load_shader(GL_FRAGMENT_SHADER, path2);
     GLuint program = make_program(shader1, shader2);
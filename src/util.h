@@ -46,6 +46,7 @@ GLuint make_shader(GLenum type, const char *source);
 GLuint load_shader(GLenum type, const char *path);
 GLuint make_program(GLuint shader1, GLuint shader2);
 GLuint load_program(const char *name);
+GLuint load_program_shaders(const char *vertex_name, const char *fragment_name);
 void load_png_texture(const char *file_name);
 void load_texture(const char *file_name);
 char *tokenize(char *str, const char *delim, char **key);
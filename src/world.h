@@ -2,6 +2,10 @@
 
 #define BEDROCK COLOR_11  // A Raspberry base
 
+// Raise with any change to the output of create_world, it is part of the
+// worldgen cache signature so cached chunks from older builds are not used
+#define WORLD_VERSION 1
+
 typedef void (*world_func)(int, int, int, int, void *);
 
 void create_world(int p, int q, world_func func, void *arg);
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chunk_blob.h"
+#include "sqlite3.h"
+#include "tinycthread.h"
+#include "worldgen_cache.h"
+
+/*
+ * On disk cache of generated chunks, before any saved changes are applied.
+ * Each row holds all the generated layers and signs of one chunk in the
+ * chunk_blob format, keyed by a signature of the worldgen that made it.
+ * Rows are stamped with a use counter when read or written, and the least
+ * recently used rows are deleted when the cache grows over its size limit.
+ */
+
+// Number of rows looked at for each eviction step
+#define EVICT_BATCH 64
+
+static sqlite3 *cache_db;
+static sqlite3_stmt *get_stmt;
+static sqlite3_stmt *put_stmt;
+static sqlite3_stmt *size_stmt;
+static sqlite3_stmt *touch_stmt;
+static sqlite3_stmt *oldest_stmt;
+static sqlite3_stmt *delete_stmt;
+static mtx_t cache_mtx;
+static char signature[MAX_WORLDGEN_SIGNATURE_LENGTH];
+static long long use_clock;
+static long long cache_size;
+static long long cache_max_size;
+
+static long long query_int64(const char *query) {
+    sqlite3_stmt *stmt;
+    long long result = 0;
+    if (sqlite3_prepare_v2(cache_db, query, -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            result = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return result;
+}
+
+/*
+ * Delete the least recently used rows until the cache is below 90% of its
+ * size limit.
+ */
+static void evict(void) {
+    if (cache_max_size <= 0 || cache_size <= cache_max_size) {
+        return;
+    }
+    long long target = cache_max_size / 10 * 9;
+    while (cache_size > target) {
+        int deleted = 0;
+        sqlite3_reset(oldest_stmt);
+        sqlite3_bind_int(oldest_stmt, 1, EVICT_BATCH);
+        while (cache_size > target &&
+               sqlite3_step(oldest_stmt) == SQLITE_ROW) {
+            sqlite3_reset(delete_stmt);
+            sqlite3_bind_int64(delete_stmt, 1,
+                               sqlite3_column_int64(oldest_stmt, 0));
+            sqlite3_step(delete_stmt);
+            cache_size -= sqlite3_column_int64(oldest_stmt, 1);
+            deleted++;
+        }
+        sqlite3_reset(oldest_stmt);
+        if (deleted == 0) {
+            cache_size = 0;
+            break;
+        }
+    }
+}
+
+/*
+ * Open the cache file at path. max_size is the size limit in bytes of the
+ * cached chunk data, or 0 for no limit.
+ */
+int worldgen_cache_open(const char *path, long long max_size) {
+    static const char *create_query =
+        "create table if not exists chunk ("
+        "    signature text not null,"
+        "    p int not null,"
+        "    q int not null,"
+        "    used int not null,"
+        "    data blob not null"
+        ");"
+        "create unique index if not exists chunk_pq_idx on chunk "
+        "    (signature, p, q);"
+        "create index if not exists chunk_used_idx on chunk (used);";
+    static const char *get_query =
+        "select rowid, data from chunk "
+        "where signature = ? and p = ? and q = ?;";
+    static const char *put_query =
+        "insert or replace into chunk (signature, p, q, used, data) "
+        "values (?, ?, ?, ?, ?);";
+    static const char *size_query =
+        "select length(data) from chunk "
+        "where signature = ? and p = ? and q = ?;";
+    static const char *touch_query =
+        "update chunk set used = ? where rowid = ?;";
+    static const char *oldest_query =
+        "select rowid, length(data) from chunk order by used limit ?;";
+    static const char *delete_query =
+        "delete from chunk where rowid = ?;";
+    if (cache_db) {
+        return 0;
+    }
+    int rc;
+    rc = sqlite3_open(path, &cache_db);
+    if (rc) goto fail;
+    // Losing the last writes after a crash only costs regenerating chunks
+    sqlite3_exec(cache_db, "pragma journal_mode = wal;"
+                 "pragma synchronous = normal;"
+                 "pragma mmap_size = 268435456;", NULL, NULL, NULL);
+    rc = sqlite3_exec(cache_db, create_query, NULL, NULL, NULL);
+    if (rc) goto fail;
+    rc = sqlite3_prepare_v2(cache_db, get_query, -1, &get_stmt, NULL);
+    if (rc) goto fail;
+    rc = sqlite3_prepare_v2(cache_db, put_query, -1, &put_stmt, NULL);
+    if (rc) goto fail;
+    rc = sqlite3_prepare_v2(cache_db, size_query, -1, &size_stmt, NULL);
+    if (rc) goto fail;
+    rc = sqlite3_prepare_v2(cache_db, touch_query, -1, &touch_stmt, NULL);
+    if (rc) goto fail;
+    rc = sqlite3_prepare_v2(cache_db, oldest_query, -1, &oldest_stmt, NULL);
+    if (rc) goto fail;
+    rc = sqlite3_prepare_v2(cache_db, delete_query, -1, &delete_stmt, NULL);
+    if (rc) goto fail;
+    mtx_init(&cache_mtx, mtx_plain);
+    use_clock = query_int64("select max(used) from chunk;");
+    cache_size = query_int64("select sum(length(data)) from chunk;");
+    cache_max_size = max_size;
+    sqlite3_exec(cache_db, "begin;", NULL, NULL, NULL);
+    evict();
+    return 0;
+fail:
+    printf("Could not open worldgen cache %s: %s\n", path,
+           sqlite3_errmsg(cache_db));
+    sqlite3_finalize(get_stmt);
+    sqlite3_finalize(put_stmt);
+    sqlite3_finalize(size_stmt);
+    sqlite3_finalize(touch_stmt);
+    sqlite3_finalize(oldest_stmt);
+    sqlite3_finalize(delete_stmt);
+    sqlite3_close(cache_db);
+    cache_db = NULL;
+    get_stmt = put_stmt = size_stmt = touch_stmt = NULL;
+    oldest_stmt = delete_stmt = NULL;
+    return rc;
+}
+
+void worldgen_cache_close(void) {
+    if (!cache_db) {
+        return;
+    }
+    sqlite3_exec(cache_db, "commit;", NULL, NULL, NULL);
+    sqlite3_finalize(get_stmt);
+    sqlite3_finalize(put_stmt);
+    sqlite3_finalize(size_stmt);
+    sqlite3_finalize(touch_stmt);
+    sqlite3_finalize(oldest_stmt);
+    sqlite3_finalize(delete_stmt);
+    sqlite3_close(cache_db);
+    mtx_destroy(&cache_mtx);
+    cache_db = NULL;
+    get_stmt = put_stmt = size_stmt = touch_stmt = NULL;
+    oldest_stmt = delete_stmt = NULL;
+}
+
+/*
+ * Set the signature of the current worldgen, the cache must not be in use
+ * by other threads when it is changed.
+ */
+void worldgen_cache_set_signature(const char *value) {
+    snprintf(signature, MAX_WORLDGEN_SIGNATURE_LENGTH, "%s", value);
+}
+
+/*
+ * Hash the contents of a file (64 bit FNV-1a), so edits to a worldgen
+ * script change the signature. Returns 0 if the file cannot be read.
+ */
+unsigned long long worldgen_cache_file_hash(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+    unsigned long long hash = 14695981039346656037ULL;
+    unsigned char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            hash = (hash ^ buffer[i]) * 1099511628211ULL;
+        }
+    }
+    fclose(file);
+    return hash;
+}
+
+/*
+ * Fill maps (indexed in RingEntryType order) and signs with the cached
+ * worldgen output for chunk (p, q). Returns 1 on a cache hit.
+ */
+int worldgen_cache_get(int p, int q, Map **maps, SignList *signs) {
+    if (!cache_db) {
+        return 0;
+    }
+    int hit = 0;
+    mtx_lock(&cache_mtx);
+    sqlite3_reset(get_stmt);
+    sqlite3_bind_text(get_stmt, 1, signature, -1, NULL);
+    sqlite3_bind_int(get_stmt, 2, p);
+    sqlite3_bind_int(get_stmt, 3, q);
+    if (sqlite3_step(get_stmt) == SQLITE_ROW) {
+        long long rowid = sqlite3_column_int64(get_stmt, 0);
+        const unsigned char *data = sqlite3_column_blob(get_stmt, 1);
+        int size = sqlite3_column_bytes(get_stmt, 1);
+        // Loading the signs checks the whole blob, so maps are only
+        // changed when it is valid
+        if (chunk_blob_load_signs(data, size, p, q, signs) == 0) {
+            chunk_blob_load_maps(data, size, p, q, maps);
+            hit = 1;
+        } else {
+            signs->size = 0;
+        }
+        sqlite3_reset(get_stmt);
+        if (hit) {
+            sqlite3_reset(touch_stmt);
+            sqlite3_bind_int64(touch_stmt, 1, ++use_clock);
+            sqlite3_bind_int64(touch_stmt, 2, rowid);
+            sqlite3_step(touch_stmt);
+        }
+    }
+    sqlite3_reset(get_stmt);
+    mtx_unlock(&cache_mtx);
+    return hit;
+}
+
+/*
+ * Store the worldgen output for chunk (p, q), returns the bytes stored.
+ */
+int worldgen_cache_put(int p, int q, Map **maps, SignList *signs) {
+    if (!cache_db) {
+        return 0;
+    }
+    ChunkBlob blob;
+    chunk_blob_alloc(&blob);
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        chunk_blob_add_map(&blob, i, maps[i]);
+    }
+    for (unsigned int i = 0; i < signs->size; i++) {
+        Sign *e = signs->data + i;
+        sign_list_add(&blob.signs, e->x, e->y, e->z, e->face, e->text);
+    }
+    int size;
+    unsigned char *data = chunk_blob_encode(&blob, p, q, &size);
+    chunk_blob_free(&blob);
+    mtx_lock(&cache_mtx);
+    // A row put again replaces the old one, which no longer counts
+    int replaced = 0;
+    sqlite3_reset(size_stmt);
+    sqlite3_bind_text(size_stmt, 1, signature, -1, NULL);
+    sqlite3_bind_int(size_stmt, 2, p);
+    sqlite3_bind_int(size_stmt, 3, q);
+    if (sqlite3_step(size_stmt) == SQLITE_ROW) {
+        replaced = sqlite3_column_int(size_stmt, 0);
+    }
+    sqlite3_reset(size_stmt);
+    sqlite3_reset(put_stmt);
+    sqlite3_bind_text(put_stmt, 1, signature, -1, NULL);
+    sqlite3_bind_int(put_stmt, 2, p);
+    sqlite3_bind_int(put_stmt, 3, q);
+    sqlite3_bind_int64(put_stmt, 4, ++use_clock);
+    sqlite3_bind_blob(put_stmt, 5, data, size, SQLITE_TRANSIENT);
+    int stored = 0;
+    if (sqlite3_step(put_stmt) == SQLITE_DONE) {
+        cache_size += size - replaced;
+        stored = size;
+        evict();
+    }
+    mtx_unlock(&cache_mtx);
+    free(data);
+    return stored;
+}
+
+void worldgen_cache_commit(void) {
+    if (!cache_db) {
+        return;
+    }
+    mtx_lock(&cache_mtx);
+    sqlite3_exec(cache_db, "commit; begin;", NULL, NULL, NULL);
+    mtx_unlock(&cache_mtx);
+}
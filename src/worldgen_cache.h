@@ -0,0 +1,15 @@
+#pragma once
+
+#include "map.h"
+#include "sign.h"
+
+#define WORLDGEN_CACHE_FILENAME "worldgen.cache"
+#define MAX_WORLDGEN_SIGNATURE_LENGTH 640
+
+int worldgen_cache_open(const char *path, long long max_size);
+void worldgen_cache_close(void);
+void worldgen_cache_set_signature(const char *signature);
+unsigned long long worldgen_cache_file_hash(const char *path);
+int worldgen_cache_get(int p, int q, Map **maps, SignList *signs);
+int worldgen_cache_put(int p, int q, Map **maps, SignList *signs);
+void worldgen_cache_commit(void);
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "chunk_blob.h"
+#include "config.h"
+#include "map.h"
+#include "sign.h"
+#include "world.h"
+#include "worldgen_cache.h"
+
+/*
+ * Times the default C worldgen against the worldgen cache, to check that
+ * caching its output is worth it. A square of chunks is generated and put
+ * in a new cache, then the cache is reopened and the chunks read back, and
+ * the average time per chunk of each step is printed.
+ *
+ *     make worldgen_cache_bench && ./worldgen_cache_bench [RADIUS [PATH]]
+ */
+
+#define BLOCK_MASK 0x3fff
+#define OTHER_MASK 0xf
+
+Config *config;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void map_set_func(int x, int y, int z, int w, void *arg) {
+    map_set(arg, x, y, z, w);
+}
+
+static void alloc_maps(Map *maps, Map **map_ptrs, int p, int q) {
+    int dx = p * CHUNK_SIZE - 1;
+    int dz = q * CHUNK_SIZE - 1;
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        map_alloc(maps + i, dx, 0, dz, i == 0 ? BLOCK_MASK : OTHER_MASK);
+        map_ptrs[i] = maps + i;
+    }
+}
+
+static void free_maps(Map *maps) {
+    for (int i = 0; i < CHUNK_BLOB_LAYERS; i++) {
+        map_free(maps + i);
+    }
+}
+
+static int open_cache(const char *path) {
+    if (worldgen_cache_open(path, 1024LL * 1024LL * 1024LL)) {
+        printf("Could not open: %s\n", path);
+        return 1;
+    }
+    worldgen_cache_set_signature("bench");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int radius = argc > 1 ? atoi(argv[1]) : 10;
+    const char *path = argc > 2 ? argv[2] : "worldgen_cache_bench.db";
+    Config c = {0};
+    config = &c;
+    config->show_trees = SHOW_TREES;
+    config->show_plants = SHOW_PLANTS;
+    config->show_clouds = SHOW_CLOUDS;
+    unlink(path);
+    if (open_cache(path)) {
+        return 1;
+    }
+    Map maps[CHUNK_BLOB_LAYERS];
+    Map *map_ptrs[CHUNK_BLOB_LAYERS];
+    SignList signs;
+    sign_list_alloc(&signs, 16);
+    double generate_time = 0;
+    double put_time = 0;
+    double get_time = 0;
+    long long bytes = 0;
+    int count = 0;
+    for (int p = -radius; p < radius; p++) {
+        for (int q = -radius; q < radius; q++) {
+            alloc_maps(maps, map_ptrs, p, q);
+            double start = now();
+            create_world(p, q, map_set_func, map_ptrs[0]);
+            generate_time += now() - start;
+            start = now();
+            bytes += worldgen_cache_put(p, q, map_ptrs, &signs);
+            put_time += now() - start;
+            free_maps(maps);
+            count++;
+        }
+    }
+    worldgen_cache_close();
+    if (open_cache(path)) {
+        return 1;
+    }
+    int hits = 0;
+    for (int p = -radius; p < radius; p++) {
+        for (int q = -radius; q < radius; q++) {
+            alloc_maps(maps, map_ptrs, p, q);
+            double start = now();
+            hits += worldgen_cache_get(p, q, map_ptrs, &signs);
+            get_time += now() - start;
+            signs.size = 0;
+            free_maps(maps);
+        }
+    }
+    worldgen_cache_close();
+    sign_list_free(&signs);
+    unlink(path);
+    printf("%d chunks, %lld bytes cached, %d read back\n", count, bytes, hits);
+    printf("create_world %.3fms, cache put %.3fms, cache get %.3fms "
+           "per chunk\n", generate_time * 1000 / count,
+           put_time * 1000 / count, get_time * 1000 / count);
+    return hits == count ? 0 : 1;
+}